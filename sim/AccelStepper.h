@@ -0,0 +1,126 @@
+#pragma once
+#include "application.h"
+
+// host simulation stand-in for AccelStepper (DRIVER interface only)
+// mirrors the constant speed behavior of the library (runSpeed / runSpeedToPosition)
+// including the integer step interval and the step timing relative to the time of the last step
+// (acceleration profiles are not modeled since StepperController does not use them)
+
+class AccelStepper {
+
+  public:
+
+    enum MotorInterfaceType { DRIVER = 1 };
+    enum Direction { DIRECTION_CCW = 0, DIRECTION_CW = 1 };
+
+  private:
+
+    uint8_t _step_pin = 0xff;
+    uint8_t _dir_pin = 0xff;
+    uint8_t _enable_pin = 0xff;
+    bool _step_inverted = false;
+    bool _dir_inverted = false;
+    bool _enable_inverted = false;
+    unsigned int _min_pulse_width = 1;
+
+    long _current_pos = 0;
+    long _target_pos = 0;
+    float _speed = 0.0;
+    float _max_speed = 1.0;
+    unsigned long _step_interval = 0;
+    unsigned long _last_step_time = 0;
+    bool _direction = DIRECTION_CW;
+
+    void setOutputPins(bool step, bool dir) {
+      digitalWrite(_step_pin, step ^ _step_inverted);
+      digitalWrite(_dir_pin, dir ^ _dir_inverted);
+    }
+
+    void step() {
+      setOutputPins(LOW, _direction);
+      setOutputPins(HIGH, _direction);
+      delayMicroseconds(_min_pulse_width);
+      setOutputPins(LOW, _direction);
+    }
+
+  public:
+
+    AccelStepper() {};
+    AccelStepper(uint8_t interface, uint8_t step_pin, uint8_t dir_pin) :
+      _step_pin(step_pin), _dir_pin(dir_pin) {
+      pinMode(_step_pin, OUTPUT);
+      pinMode(_dir_pin, OUTPUT);
+    };
+
+    void setEnablePin(uint8_t enable_pin) {
+      _enable_pin = enable_pin;
+      pinMode(_enable_pin, OUTPUT);
+      digitalWrite(_enable_pin, HIGH ^ _enable_inverted);
+    }
+
+    void setPinsInverted(bool dir_invert, bool step_invert, bool enable_invert) {
+      _dir_inverted = dir_invert;
+      _step_inverted = step_invert;
+      _enable_inverted = enable_invert;
+    }
+
+    void setMinPulseWidth(unsigned int min_width) { _min_pulse_width = min_width; }
+
+    void enableOutputs() {
+      pinMode(_step_pin, OUTPUT);
+      pinMode(_dir_pin, OUTPUT);
+      if (_enable_pin != 0xff) digitalWrite(_enable_pin, HIGH ^ _enable_inverted);
+    }
+
+    void disableOutputs() {
+      setOutputPins(LOW, LOW);
+      if (_enable_pin != 0xff) digitalWrite(_enable_pin, LOW ^ _enable_inverted);
+    }
+
+    void setMaxSpeed(float speed) { _max_speed = speed; }
+    float maxSpeed() { return(_max_speed); }
+
+    void setSpeed(float speed) {
+      if (speed == _speed) return;
+      speed = constrain(speed, -_max_speed, _max_speed);
+      if (speed == 0.0) {
+        _step_interval = 0;
+      } else {
+        _step_interval = fabs(1000000.0 / speed);
+        _direction = (speed > 0.0) ? DIRECTION_CW : DIRECTION_CCW;
+      }
+      _speed = speed;
+    }
+    float speed() { return(_speed); }
+
+    void moveTo(long absolute) { _target_pos = absolute; }
+    void move(long relative) { moveTo(_current_pos + relative); }
+    long distanceToGo() { return(_target_pos - _current_pos); }
+    long targetPosition() { return(_target_pos); }
+    long currentPosition() { return(_current_pos); }
+
+    void setCurrentPosition(long position) {
+      _target_pos = _current_pos = position;
+      _step_interval = 0;
+      _speed = 0.0;
+    }
+
+    bool runSpeed() {
+      if (!_step_interval) return(false);
+      unsigned long time = micros();
+      if (time - _last_step_time >= _step_interval) {
+        _current_pos += (_direction == DIRECTION_CW) ? 1 : -1;
+        step();
+        _last_step_time = time;
+        return(true);
+      }
+      return(false);
+    }
+
+    bool runSpeedToPosition() {
+      if (_target_pos == _current_pos) return(false);
+      _direction = (_target_pos > _current_pos) ? DIRECTION_CW : DIRECTION_CCW;
+      return(runSpeed());
+    }
+
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include "application.h"
+
+// host simulation stand-in for the LiquidCrystal_I2C_Spark library
+// keeps the panel content in memory and charges the virtual clock for the blocking I2C transfer
+// (PCF8574 backpack at 100kHz: 4 nibble writes per character ~ 0.5ms)
+
+#define SIM_LCD_US_PER_WRITE 500
+
+class LiquidCrystal_I2C {
+
+  private:
+
+    uint8_t cols = 20;
+    uint8_t rows = 4;
+    uint8_t col = 0;
+    uint8_t row = 0;
+
+  public:
+
+    char panel[4][21]; // what is currently shown on the display
+    unsigned long writes = 0; // number of blocking character/command transfers
+
+    LiquidCrystal_I2C(uint8_t addr, uint8_t cols, uint8_t rows) : cols(cols), rows(rows) {
+      clear();
+    }
+
+    void init() { transfer(); }
+    void begin(uint8_t cols, uint8_t rows) { transfer(); }
+    void backlight() { transfer(); }
+    void noBacklight() { transfer(); }
+    void display() { transfer(); }
+    void noDisplay() { transfer(); }
+
+    void clear() {
+      for (int i = 0; i < 4; i++) {
+        memset(panel[i], ' ', 20);
+        panel[i][20] = 0;
+      }
+      col = 0; row = 0;
+      transfer();
+    }
+
+    void home() { setCursor(0, 0); }
+
+    void setCursor(uint8_t c, uint8_t r) {
+      col = c; row = r;
+      transfer();
+    }
+
+    size_t write(uint8_t c) {
+      if (row < 4 && col < 20) panel[row][col] = c;
+      col++;
+      transfer();
+      return(1);
+    }
+
+    size_t print(const char* text) {
+      size_t n = 0;
+      while (text[n]) write(text[n++]);
+      return(n);
+    }
+    size_t print(const String& text) { return(print(text.c_str())); }
+    size_t print(char c) { return(write(c)); }
+
+  private:
+
+    void transfer() {
+      writes++;
+      sim.advance(SIM_LCD_US_PER_WRITE);
+    }
+
+};
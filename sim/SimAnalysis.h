@@ -0,0 +1,106 @@
+#pragma once
+#include <math.h>
+#include "SimHardware.h"
+
+// step trace analysis: achieved step rate, step timing jitter and position from the recorded pin edges
+
+struct SimStepStats {
+  unsigned long steps = 0; // number of step pulses
+  long position = 0; // net position (forward - backward steps)
+  double rate = 0; // achieved steps/s (from first to last step)
+  double interval_mean = 0; // mean step interval [us]
+  double interval_sd = 0; // step interval standard deviation [us]
+  uint64_t interval_min = 0; // shortest step interval [us]
+  uint64_t interval_max = 0; // longest step interval [us]
+  uint64_t first_step = 0; // time of first step [us]
+  uint64_t last_step = 0; // time of last step [us]
+};
+
+// analyze the step pulses in [from, to) - step_on: active level of the step pin, dir_forward: dir level for positive steps
+inline SimStepStats analyzeSteps(const std::vector<SimEdge>& edges, uint8_t step_pin, uint8_t step_on,
+    uint8_t dir_pin, uint8_t dir_forward, uint64_t from, uint64_t to) {
+
+  SimStepStats stats;
+  uint8_t dir = dir_forward;
+  double sum = 0, sum2 = 0;
+
+  for (const SimEdge& edge : edges) {
+    if (edge.pin == dir_pin) dir = edge.level;
+    if (edge.time < from || edge.time >= to) continue;
+    if (edge.pin != step_pin || edge.level != step_on) continue;
+    // step pulse
+    if (stats.steps > 0) {
+      uint64_t interval = edge.time - stats.last_step;
+      sum += interval;
+      sum2 += (double) interval * interval;
+      if (stats.steps == 1 || interval < stats.interval_min) stats.interval_min = interval;
+      if (interval > stats.interval_max) stats.interval_max = interval;
+    } else {
+      stats.first_step = edge.time;
+    }
+    stats.last_step = edge.time;
+    stats.steps++;
+    stats.position += (dir == dir_forward) ? 1 : -1;
+  }
+
+  if (stats.steps > 1) {
+    unsigned long n = stats.steps - 1;
+    stats.interval_mean = sum / n;
+    stats.interval_sd = sqrt(fmax(0.0, sum2 / n - stats.interval_mean * stats.interval_mean));
+    stats.rate = 1e6 / stats.interval_mean;
+  }
+
+  return(stats);
+}
+
+inline void printStepStats(const SimStepStats& stats, double expected_rate) {
+  printf("steps:          %lu (net position %ld)\n", stats.steps, stats.position);
+  printf("step rate:      %.4f steps/s (commanded %.4f steps/s, error %+.4f%%)\n",
+    stats.rate, expected_rate, expected_rate > 0 ? 100.0 * (stats.rate - expected_rate) / expected_rate : 0.0);
+  printf("step interval:  mean %.2fus, sd %.2fus, min %lluus, max %lluus (ideal %.2fus)\n",
+    stats.interval_mean, stats.interval_sd, (unsigned long long) stats.interval_min,
+    (unsigned long long) stats.interval_max, expected_rate > 0 ? 1e6 / expected_rate : 0.0);
+}
+
+// trigger edges (rising) that started the motor from standstill and the latency to the first step pulse
+#define SIM_TRIGGER_QUIET_US  50000 // standstill: no step pulse for this long before the edge
+
+struct SimTriggerStats {
+  unsigned long edges = 0; // rising trigger edges
+  unsigned long starts = 0; // of those, edges from standstill followed by a step pulse
+  double latency_mean = 0; // [us]
+  uint64_t latency_max = 0; // [us]
+};
+
+inline SimTriggerStats analyzeTrigger(const std::vector<SimEdge>& edges, uint8_t trigger_pin, uint8_t step_pin, uint8_t step_on,
+    uint64_t from, uint64_t to) {
+
+  SimTriggerStats stats;
+  double sum = 0;
+  bool waiting = false; // for the first step after a trigger edge
+  uint64_t edge_time = 0;
+  uint64_t last_step = 0;
+  bool stepped = false;
+
+  // pin interrupts run once the step interrupt returns, so the trigger edge is traced after the step pulses during it
+  for (const SimEdge& edge : edges) {
+    if (edge.pin == trigger_pin && edge.level && edge.time >= from && edge.time < to) {
+      stats.edges++;
+      waiting = !stepped || edge.time - last_step >= SIM_TRIGGER_QUIET_US;
+      edge_time = edge.time;
+    } else if (edge.pin == step_pin && edge.level == step_on) {
+      if (waiting && edge.time >= edge_time) {
+        uint64_t latency = edge.time - edge_time;
+        sum += latency;
+        if (latency > stats.latency_max) stats.latency_max = latency;
+        stats.starts++;
+        waiting = false;
+      }
+      last_step = edge.time;
+      stepped = true;
+    }
+  }
+
+  if (stats.starts > 0) stats.latency_mean = sum / stats.starts;
+  return(stats);
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <stdlib.h>
+#include "SimHardware.h"
+#include "../src/StepperConfig.h"
+
+// motor and shaft encoder model for the host simulation build
+// - the rotor follows the step pulses on the board's step pin (step size from the microstepping pins) unless it slips:
+//   - pull-out: above pullout_sps full steps/s the rotor loses sync and stays stalled until the steps slow down to half that
+//   - blocked: from block_at to block_until the rotor does not turn at all (e.g. an occluded tube)
+//   - random slip: each step is lost with probability slip (back pressure)
+// - the encoder outputs the quadrature edges as the rotor moves, one every SIM_MOTOR_EDGE_US after the step pulse
+// - the first lost step is recorded so benchmarks can measure how long the firmware takes to notice
+#define SIM_MOTOR_RESYNC  0.5 // stalled rotor catches on again below this fraction of the pull-out rate
+#define SIM_MOTOR_EDGE_US 20 // [us] between the encoder edges of one step
+
+struct SimEncoder {
+
+  // configuration
+  const StepperBoard* board = nullptr;
+  const StepperDriver* driver = nullptr;
+  const StepperEncoderConfig* encoder = nullptr;
+  int units_per_rotation = 0; // motor rotation in the finest mode's steps
+  double pullout_sps = 0; // [full steps/s] (0 = never)
+  double slip = 0; // probability per step
+  uint64_t block_at = 0; // [us] (0 = never)
+  uint64_t block_until = 0; // [us] (0 = for good)
+
+  // rotor
+  int64_t commanded = 0; // [units] position of the step pulses
+  int64_t rotor = 0; // [units] where the rotor actually is
+  int32_t count = 0; // encoder count
+  bool stalled = false;
+  uint64_t last_step = 0; // [us]
+  unsigned long steps = 0;
+  unsigned long lost = 0; // steps the rotor did not follow
+  uint64_t first_lost = 0; // [us] time of the first lost step
+  int64_t first_lost_commanded = 0; // [units] commanded position before the first lost step
+
+  // watch the board's pins and drive the encoder's (replaces any other model)
+  void attach(const StepperBoard* board, const StepperDriver* driver, const StepperEncoderConfig* encoder, int full_steps) {
+    this->board = board;
+    this->driver = driver;
+    this->encoder = encoder;
+    units_per_rotation = full_steps * driver->getFullStepUnits();
+    sim.write_hook = hook;
+    output();
+  }
+
+  static void hook(uint8_t pin, uint8_t level);
+
+  // units per step of the mode the ms pins select
+  int getStepUnits() {
+    for (int i = 0; i < driver->ms_modes_n; i++) {
+      if (sim.read(board->ms1) == driver->ms_modes[i].ms1 && sim.read(board->ms2) == driver->ms_modes[i].ms2 &&
+          sim.read(board->ms3) == driver->ms_modes[i].ms3) return(driver->getStepUnits(i));
+    }
+    return(1);
+  }
+
+  void step() {
+    int units = getStepUnits();
+    int dir = (sim.read(board->dir) == (driver->dir_cw ? 0 : 1)) ? 1 : -1; // same pin inversion as StepperController::init()
+    uint64_t interval = sim.now - last_step;
+    double full_sps = (steps > 0 && interval > 0) ? 1.0e6 * units / driver->getFullStepUnits() / interval : 0;
+    last_step = sim.now;
+    steps++;
+
+    // does the rotor follow?
+    if (pullout_sps > 0) {
+      if (full_sps > pullout_sps) stalled = true;
+      else if (full_sps < SIM_MOTOR_RESYNC * pullout_sps) stalled = false;
+    }
+    bool blocked = block_at > 0 && sim.now >= block_at && (block_until == 0 || sim.now < block_until);
+    bool slipped = slip > 0 && rand() < slip * ((double) RAND_MAX + 1);
+    if (stalled || blocked || slipped) {
+      if (lost++ == 0) {
+        first_lost = sim.now;
+        first_lost_commanded = commanded;
+      }
+    } else {
+      rotor += dir * units;
+    }
+    commanded += dir * units;
+    output();
+  }
+
+  // quadrature edges one count at a time up to the rotor's count (00 -> 10 -> 11 -> 01 in the positive direction)
+  void output() {
+    if (!encoder) return;
+    int64_t counts = rotor * encoder->counts;
+    int32_t target = (counts >= 0 ? counts : counts - units_per_rotation + 1) / units_per_rotation; // floor
+    if (encoder->inverted) target = -target;
+    uint64_t time = sim.now;
+    while (count != target) {
+      count += (count < target) ? 1 : -1;
+      uint8_t phase = count & 3;
+      time += SIM_MOTOR_EDGE_US;
+      sim.drive(encoder->a, phase == 1 || phase == 2, time);
+      sim.drive(encoder->b, phase >= 2, time);
+    }
+  }
+
+};
+
+// the one and only motor
+static SimEncoder sim_motor;
+
+void SimEncoder::hook(uint8_t pin, uint8_t level) {
+  if (pin == sim_motor.board->step && level == sim_motor.driver->step_on) sim_motor.step();
+}
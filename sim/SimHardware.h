@@ -0,0 +1,238 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// virtual hardware for the host simulation build
+// - virtual clock (micros/millis only advance when the simulation advances them)
+// - pin levels and a timestamped trace of every pin edge
+// - hardware timer interrupts that fire on the virtual clock, optionally delayed by periodic interrupt load (higher
+//   priority interrupts such as the radio stack)
+// - pin change interrupts and square wave signal sources on input pins (e.g. an external trigger)
+// - hooks for models of the attached hardware (e.g. motor and encoder, see SimEncoder.h): they watch the output pins
+//   and schedule edges on input pins
+// - emulated EEPROM
+
+#define SIM_PINS_N      32
+#define SIM_EEPROM_SIZE 2048
+#define SIM_TIMERS_N    4
+#define SIM_SIGNALS_N   2
+#define SIM_RISING      1 // pin interrupt modes (bits)
+#define SIM_FALLING     2
+
+// single pin edge (only recorded when the level actually changes)
+struct SimEdge {
+  uint64_t time; // virtual time [us]
+  uint8_t pin; // pin number
+  uint8_t level; // new level (HIGH or LOW)
+};
+
+// periodic timer interrupt
+struct SimTimer {
+  bool active = false;
+  uint64_t next = 0; // virtual time of the next interrupt [us]
+  uint32_t period = 0; // [us]
+  void (*isr)() = nullptr;
+};
+
+// pin change interrupt
+struct SimPinInterrupt {
+  void (*isr)() = nullptr;
+  uint8_t edges = 0; // SIM_RISING and/or SIM_FALLING
+};
+
+// square wave driving an input pin (edges at exact virtual times, high first)
+struct SimSignal {
+  bool active = false;
+  uint8_t pin = 0;
+  uint64_t next = 0; // virtual time of the next edge [us]
+  uint32_t high = 0; // [us]
+  uint32_t low = 0; // [us]
+};
+
+struct SimHardware {
+
+  // clock
+  uint64_t now = 0; // virtual time since boot [us]
+
+  // pins
+  uint8_t pin_mode[SIM_PINS_N] = {};
+  uint8_t pin_level[SIM_PINS_N] = {};
+  bool trace_on = true;
+  std::vector<SimEdge> edges;
+
+  // pin interrupts and signals
+  SimPinInterrupt pin_interrupts[SIM_PINS_N];
+  SimSignal signals[SIM_SIGNALS_N];
+
+  // hardware models: called for every output level change (in the context of the writer), drive inputs with scheduled edges
+  void (*write_hook)(uint8_t pin, uint8_t level) = nullptr;
+  std::vector<SimEdge> inputs; // scheduled input edges in time order
+
+  // timers
+  SimTimer timers[SIM_TIMERS_N];
+  bool in_isr = false; // interrupts do not nest
+  unsigned long interrupts = 0; // number of serviced interrupts
+
+  // interrupt load: timer interrupts are held off for mask_us of every mask_period_us (0 = never)
+  uint32_t mask_period_us = 0;
+  uint32_t mask_us = 0;
+
+  // eeprom
+  uint8_t eeprom[SIM_EEPROM_SIZE];
+
+  SimHardware() {
+    memset(eeprom, 0xff, sizeof(eeprom)); // erased flash
+  }
+
+  // advance the virtual clock
+  void advance(uint64_t us) {
+    advanceTo(now + us);
+  }
+
+  // advance the virtual clock to an absolute time (never goes backwards)
+  // and service all timer interrupts, signal edges and scheduled input edges that become due on the way (in time order,
+  // an edge during an interrupt is traced at its time, the level and pin interrupt follow once the running interrupt returns)
+  void advanceTo(uint64_t time) {
+    while (!in_isr) {
+      SimTimer* due = nullptr;
+      uint64_t due_at = 0;
+      for (SimTimer& timer : timers) {
+        uint64_t at = unmasked(timer.next);
+        if (timer.active && at <= time && (!due || at < due_at)) {
+          due = &timer;
+          due_at = at;
+        }
+      }
+      SimSignal* edge = nullptr;
+      for (SimSignal& signal : signals) {
+        if (signal.active && signal.next <= time && (!edge || signal.next < edge->next)) edge = &signal;
+      }
+      if (!inputs.empty() && inputs.front().time <= time && (!edge || inputs.front().time < edge->next) &&
+          (!due || inputs.front().time <= due_at)) {
+        SimEdge input = inputs.front();
+        inputs.erase(inputs.begin());
+        if (input.time > now) now = input.time;
+        if (pin_level[input.pin] != input.level) {
+          pin_level[input.pin] = input.level;
+          if (trace_on) edges.push_back(input);
+          pinInterrupt(input.pin, input.level);
+        }
+        continue;
+      }
+      if (edge && (!due || edge->next <= due_at)) {
+        if (edge->next > now) now = edge->next;
+        input(edge);
+        continue;
+      }
+      if (!due) break;
+      if (due_at > now) now = due_at;
+      due->next += due->period;
+      interrupt(due->isr);
+    }
+    if (time > now) now = time;
+  }
+
+  // earliest time an interrupt due at time can run
+  uint64_t unmasked(uint64_t time) {
+    if (mask_period_us == 0) return(time);
+    uint64_t phase = time % mask_period_us;
+    return(phase < mask_us ? time - phase + mask_us : time);
+  }
+
+  void interrupt(void (*isr)()) {
+    in_isr = true;
+    interrupts++;
+    isr();
+    in_isr = false;
+  }
+
+  // square wave on an input pin from start [us]: high for high_us of every period_us
+  SimSignal* startSignal(uint8_t pin, uint32_t period_us, uint32_t high_us, uint64_t start) {
+    if (pin >= SIM_PINS_N || high_us == 0 || high_us >= period_us) return(nullptr);
+    for (SimSignal& signal : signals) {
+      if (!signal.active) {
+        signal.active = true;
+        signal.pin = pin;
+        signal.next = start > now ? start : now;
+        signal.high = high_us;
+        signal.low = period_us - high_us;
+        return(&signal);
+      }
+    }
+    return(nullptr);
+  }
+
+  // apply the signal's next edge (traced at its own time) and run the pin interrupt
+  void input(SimSignal* signal) {
+    uint8_t level = pin_level[signal->pin] ? 0 : 1;
+    pin_level[signal->pin] = level;
+    if (trace_on) edges.push_back({signal->next, signal->pin, level});
+    signal->next += level ? signal->high : signal->low;
+    pinInterrupt(signal->pin, level);
+  }
+
+  // edge on an input pin at a (future) time, from a hardware model
+  void drive(uint8_t pin, uint8_t level, uint64_t time) {
+    if (pin >= SIM_PINS_N) return;
+    SimEdge input = {time, pin, (uint8_t) (level ? 1 : 0)};
+    auto at = inputs.end();
+    while (at != inputs.begin() && (at - 1)->time > time) at--;
+    inputs.insert(at, input);
+  }
+
+  void pinInterrupt(uint8_t pin, uint8_t level) {
+    SimPinInterrupt* pin_interrupt = &pin_interrupts[pin];
+    if (pin_interrupt->isr && (pin_interrupt->edges & (level ? SIM_RISING : SIM_FALLING))) interrupt(pin_interrupt->isr);
+  }
+
+  // timer interrupts
+  SimTimer* startTimer(void (*isr)(), uint32_t period) {
+    for (SimTimer& timer : timers) {
+      if (!timer.active) {
+        timer.active = true;
+        timer.isr = isr;
+        setTimerPeriod(&timer, period);
+        return(&timer);
+      }
+    }
+    return(nullptr);
+  }
+
+  // (re)starts the count from now, like the hardware does on a period reset
+  void setTimerPeriod(SimTimer* timer, uint32_t period) {
+    timer->period = period > 0 ? period : 1;
+    timer->next = now + timer->period;
+  }
+
+  // write a pin and trace the edge if the level changed
+  void write(uint8_t pin, uint8_t level) {
+    if (pin >= SIM_PINS_N) return;
+    level = level ? 1 : 0;
+    if (pin_level[pin] != level) {
+      pin_level[pin] = level;
+      if (trace_on) edges.push_back({now, pin, level});
+      if (write_hook) write_hook(pin, level);
+    }
+  }
+
+  uint8_t read(uint8_t pin) {
+    return(pin < SIM_PINS_N ? pin_level[pin] : 0);
+  }
+
+  // write the edge trace as csv (time_us,pin,level)
+  bool saveTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return(false);
+    fprintf(file, "time_us,pin,level\n");
+    for (const SimEdge& edge : edges)
+      fprintf(file, "%llu,%d,%d\n", (unsigned long long) edge.time, edge.pin, edge.level);
+    fclose(file);
+    return(true);
+  }
+
+};
+
+// the one and only virtual board
+static SimHardware sim;
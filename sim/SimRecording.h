@@ -0,0 +1,125 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "SimHardware.h"
+
+// command recordings and pin traces for replaying and comparing firmware revisions
+// - recordings are the R: lines the firmware prints on serial with 'record on' (see StepperController::parseCommand()),
+//   a raw serial log works as is (everything before "R:" and lines without it are skipped)
+// - times are relative to the first recorded line (the state when the recording started), a replay schedules the
+//   commands at the same virtual times after boot
+// - pin traces are the csv files of pump_sim -t (time_us,pin,level)
+
+struct SimRecordedCommand {
+  uint64_t time; // [us] since the start of the recording
+  int ret; // return code
+  std::string command;
+};
+
+struct SimRecordedState {
+  uint64_t time; // [us] since the start of the recording
+  std::string state; // state information
+};
+
+struct SimRecording {
+  std::vector<SimRecordedCommand> commands;
+  std::vector<SimRecordedState> states;
+};
+
+// R: lines of a text (serial log or captured serial output)
+inline SimRecording parseRecording(const std::string& text) {
+  SimRecording recording;
+  bool started = false;
+  unsigned long start = 0;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) end = text.size();
+    std::string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    size_t r = line.find("R:");
+    if (r == std::string::npos) continue;
+    char* next;
+    unsigned long ms = strtoul(line.c_str() + r + 2, &next, 10);
+    if (*next != ',') continue;
+    if (!started) {
+      start = ms;
+      started = true;
+    }
+    uint64_t time = (uint64_t) (unsigned long) (ms - start) * 1000; // millis() wraps around
+    if (strncmp(next, ",cmd,", 5) == 0) {
+      int ret = strtol(next + 5, &next, 10);
+      if (*next == ',') recording.commands.push_back({time, ret, next + 1});
+    } else if (strncmp(next, ",state,", 7) == 0) {
+      recording.states.push_back({time, next + 7});
+    }
+  }
+  return(recording);
+}
+
+inline bool loadRecording(const char* path, SimRecording* recording) {
+  FILE* file = fopen(path, "r");
+  if (!file) return(false);
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, n);
+  fclose(file);
+  *recording = parseRecording(text);
+  return(true);
+}
+
+// the state information's settings: without the fields that measure the motion (odometer, volume, step timing,
+// run and program progress, encoder error, step rate limit) and without the trigger latency, which differ between the pump and a replay
+inline std::string getStateSettings(const std::string& state) {
+  static const char* measured[] = {"odo", "vol", "late", "run", "enc", "limit", "prog"};
+  std::string settings;
+  bool skip_units = false;
+  size_t pos = 0;
+  // flat json of "key":"value" pairs
+  while ((pos = state.find('"', pos)) != std::string::npos) {
+    size_t key_end = state.find('"', pos + 1);
+    size_t value_start = (key_end == std::string::npos) ? std::string::npos : state.find('"', key_end + 1);
+    size_t value_end = (value_start == std::string::npos) ? std::string::npos : state.find('"', value_start + 1);
+    if (value_end == std::string::npos) break;
+    std::string key = state.substr(pos + 1, key_end - pos - 1);
+    std::string value = state.substr(value_start + 1, value_end - value_start - 1);
+    pos = value_end + 1;
+    bool skip = (key == "units") ? skip_units : false;
+    for (const char* field : measured) if (key == field) skip = true;
+    skip_units = skip && key != "units"; // units belong to the field before them
+    if (skip) continue;
+    if (key == "trig" && value.find(" <") != std::string::npos) value.erase(value.find(" <"));
+    settings += (settings.empty() ? "" : ",") + key + ":" + value;
+  }
+  return(settings);
+}
+
+// state changes as settings, leaving out the ones that only changed measured fields
+inline std::vector<SimRecordedState> getSettingChanges(const std::vector<SimRecordedState>& states) {
+  std::vector<SimRecordedState> changes;
+  for (const SimRecordedState& state : states) {
+    std::string settings = getStateSettings(state.state);
+    if (changes.empty() || changes.back().state != settings) changes.push_back({state.time, settings});
+  }
+  return(changes);
+}
+
+// pin trace saved by SimHardware::saveTrace()
+inline bool loadTrace(const char* path, std::vector<SimEdge>* edges) {
+  FILE* file = fopen(path, "r");
+  if (!file) return(false);
+  char line[100];
+  unsigned long long time;
+  int pin, level;
+  edges->clear();
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%llu,%d,%d", &time, &pin, &level) == 3) edges->push_back({(uint64_t) time, (uint8_t) pin, (uint8_t) level});
+  }
+  fclose(file);
+  return(true);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "application.h"
+
+// host simulation stand-in for the SparkIntervalTimer library
+// the interrupts are serviced by the virtual clock (see SimHardware::advanceTo)
+
+enum { uSec, hmSec };
+enum TIMid { TIMER3, TIMER4, TIMER5, TIMER6, TIMER7, AUTO = 255 };
+
+class IntervalTimer {
+
+  private:
+
+    SimTimer* timer = nullptr;
+
+    static uint32_t toMicros(uint16_t period, bool scale) {
+      return(scale == hmSec ? period * 500UL : period);
+    }
+
+  public:
+
+    bool begin(void (*isr)(), uint16_t period, bool scale, TIMid id = AUTO) {
+      if (timer) end();
+      timer = sim.startTimer(isr, toMicros(period, scale));
+      return(timer != nullptr);
+    }
+
+    void resetPeriod_SIT(uint16_t period, bool scale) {
+      if (timer) sim.setTimerPeriod(timer, toMicros(period, scale));
+    }
+
+    void end() {
+      if (timer) timer->active = false;
+      timer = nullptr;
+    }
+
+};
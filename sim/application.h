@@ -0,0 +1,306 @@
+#pragma once
+
+// Linux stand-in for the Particle HAL (application.h) used by the host simulation build
+// only covers what the stepper pump firmware needs, all timing runs on the virtual clock in SimHardware.h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "SimHardware.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+/**** PINS ****/
+
+#define LOW           0
+#define HIGH          1
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define INPUT_PULLDOWN 3
+
+#define D0  0
+#define D1  1
+#define D2  2
+#define D3  3
+#define D4  4
+#define D5  5
+#define D6  6
+#define D7  7
+#define A0  10
+#define A1  11
+#define A2  12
+#define A3  13
+#define A4  14
+#define A5  15
+#define A6  16
+#define A7  17
+
+inline void pinMode(uint16_t pin, uint8_t mode) { if (pin < SIM_PINS_N) sim.pin_mode[pin] = mode; }
+inline void digitalWrite(uint16_t pin, uint8_t value) { sim.write(pin, value); }
+inline int32_t digitalRead(uint16_t pin) { return(sim.read(pin)); }
+inline void digitalWriteFast(uint16_t pin, uint8_t value) { sim.write(pin, value); }
+inline void pinSetFast(uint16_t pin) { sim.write(pin, HIGH); }
+inline void pinResetFast(uint16_t pin) { sim.write(pin, LOW); }
+inline int32_t pinReadFast(uint16_t pin) { return(sim.read(pin)); }
+
+/**** TIMING ****/
+
+inline unsigned long micros() { return((unsigned long) sim.now); }
+inline unsigned long millis() { return((unsigned long) (sim.now / 1000)); }
+inline void delayMicroseconds(unsigned int us) { sim.advance(us); }
+inline void delay(unsigned long ms) { sim.advance(ms * 1000); }
+
+/**** INTERRUPTS ****/
+
+// timer and pin interrupts only fire while the virtual clock advances, which never happens inside a critical section
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+enum InterruptMode { CHANGE, RISING, FALLING };
+
+inline bool attachInterrupt(uint16_t pin, void (*isr)(), InterruptMode mode, int8_t priority = -1, uint8_t subpriority = 0) {
+  if (pin >= SIM_PINS_N) return(false);
+  sim.pin_interrupts[pin].isr = isr;
+  sim.pin_interrupts[pin].edges = (mode == RISING) ? SIM_RISING : (mode == FALLING) ? SIM_FALLING : SIM_RISING | SIM_FALLING;
+  return(true);
+}
+
+inline void detachInterrupt(uint16_t pin) {
+  if (pin < SIM_PINS_N) sim.pin_interrupts[pin] = SimPinInterrupt();
+}
+
+/**** SYSTEM ****/
+
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+#define SEMI_AUTOMATIC 1
+#define ENABLED 1
+
+#ifndef constrain
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+
+/**** STRING ****/
+
+class String {
+  private:
+    std::string s;
+  public:
+    String() {}
+    String(const char* cstr) : s(cstr ? cstr : "") {}
+    String(const std::string& str) : s(str) {}
+    const char* c_str() const { return(s.c_str()); }
+    unsigned int length() const { return(s.length()); }
+    void toCharArray(char* buf, unsigned int size) const { snprintf(buf, size, "%s", s.c_str()); }
+    String& operator+=(const char* cstr) { s += cstr; return(*this); }
+    bool operator==(const char* cstr) const { return(s == cstr); }
+};
+
+/**** STREAMS ****/
+
+// byte stream on a non-blocking file descriptor (serial pty, TCP socket), not attached if fd < 0
+class Stream {
+  public:
+    int fd = -1;
+    int available() {
+      struct pollfd p = {fd, POLLIN, 0};
+      return(fd >= 0 && poll(&p, 1, 0) > 0 && (p.revents & POLLIN) ? 1 : 0);
+    }
+    int read() {
+      uint8_t c;
+      return(fd >= 0 && ::read(fd, &c, 1) == 1 ? c : -1);
+    }
+    size_t write(const uint8_t* buffer, size_t size) {
+      return(fd >= 0 && ::write(fd, buffer, size) > 0 ? size : 0);
+    }
+    void printf(const char* format, ...) {
+      if (fd < 0) return;
+      va_list args;
+      va_start(args, format);
+      vdprintf(fd, format, args);
+      va_end(args);
+    }
+};
+
+/**** SERIAL ****/
+
+// USB serial: stdout (echo) and the pty attached by the simulation (fd, if any)
+class SimSerial : public Stream {
+  private:
+    void output(const char* text) {
+      if (fd >= 0) write((const uint8_t*) text, strlen(text));
+      if (echo) fputs(text, stdout);
+      if (capture) capture->append(text);
+    }
+  public:
+    bool echo = true; // print to stdout
+    std::string* capture = nullptr; // also collect the output (e.g. the firmware's recorder lines)
+    void begin(long baud) {}
+    void printf(const char* format, ...) {
+      char buffer[1024];
+      va_list args;
+      va_start(args, format);
+      vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+      output(buffer);
+    }
+    void print(const char* text) { output(text); }
+    void print(const String& text) { print(text.c_str()); }
+    void print(int value) { printf("%d", value); }
+    void print(double value) { printf("%.2f", value); }
+    void println() { output("\n"); }
+    void println(const char* text) { printf("%s\n", text); }
+    void println(const String& text) { println(text.c_str()); }
+    void println(int value) { printf("%d\n", value); }
+    void println(double value) { printf("%.2f\n", value); }
+};
+
+static SimSerial Serial;
+
+/**** EEPROM ****/
+
+class SimEEPROM {
+  public:
+    template <typename T> T& get(int address, T& t) {
+      memcpy((void*) &t, sim.eeprom + address, sizeof(T));
+      return(t);
+    }
+    template <typename T> const T& put(int address, const T& t) {
+      memcpy(sim.eeprom + address, (const void*) &t, sizeof(T));
+      return(t);
+    }
+    uint8_t read(int address) { return(sim.eeprom[address]); }
+    void write(int address, uint8_t value) { sim.eeprom[address] = value; }
+    size_t length() { return(SIM_EEPROM_SIZE); }
+};
+
+static SimEEPROM EEPROM;
+
+/**** CLOUD ****/
+
+// cloud functions are registered here so the simulation can call them like the cloud would
+struct SimCloudFunction {
+  std::string name;
+  std::function<int(String)> call;
+};
+
+class SimParticle {
+  public:
+    std::vector<SimCloudFunction> functions;
+    bool cloud_connected = false;
+    int published = 0;
+
+    template <typename T> bool function(const char* name, int (T::*handler)(String), T* instance) {
+      functions.push_back({name, [handler, instance](String arg) { return((instance->*handler)(arg)); }});
+      return(true);
+    }
+    bool function(const char* name, int (*handler)(String)) {
+      functions.push_back({name, handler});
+      return(true);
+    }
+    template <typename T> bool variable(const char* name, T* var) { return(true); }
+    template <typename T> bool variable(const char* name, const T* var) { return(true); }
+    bool publish(const char* name, const char* data = nullptr, ...) { published++; return(cloud_connected); }
+    bool publish(const String& name, const String& data, ...) { published++; return(cloud_connected); }
+    void connect() { cloud_connected = true; }
+    void disconnect() { cloud_connected = false; }
+    bool connected() { return(cloud_connected); }
+    void process() {}
+    bool syncTime() { return(true); }
+
+    // call a registered cloud function (first registered one if name is null)
+    int call(const char* name, const char* arg) {
+      for (SimCloudFunction& f : functions) {
+        if (!name || f.name == name) return(f.call(String(arg)));
+      }
+      return(-1);
+    }
+};
+
+static SimParticle Particle;
+
+#define PRIVATE 0
+#define PUBLIC 1
+
+/**** NETWORK ****/
+
+class SimWiFi {
+  public:
+    bool ready() { return(true); }
+};
+
+static SimWiFi WiFi;
+
+// TCP on the host's loopback interface (non-blocking sockets)
+class TCPClient : public Stream {
+  public:
+    TCPClient() {}
+    TCPClient(int fd) { this->fd = fd; }
+    bool connected() {
+      // peer closed once a readable socket has no data
+      char c;
+      if (fd < 0) return(false);
+      ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      return(n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)));
+    }
+    void stop() {
+      if (fd >= 0) close(fd);
+      fd = -1;
+    }
+};
+
+class TCPServer {
+  private:
+    uint16_t port;
+    int fd = -1;
+  public:
+    TCPServer(uint16_t port) : port(port) {}
+    bool begin() {
+      fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      struct sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_port = htons(port);
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        return(false);
+      }
+      return(true);
+    }
+    // newly connected client (not connected if there is none)
+    TCPClient available() {
+      return(TCPClient(fd >= 0 ? accept4(fd, nullptr, nullptr, SOCK_NONBLOCK) : -1));
+    }
+};
+
+class SimTime {
+  public:
+    long now() { return((long) (sim.now / 1000000)); }
+    bool isValid() { return(true); }
+    String format(long t, const char* format = nullptr) {
+      char buffer[20];
+      snprintf(buffer, sizeof(buffer), "%lds", t);
+      return(String(buffer));
+    }
+};
+
+static SimTime Time;
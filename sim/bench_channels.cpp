@@ -0,0 +1,57 @@
+// host benchmark: step engines of several motor channels sharing the step scheduler's timer interrupt
+// runs 1 to STEPPER_SCHEDULER_TASKS_MAX engines at different step rates and reports the interrupts per step,
+// host time per interrupt and the step timing (virtual time, step pulses of engines due together delay each other)
+// build: make sim, usage: sim/bench_channels [-s seconds]
+
+#include "application.h"
+#include <chrono>
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+
+// step rates [steps/s] of the channels (added one at a time), pins of separate boards
+static const double RATES[STEPPER_SCHEDULER_TASKS_MAX] = {8000, 3000, 1234.5, 200};
+static const int PINS[STEPPER_SCHEDULER_TASKS_MAX][3] = {{D3, D2, D7}, {A1, A0, A2}, {D1, D0, A3}, {A7, A6, A4}};
+
+int main(int argc, char** argv) {
+
+  double seconds = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    switch (opt) {
+      case 's': seconds = atof(optarg); break;
+      default:
+        printf("usage: bench_channels [-s virtual seconds (default 10)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  sim.trace_on = false;
+  printf("%.0f virtual seconds per run\n%9s %12s %12s %12s %12s %12s\n", seconds,
+    "channels", "steps/s", "irq/step", "ns/irq", "late steps", "max late us");
+  for (int n = 1; n <= STEPPER_SCHEDULER_TASKS_MAX; n++) {
+    StepperEngine engines[STEPPER_SCHEDULER_TASKS_MAX];
+    for (int i = 0; i < n; i++) {
+      engines[i].init(PINS[i][0], PINS[i][1], PINS[i][2]);
+      engines[i].setMaxSpeed(STEPPER_ENGINE_MAX_SPEED);
+      engines[i].runInterval(StepperEngine::getIntervalForSpeed(RATES[i] * 60.0), 1);
+    }
+    unsigned long interrupts = sim.interrupts;
+    auto start = std::chrono::steady_clock::now();
+    sim.advance((uint64_t) (seconds * 1e6));
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    interrupts = sim.interrupts - interrupts;
+    unsigned long steps = 0, late = 0, max_late = 0;
+    for (int i = 0; i < n; i++) {
+      engines[i].stop();
+      StepTimingStats* timing = engines[i].getTiming();
+      steps += timing->steps;
+      late += timing->late;
+      if (timing->max_late > max_late) max_late = timing->max_late;
+    }
+    printf("%9d %12.0f %12.3f %12.1f %12lu %12lu\n", n, steps / seconds, (double) interrupts / steps, ns / interrupts, late, max_late);
+  }
+
+  return(0);
+}
@@ -0,0 +1,79 @@
+// host benchmark: command parse + dispatch cost
+// compares the hashed command table lookup with trying every command in turn (the previous parser cascade)
+// and times complete cloud calls (parse, dispatch, handler and state information update) per command
+// build: make sim, usage: sim/bench_commands [-n repeats]
+
+#include "application.h"
+#include "../src/pump.cpp"
+#include <chrono>
+#include <unistd.h>
+
+// previous parser order (status, direction, speed, ramp, dispense, calibrate, ms, timing)
+static const char* CASCADE[] = {CMD_START, CMD_STOP, CMD_HOLD, CMD_RUN, CMD_AUTO, CMD_ROTATE, CMD_DIR, CMD_SPEED,
+  CMD_RAMP, CMD_DISPENSE, CMD_SET, CMD_STEP, CMD_TIMING};
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+  return(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+}
+
+static int findInCascade(const char* variable) {
+  for (int i = 0; i < (int) (sizeof(CASCADE) / sizeof(CASCADE[0])); i++) {
+    if (strcmp(variable, CASCADE[i]) == 0) return(i);
+  }
+  return(-1);
+}
+
+int main(int argc, char** argv) {
+
+  long repeats = 1000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n': repeats = atol(optarg); break;
+      default:
+        printf("usage: bench_commands [-n repeats (default 1000000)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  sim.trace_on = false;
+  setup();
+
+  // dispatch only
+  const char* variables[] = {CMD_START, CMD_STOP, CMD_ROTATE, CMD_DIR, CMD_SPEED, CMD_RAMP, CMD_STEP, CMD_TIMING, "bogus"};
+  printf("dispatch (%ld repeats)\n%12s %12s %12s\n", repeats, "command", "cascade ns", "table ns");
+  volatile long found = 0; // keeps the lookups from being optimized away
+  for (const char* variable : variables) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < repeats; i++) found += findInCascade(variable);
+    double cascade_ns = elapsedNs(start) / repeats;
+    start = std::chrono::steady_clock::now();
+    for (long i = 0; i < repeats; i++) found += findStepperCommandHandler(variable) != nullptr;
+    double table_ns = elapsedNs(start) / repeats;
+    printf("%12s %12.1f %12.1f\n", variable, cascade_ns, table_ns);
+  }
+
+  // complete cloud calls (alternating pairs so every call changes the state)
+  const char* commands[][2] = {
+    {"direction cc", "direction cw"},
+    {"speed 10 rpm", "speed 11 rpm"},
+    {"ms 8", "ms auto"},
+    {"ramp 10 rpm 0", "ramp 11 rpm 0"},
+    {"hold", "stop"},
+    {"timing", "timing reset"},
+    {"batch ms 4; speed 5 rpm", "batch ms auto; speed 6 rpm"},
+    {"bogus", "bogus"}
+  };
+  long calls = repeats / 100 > 0 ? repeats / 100 : 1;
+  double step_budget_ns = 1e9 / board->max_speed;
+  printf("\ncloud calls (%ld repeats, shortest step interval %.0fns)\n%30s %12s %10s\n", calls, step_budget_ns, "command", "ns/call", "steps");
+  for (auto& pair : commands) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < calls; i++) found += Particle.call(nullptr, pair[i % 2]);
+    double call_ns = elapsedNs(start) / calls;
+    printf("%30s %12.1f %10.2f\n", pair[0], call_ns, call_ns / step_budget_ns);
+  }
+
+  return(0);
+}
@@ -0,0 +1,110 @@
+// host benchmark: stall / slip detection latency of the encoder feedback, checked in the step interrupt vs. polled in loop()
+// a motor model (SimEncoder.h) follows the step pulses and drives the quadrature encoder until the rotor is blocked
+// or loses steps at random, loop() runs with periodic stalls (cloud/LCD load)
+// latency: full steps commanded and time from the first step the rotor did not follow until the engine stopped,
+// clean runs report the worst following error (false stalls would show up as detections)
+// build: make sim, usage: sim/bench_encoder [-s seconds]
+
+#include "application.h"
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+#include "../src/StepperEncoder.h"
+#include "SimEncoder.h"
+
+#define BLOCK_AT_US 500000 // rotor blocked from here on
+
+struct BenchCase {
+  const char* name;
+  float rpm;
+  int ms_index;
+  double slip; // probability per step
+  bool block;
+};
+
+int main(int argc, char** argv) {
+
+  double seconds = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    switch (opt) {
+      case 's': seconds = atof(optarg); break;
+      default:
+        printf("usage: bench_encoder [-s virtual seconds per run (default 10)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  const StepperBoard* board = &PHOTON_STEPPER_BOARD;
+  const StepperDriver* driver = &DRV8825;
+  const StepperMotor* motor = &WM114ST;
+  const StepperEncoderConfig* config = &PHOTON_ENCODER_400;
+  const int full_step = driver->getFullStepUnits();
+  const BenchCase cases[] = {
+    {"blocked", 30, 5, 0, true},
+    {"blocked", 120, 3, 0, true},
+    {"blocked", 600, 1, 0, true},
+    {"blocked", 2000, 0, 0, true},
+    {"slip 1%", 60, 5, 0.01, false},
+    {"slip 1%", 600, 1, 0.01, false},
+    {"clean", 60, 5, 0, false},
+    {"clean", 2000, 0, 0, false}
+  };
+
+  printf("up to %.0f virtual seconds per run, %d counts/rotation, tolerance %d counts, loop stalls 30ms every 70ms\n",
+    seconds, config->counts, STEPPER_ENCODER_TOLERANCE);
+  printf("%10s %8s %8s %4s %10s %10s %14s %14s %12s\n", "check", "motor", "rpm", "ms", "lost", "detected", "latency steps", "latency ms", "max error");
+  for (int polled = 0; polled < 2; polled++) {
+    for (const BenchCase& bench : cases) {
+      sim = SimHardware();
+      sim_motor = SimEncoder();
+      srand(1);
+      sim_motor.slip = bench.slip;
+      sim_motor.block_at = bench.block ? BLOCK_AT_US : 0;
+      sim_motor.attach(board, driver, config, motor->steps);
+
+      StepperEngine engine;
+      engine.init(board->step, board->dir, board->enable);
+      engine.setPinsInverted(driver->dir_cw != LOW, driver->step_on != HIGH, driver->enable_on != LOW);
+      engine.setMaxSpeed(board->max_speed);
+      engine.initMicrostepping(board->ms1, board->ms2, board->ms3);
+      const MicrostepMode* mode = &driver->ms_modes[bench.ms_index];
+      engine.setMicrostepping(driver->getStepUnits(bench.ms_index), mode->ms1, mode->ms2, mode->ms3);
+      StepperEncoder encoder(config);
+      encoder.init(motor->steps * full_step);
+      encoder.sync(engine.currentPosition());
+      if (!polled) engine.setMonitor(&encoder);
+      engine.enableOutputs();
+      engine.runInterval(StepperEngine::getIntervalForSpeed(bench.rpm * motor->steps * full_step), 1);
+
+      // loop() of 200us, stalling for 30ms every 70ms
+      uint64_t end = sim.now + (uint64_t) (seconds * 1e6), next_stall = 70000;
+      int32_t max_error = 0;
+      while (sim.now < end && engine.isRunning()) {
+        if (polled && !encoder.check(engine.currentPosition())) engine.stop();
+        if (encoder.getMaxError() > max_error) max_error = encoder.getMaxError();
+        sim.advance(200);
+        if (sim.now >= next_stall) {
+          sim.advance(30000);
+          next_stall += 70000;
+        }
+      }
+      engine.stop();
+      if (encoder.getMaxError() > max_error) max_error = encoder.getMaxError();
+
+      bool detected = encoder.hasFault();
+      printf("%10s %8s %8.0f %4d %10lu %10s", polled ? "loop poll" : "step isr", bench.name, bench.rpm, driver->getMode(bench.ms_index),
+        sim_motor.lost, detected ? "yes" : "no");
+      if (detected && sim_motor.lost > 0) {
+        printf(" %14.1f %14.2f", (double) (sim_motor.commanded - sim_motor.first_lost_commanded) / full_step,
+          (sim_motor.last_step - sim_motor.first_lost) / 1e3);
+      } else {
+        printf(" %14s %14s", "-", "-");
+      }
+      printf(" %10ldcnt\n", (long) max_error);
+    }
+  }
+
+  return(0);
+}
@@ -0,0 +1,147 @@
+// host benchmark: fixed point step engine vs. the previous AccelStepper runSpeed() path
+// compares host time per loop iteration and the cumulative step count drift against the commanded rpm,
+// and checks that ramps slowing down to a low speed settle at the commanded rate (no interval below the slower speed's)
+// build: make sim, usage: sim/bench_engine [-H hours] [-l loop_us]
+
+#include "application.h"
+#include <AccelStepper.h>
+#include <chrono>
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+
+struct BenchResult {
+  long steps;
+  double ns_per_loop;
+};
+
+static double elapsedNs(std::chrono::steady_clock::time_point start) {
+  return(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+}
+
+// previous path: float speed, AccelStepper::runSpeed() polled once per loop()
+static BenchResult runAccelStepper(float rpm, int ms_mode, uint64_t duration, uint64_t loop_us) {
+  AccelStepper stepper(AccelStepper::DRIVER, PHOTON_STEPPER_BOARD.step, PHOTON_STEPPER_BOARD.dir);
+  stepper.setMaxSpeed(STEPPER_ENGINE_MAX_SPEED);
+  stepper.setSpeed(rpm/60.0 * WM114ST.steps * WM114ST.gearing * ms_mode);
+  uint64_t end = sim.now + duration;
+  unsigned long loops = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (sim.now < end) {
+    stepper.runSpeed();
+    sim.advance(loop_us);
+    loops++;
+  }
+  BenchResult result = {stepper.currentPosition(), elapsedNs(start) / loops};
+  return(result);
+}
+
+// fixed point engine: interval calculated once, stepping from the timer interrupt
+static BenchResult runEngine(float rpm, int ms_mode, uint64_t duration, uint64_t loop_us) {
+  StepperEngine engine;
+  engine.init(PHOTON_STEPPER_BOARD.step, PHOTON_STEPPER_BOARD.dir, PHOTON_STEPPER_BOARD.enable);
+  engine.setMaxSpeed(STEPPER_ENGINE_MAX_SPEED);
+  engine.runInterval(StepperEngine::getIntervalForSpeed((double) rpm * WM114ST.steps * WM114ST.gearing * ms_mode), 1);
+  uint64_t end = sim.now + duration;
+  unsigned long loops = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (sim.now < end) {
+    engine.distanceToGo(); // all that's left for update() to do
+    sim.advance(loop_us);
+    loops++;
+  }
+  engine.stop();
+  BenchResult result = {engine.currentPosition(), elapsedNs(start) / loops};
+  return(result);
+}
+
+// slow down from rpm_from to rpm_to at the acceleration limit, settled rate and shortest interval after the change
+struct SlowDownResult {
+  double steps_per_s;
+  uint64_t min_interval_us;
+};
+
+static SlowDownResult runSlowDown(float rpm_from, float rpm_to, int ms_mode, float rpm_per_s) {
+  sim = SimHardware();
+  double steps_per_rpm = WM114ST.steps * WM114ST.gearing * ms_mode;
+  StepperEngine engine;
+  engine.init(PHOTON_STEPPER_BOARD.step, PHOTON_STEPPER_BOARD.dir, PHOTON_STEPPER_BOARD.enable);
+  engine.setMaxSpeed(STEPPER_ENGINE_MAX_SPEED);
+  float acceleration = rpm_per_s / 60.0 * steps_per_rpm;
+  engine.runInterval(StepperEngine::getIntervalForSpeed(rpm_from * steps_per_rpm), 1, acceleration);
+  sim.advance(2000000);
+  uint64_t change = sim.now;
+  engine.runInterval(StepperEngine::getIntervalForSpeed(rpm_to * steps_per_rpm), 1, acceleration);
+  // settled once the ramp is over (at most rpm_from / rpm_per_s), then count steps for 60 intervals of the slow speed
+  uint64_t settled = change + (uint64_t) (rpm_from / rpm_per_s * 1e6) + 1000000;
+  uint64_t end = settled + (uint64_t) (60 * 60e6 / (rpm_to * steps_per_rpm));
+  sim.advance(end - sim.now);
+  engine.stop();
+  SlowDownResult result = {0, UINT64_MAX};
+  uint64_t last = 0;
+  long steps = 0;
+  for (const SimEdge& edge : sim.edges) {
+    if (edge.pin != PHOTON_STEPPER_BOARD.step || edge.level != HIGH) continue;
+    if (last >= change && edge.time - last < result.min_interval_us) result.min_interval_us = edge.time - last;
+    if (edge.time >= settled && edge.time < end) steps++;
+    last = edge.time;
+  }
+  result.steps_per_s = steps / ((end - settled) / 1e6);
+  return(result);
+}
+
+int main(int argc, char** argv) {
+
+  double hours = 1;
+  uint64_t loop_us = 50;
+  int opt;
+  while ((opt = getopt(argc, argv, "H:l:h")) != -1) {
+    switch (opt) {
+      case 'H': hours = atof(optarg); break;
+      case 'l': loop_us = strtoull(optarg, nullptr, 10); break;
+      default:
+        printf("usage: bench_engine [-H virtual hours per run (default 1)] [-l loop_us (default 50)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  sim.trace_on = false;
+  uint64_t duration = (uint64_t) (hours * 3600e6);
+  const float rpms[] = {0.37, 1, 3.3, 10, 33.3};
+  const int ms_modes[] = {32, 32, 16, 4, 1}; // modes AccelStepper can still step at 1000 steps/s
+
+  printf("%.2f virtual hour(s) per run, %lluus per loop() iteration\n", hours, (unsigned long long) loop_us);
+  printf("%8s %4s %14s | %12s %10s %10s | %12s %10s %10s\n", "rpm", "ms", "expected",
+    "accel steps", "drift", "ns/loop", "engine steps", "drift", "ns/loop");
+
+  for (int i = 0; i < sizeof(rpms) / sizeof(rpms[0]); i++) {
+    double expected = (double) rpms[i] * WM114ST.steps * WM114ST.gearing * ms_modes[i] * hours * 60.0;
+    BenchResult accel = runAccelStepper(rpms[i], ms_modes[i], duration, loop_us);
+    BenchResult engine = runEngine(rpms[i], ms_modes[i], duration, loop_us);
+    printf("%8.2f %4d %14.1f | %12ld %+9.4f%% %10.1f | %12ld %+9.4f%% %10.1f\n", rpms[i], ms_modes[i], expected,
+      accel.steps, 100.0 * (accel.steps - expected) / expected, accel.ns_per_loop,
+      engine.steps, 100.0 * (engine.steps - expected) / expected, engine.ns_per_loop);
+  }
+
+  // slowing down at the motor's acceleration limit to speeds slower than the first step of a ramp from standstill
+  const float slow_downs[][2] = {{100, 1}, {60, 1}, {10, 0.1}, {33.3, 0.37}};
+  const int ms_mode = 32;
+  float rpm_per_s = WM114ST.acceleration;
+  printf("\nslowing down at %.0f rpm/s, %d microsteps\n", rpm_per_s, ms_mode);
+  printf("%8s %8s %14s %14s %10s %14s %14s\n", "from rpm", "to rpm", "expected", "steps/s", "error", "ideal us", "min us");
+  int failed = 0;
+  for (int i = 0; i < sizeof(slow_downs) / sizeof(slow_downs[0]); i++) {
+    double expected = (double) slow_downs[i][1] * WM114ST.steps * WM114ST.gearing * ms_mode / 60.0;
+    SlowDownResult result = runSlowDown(slow_downs[i][0], slow_downs[i][1], ms_mode, rpm_per_s);
+    double error = (result.steps_per_s - expected) / expected;
+    double ideal_us = 1e6 / expected;
+    printf("%8.2f %8.2f %14.4f %14.4f %+9.4f%% %14.1f %14llu\n", slow_downs[i][0], slow_downs[i][1], expected,
+      result.steps_per_s, 100.0 * error, ideal_us, (unsigned long long) result.min_interval_us);
+    // the slowest speed of the ramp is never faster than the one it started from
+    double from_us = 60e6 / (slow_downs[i][0] * WM114ST.steps * WM114ST.gearing * ms_mode);
+    if (fabs(error) > 0.02 || result.min_interval_us + 2 < from_us) failed++;
+  }
+  if (failed) printf("FAILED: %d slow down(s) did not settle at the commanded rate\n", failed);
+
+  return(0);
+}
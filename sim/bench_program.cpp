@@ -0,0 +1,134 @@
+// host benchmark: speed program transitions on the exact step, chained in the step interrupt vs. switched from loop()
+// a step engine runs a sequence of moves (speed for a number of steps) in one direction, once with the next move queued
+// for the step interrupt (as the controller's 'program' does) and once with loop() switching the speed once the position
+// passed the move's end, with and without loop stalls (cloud/LCD load)
+// transition error: steps at the old speed beyond the planned end of each move (measured on the step pin),
+// end error: when the last step went out vs. the planned duration
+// build: make sim, usage: sim/bench_program [-n repeats]
+
+#include "application.h"
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+
+struct BenchMove {
+  float rpm;
+  uint32_t steps;
+};
+
+struct BenchLoop {
+  const char* name;
+  uint32_t stall_period_us; // 0 = no stalls
+  uint32_t stall_us;
+};
+
+int main(int argc, char** argv) {
+
+  int repeats = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n': repeats = atoi(optarg); break;
+      default:
+        printf("usage: bench_program [-n repeats of the move sequence (default 3)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  const StepperBoard* board = &PHOTON_STEPPER_BOARD;
+  const StepperDriver* driver = &DRV8825;
+  const StepperMotor* motor = &WM114ST;
+  const int ms_index = 3; // 8 microsteps
+  const double units_per_rotation = motor->steps * driver->getFullStepUnits();
+  const int step_units = driver->getStepUnits(ms_index);
+  // instant speed changes so every transition shows as one changed step interval
+  const BenchMove sequence[] = { {60, 1600}, {120, 4000}, {30, 400}, {90, 2400}, {15, 200} };
+  const int sequence_n = sizeof(sequence) / sizeof(BenchMove);
+  const BenchLoop loops[] = { {"200us", 0, 0}, {"stalls", 70000, 30000} };
+
+  std::vector<BenchMove> moves;
+  for (int r = 0; r < repeats; r++) moves.insert(moves.end(), sequence, sequence + sequence_n);
+  double planned_us = 0;
+  for (const BenchMove& move : moves) planned_us += move.steps * 60.0e6 / (move.rpm * units_per_rotation / step_units);
+
+  printf("%d moves (%d repeats), %d microsteps, instant speed changes, loop() of 200us (stalls: 30ms every 70ms)\n",
+    (int) moves.size(), repeats, driver->getMode(ms_index));
+  printf("%12s %8s %12s %16s %16s %14s\n", "transitions", "loop", "steps", "max error steps", "mean error steps", "end error ms");
+  for (int polled = 0; polled < 2; polled++) {
+    for (const BenchLoop& loop : loops) {
+      sim = SimHardware();
+      StepperEngine engine;
+      engine.init(board->step, board->dir, board->enable);
+      engine.setPinsInverted(driver->dir_cw != LOW, driver->step_on != HIGH, driver->enable_on != LOW);
+      engine.setMaxSpeed(board->max_speed);
+      engine.initMicrostepping(board->ms1, board->ms2, board->ms3);
+      const MicrostepMode* mode = &driver->ms_modes[ms_index];
+      engine.setMicrostepping(step_units, mode->ms1, mode->ms2, mode->ms3);
+      engine.enableOutputs();
+
+      // planned end of each move [steps]
+      std::vector<uint32_t> ends;
+      uint32_t total = 0;
+      for (const BenchMove& move : moves) ends.push_back(total += move.steps);
+      auto interval = [&](size_t i) { return(StepperEngine::getIntervalForSpeed(moves[i].rpm * units_per_rotation)); };
+
+      // first move, the second queued (step interrupt) or switched to from loop()
+      size_t active = 0;
+      uint32_t segments = engine.getSegments();
+      if (polled) {
+        engine.runInterval(interval(0), 1);
+      } else {
+        engine.moveTo((long) ends[0] * step_units);
+        engine.queueSegment(interval(1), moves[1].steps * step_units);
+        engine.runIntervalToPosition(interval(0));
+      }
+      uint64_t start = sim.now, next_stall = sim.now + loop.stall_period_us;
+      while (engine.isRunning()) {
+        if (polled) {
+          // switch once the position passed the move's end (the last move stops at its exact target)
+          if (active + 1 < moves.size() && engine.currentPosition() >= (long) ends[active] * step_units) {
+            active++;
+            if (active + 1 < moves.size()) {
+              engine.runInterval(interval(active), 1);
+            } else {
+              engine.moveTo((long) ends[active] * step_units);
+              engine.runIntervalToPosition(interval(active));
+            }
+          }
+        } else if (engine.getSegments() != segments) {
+          // keep the next move queued
+          active += engine.getSegments() - segments;
+          segments = engine.getSegments();
+          if (active + 1 < moves.size()) engine.queueSegment(interval(active + 1), moves[active + 1].steps * step_units);
+        }
+        sim.advance(200);
+        if (loop.stall_period_us > 0 && sim.now >= next_stall) {
+          sim.advance(loop.stall_us);
+          next_stall += loop.stall_period_us;
+        }
+      }
+
+      // step k (from 1) is a transition if the interval to step k + 1 follows the next move's speed
+      std::vector<uint64_t> steps;
+      for (const SimEdge& edge : sim.edges) {
+        if (edge.pin == board->step && edge.level == driver->step_on) steps.push_back(edge.time);
+      }
+      double sum = 0;
+      long max = 0;
+      size_t k = 1;
+      for (size_t i = 0; i + 1 < moves.size(); i++) {
+        double next_us = 60.0e6 / (moves[i + 1].rpm * units_per_rotation / step_units);
+        while (k < steps.size() && fabs((double) (steps[k] - steps[k - 1]) - next_us) > 1.5) k++;
+        long error = (long) k - (long) ends[i];
+        sum += labs(error);
+        if (labs(error) > max) max = labs(error);
+      }
+      double end_error = (double) (steps.back() - start) - planned_us;
+      printf("%12s %8s %12lu %16ld %16.1f %14.2f\n", polled ? "loop poll" : "step isr", loop.name, (unsigned long) steps.size(),
+        max, sum / (moves.size() - 1), end_error / 1e3);
+    }
+  }
+
+  return(0);
+}
@@ -0,0 +1,92 @@
+// host benchmark: step rate self-calibration under interrupt load
+// the step interrupt is held off periodically (higher priority interrupts such as the radio stack, or a flash write),
+// the calibration searches the sustainable rate while loop() runs, then a step engine runs at the calibrated limit,
+// at the sustainable rate and at the engine's maximum: share of steps later than 25% of the interval behind their
+// deadline (the calibration's criterion, measured on the step pin) and the shortest interval (catch-up bursts)
+// build: make sim, usage: sim/bench_rate [-s seconds]
+
+#include "application.h"
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperRateCalibration.h"
+
+struct BenchLoad {
+  uint32_t period_us;
+  uint32_t masked_us;
+};
+
+struct BenchSteps {
+  unsigned long steps = 0;
+  unsigned long late = 0;
+  uint64_t min_interval = 0;
+};
+
+// steps on the pin against their deadlines (start + k intervals)
+static BenchSteps analyze(uint8_t step_pin, uint64_t start, double interval) {
+  BenchSteps result;
+  uint64_t last = 0;
+  for (const SimEdge& edge : sim.edges) {
+    if (edge.pin != step_pin || edge.level != HIGH) continue;
+    if (edge.time - start - (result.steps + 1) * interval > STEPPER_RATE_JITTER * interval) result.late++;
+    if (result.steps == 1 || (result.steps > 1 && edge.time - last < result.min_interval)) result.min_interval = edge.time - last;
+    last = edge.time;
+    result.steps++;
+  }
+  return(result);
+}
+
+int main(int argc, char** argv) {
+
+  double seconds = 5;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    switch (opt) {
+      case 's': seconds = atof(optarg); break;
+      default:
+        printf("usage: bench_rate [-s virtual seconds per engine run (default 5)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  const StepperBoard* board = &PHOTON_STEPPER_BOARD;
+  const BenchLoad loads[] = { {0, 0}, {1000, 20}, {1000, 100}, {1000, 300}, {10000, 500}, {100000, 2000} };
+
+  printf("%.0f virtual seconds per engine run, loop() of 200us, late: more than %.0f%% of the interval behind the deadline\n",
+    seconds, STEPPER_RATE_JITTER * 100);
+  printf("%14s %12s %12s | %14s %10s %12s\n", "load", "sustainable", "limit", "engine steps/s", "late", "min interval");
+  for (const BenchLoad& load : loads) {
+    // calibration
+    sim = SimHardware();
+    sim.mask_period_us = load.period_us;
+    sim.mask_us = load.masked_us;
+    StepperRateCalibration calibration;
+    while (!calibration.update(true)) sim.advance(200);
+    char name[20];
+    if (load.period_us > 0) snprintf(name, sizeof(name), "%luus/%luus", (unsigned long) load.masked_us, (unsigned long) load.period_us);
+    else snprintf(name, sizeof(name), "none");
+
+    // engine at the limit, the sustainable rate and the engine's maximum
+    const float rates[] = { calibration.getMaxSpeed(), calibration.getRate(), STEPPER_ENGINE_MAX_SPEED };
+    for (int i = 0; i < 3; i++) {
+      uint32_t mask_period_us = sim.mask_period_us, mask_us = sim.mask_us;
+      sim = SimHardware();
+      sim.mask_period_us = mask_period_us;
+      sim.mask_us = mask_us;
+      uint64_t start = sim.now;
+      StepperEngine engine;
+      engine.init(board->step, board->dir, board->enable);
+      engine.setMaxSpeed(STEPPER_ENGINE_MAX_SPEED);
+      engine.runInterval(StepperEngine::getIntervalForSpeed(rates[i] * 60.0), 1);
+      sim.advance((uint64_t) (seconds * 1e6));
+      engine.stop();
+      BenchSteps steps = analyze(board->step, start, 1.0e6 / rates[i]);
+      if (i == 0) printf("%14s %10.0f/s %10.0f/s |", name, calibration.getRate(), calibration.getMaxSpeed());
+      else printf("%14s %12s %12s |", "", "", "");
+      printf(" %12.0f/s %9.2f%% %10lluus\n", rates[i], steps.steps > 1 ? 100.0 * steps.late / steps.steps : 0.0,
+        (unsigned long long) steps.min_interval);
+    }
+  }
+
+  return(0);
+}
@@ -0,0 +1,68 @@
+// host benchmark: state information update with cached state fragments vs. reformatting every field (the previous rebuild)
+// times updateStateInformation() (state string, state event check and LCD lines) while the pump is running
+// build: make sim, usage: sim/bench_state [-n repeats]
+
+#include "application.h"
+#include "../src/pump.cpp"
+#include <chrono>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define CYCLES() __rdtsc()
+#else
+  #define CYCLES() 0ULL
+#endif
+
+struct BenchResult {
+  double ns;
+  double cycles;
+};
+
+static BenchResult runUpdates(long repeats, bool cached) {
+  auto start = std::chrono::steady_clock::now();
+  unsigned long long start_cycles = CYCLES();
+  for (long i = 0; i < repeats; i++) {
+    if (!cached) pump->invalidateStateInformation();
+    pump->updateStateInformation();
+  }
+  BenchResult result = {
+    std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repeats,
+    (double) (CYCLES() - start_cycles) / repeats
+  };
+  return(result);
+}
+
+int main(int argc, char** argv) {
+
+  long repeats = 200000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n': repeats = atol(optarg); break;
+      default:
+        printf("usage: bench_state [-n repeats (default 200000)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  sim.trace_on = false;
+  setup();
+  Particle.call(nullptr, "calibrate rotation-flow 0.52 mL");
+  Particle.call(nullptr, "speed 10 rpm");
+  Particle.call(nullptr, "start");
+  for (int i = 0; i < 20000; i++) {
+    loop();
+    sim.advance(50);
+  }
+
+  // steady state: pump running, nothing but the odometer changes between updates (it does not while the clock stands still)
+  printf("%ld state updates (pump running, calibrated)\n%22s %12s %14s\n", repeats, "", "ns/update", "cycles/update");
+  BenchResult rebuild = runUpdates(repeats, false);
+  BenchResult cached = runUpdates(repeats, true);
+  printf("%22s %12.1f %14.0f\n", "reformat all fields", rebuild.ns, rebuild.cycles);
+  printf("%22s %12.1f %14.0f\n", "cached fragments", cached.ns, cached.cycles);
+  printf("%22s %12.1f %14.0f\n", "saved", rebuild.ns - cached.ns, rebuild.cycles - cached.cycles);
+
+  return(0);
+}
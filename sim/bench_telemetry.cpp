@@ -0,0 +1,139 @@
+// host benchmark: telemetry batch encoding (delta/varint) vs. the raw samples and one JSON object per sample
+// runs a step engine through speed changes on the virtual clock, samples it like the controller does, encodes the batches,
+// decodes them again (reference decoder for the batch format in StepperTelemetry.h) and checks the reconstruction is exact
+// build: make sim, usage: sim/bench_telemetry [-s seconds] [-p period_ms]
+
+#include "application.h"
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+#include "../src/StepperTelemetry.h"
+
+// reference decoder
+struct Reader {
+  const uint8_t* data;
+  int n;
+  int i;
+  bool more() { return(i < n); };
+  uint32_t varint() {
+    uint32_t value = 0;
+    for (int shift = 0; i < n; shift += 7) {
+      uint8_t b = data[i++];
+      value |= (uint32_t) (b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    return(value);
+  };
+  int32_t zigzag() { uint32_t v = varint(); return((int32_t) ((v >> 1) ^ -(v & 1))); };
+};
+
+static uint32_t decodeBatch(const uint8_t* data, int n, std::vector<TelemetrySample>& samples) {
+  Reader r = {data, n, 0};
+  if (r.varint() != TELEMETRY_FORMAT) return(0);
+  uint32_t seq = r.varint();
+  uint32_t period = r.varint();
+  TelemetrySample sample;
+  sample.time = r.varint();
+  sample.position = r.zigzag();
+  sample.late = r.varint();
+  sample.lag = r.varint();
+  samples.push_back(sample);
+  int32_t delta = 0;
+  while (r.more()) {
+    sample.time += period + r.zigzag();
+    delta += r.zigzag();
+    sample.position = (uint32_t) sample.position + (uint32_t) delta;
+    sample.late += r.varint();
+    sample.lag = r.varint();
+    samples.push_back(sample);
+  }
+  return(seq);
+}
+
+int main(int argc, char** argv) {
+
+  double seconds = 600;
+  unsigned long period_ms = TELEMETRY_PERIOD_MS;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:p:h")) != -1) {
+    switch (opt) {
+      case 's': seconds = atof(optarg); break;
+      case 'p': period_ms = atol(optarg); break;
+      default:
+        printf("usage: bench_telemetry [-s virtual seconds (default 600)] [-p sampling period ms (default %d)]\n", TELEMETRY_PERIOD_MS);
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  sim.trace_on = false;
+  StepperEngine engine;
+  engine.init(PHOTON_STEPPER_BOARD.step, PHOTON_STEPPER_BOARD.dir, PHOTON_STEPPER_BOARD.enable);
+  engine.setMaxSpeed(PHOTON_STEPPER_BOARD.max_speed);
+  double units_per_rotation = WM114ST.steps * WM114ST.gearing * DRV8825.getFullStepUnits();
+
+  // speed changes every 20s (ramped), loop() of 200us with a 30ms stall every 5s
+  StepperTelemetry telemetry;
+  std::vector<TelemetrySample> raw, decoded;
+  uint8_t batch[TELEMETRY_BATCH_MAX];
+  char text[TELEMETRY_BATCH_MAX / 3 * 4 + 5];
+  long bytes = 0, text_chars = 0, json_chars = 0, batches = 0;
+  uint32_t next_seq = 0;
+  bool in_order = true;
+  double encode_ns = 0;
+  uint64_t end = sim.now + (uint64_t) (seconds * 1e6), last_sample = 0, last_loop = sim.now;
+  uint32_t lag_max = 0;
+  const float rpms[] = {10, 120, 0.5, 300, 60};
+  int segment = -1;
+  while (sim.now < end) {
+    int current = (int) (sim.now / 20000000) % 5;
+    if (current != segment) {
+      segment = current;
+      engine.runInterval(StepperEngine::getIntervalForSpeed(rpms[segment] * units_per_rotation), segment % 2 ? 1 : -1, 300 / 60.0 * units_per_rotation);
+    }
+    uint32_t lag = sim.now - last_loop;
+    if (lag > lag_max) lag_max = lag;
+    last_loop = sim.now;
+    if (sim.now - last_sample >= period_ms * 1000) {
+      TelemetrySample sample = {(uint32_t) sim.now, (int32_t) engine.currentPosition(), (uint32_t) engine.getTiming()->late, lag_max};
+      telemetry.add(sample.time, sample.position, sample.late, sample.lag);
+      raw.push_back(sample);
+      char json[100];
+      json_chars += snprintf(json, sizeof(json), "{\"t\":%lu,\"pos\":%ld,\"late\":%lu,\"lag\":%lu}",
+        (unsigned long) sample.time, (long) sample.position, (unsigned long) sample.late, (unsigned long) sample.lag);
+      last_sample = sim.now;
+      lag_max = 0;
+    }
+    while (telemetry.getCount() >= TELEMETRY_BATCH_SAMPLES) {
+      auto start = std::chrono::steady_clock::now();
+      int n = telemetry.encode(batch, sizeof(batch), period_ms * 1000);
+      text_chars += StepperTelemetry::toBase64(batch, n, text, sizeof(text));
+      encode_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      size_t before = decoded.size();
+      in_order &= decodeBatch(batch, n, decoded) == next_seq;
+      next_seq += decoded.size() - before;
+      bytes += n;
+      batches++;
+    }
+    sim.advance((sim.now / 1000) % 5000 == 0 ? 30000 : 200);
+  }
+
+  bool exact = in_order && decoded.size() <= raw.size();
+  for (size_t i = 0; exact && i < decoded.size(); i++) {
+    exact = decoded[i].time == raw[i].time && decoded[i].position == raw[i].position &&
+      decoded[i].late == raw[i].late && decoded[i].lag == raw[i].lag;
+  }
+  long samples = decoded.size();
+  printf("%ld samples every %lums in %ld batches (%.0f virtual seconds), reconstruction %s\n",
+    samples, period_ms, batches, seconds, exact ? "exact" : "FAILED");
+  printf("%22s %12s %16s\n", "", "bytes/sample", "samples/event"); // Particle event data: 622 characters
+  printf("%22s %12.1f %16s\n", "raw samples", (double) sizeof(TelemetrySample), "-");
+  printf("%22s %12.1f %16.0f\n", "json per sample", (double) json_chars / raw.size(), 622.0 * raw.size() / json_chars);
+  printf("%22s %12.1f %16s\n", "delta/varint", (double) bytes / samples, "-");
+  printf("%22s %12.1f %16.0f\n", "delta/varint base64", (double) text_chars / samples, 622.0 * samples / text_chars);
+  printf("encoding: %.0fns per batch\n", encode_ns / batches);
+
+  return(exact ? 0 : 1);
+}
@@ -0,0 +1,83 @@
+// host benchmark: external trigger edge to first step pulse latency, pin interrupt vs. polling the trigger in loop()
+// a square wave on the trigger input starts a fixed dose on every rising edge while loop() runs with periodic stalls
+// (cloud/LCD load), optionally next to a second engine stepping on the shared step interrupt (edges have to wait for it)
+// latencies are measured on the virtual pins, from the trigger edge to the first step pulse
+// build: make sim, usage: sim/bench_trigger [-s seconds]
+
+#include "application.h"
+#include <unistd.h>
+#include "../src/StepperConfig.h"
+#include "../src/StepperEngine.h"
+#include "SimAnalysis.h"
+
+#define DOSE_UNITS 40 // steps per rising edge (10ms)
+
+static StepperEngine engine;
+
+static void triggerISR() {
+  engine.trigger(micros());
+}
+
+int main(int argc, char** argv) {
+
+  double seconds = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    switch (opt) {
+      case 's': seconds = atof(optarg); break;
+      default:
+        printf("usage: bench_trigger [-s virtual seconds (default 20)]\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  Serial.echo = false;
+  const StepperBoard* board = &PHOTON_STEPPER_BOARD;
+  // loop() of 200us, stalling for stall_us every 70ms
+  const uint32_t stalls[] = {0, 1000, 30000};
+  printf("%.0f virtual seconds per run, trigger every 101ms (5ms high), loop stalls every 70ms\n", seconds);
+  printf("%10s %10s %10s %10s %14s %14s %16s\n", "trigger", "stall us", "channel 2", "starts", "mean latency", "max latency", "engine max us");
+  for (int polled = 0; polled < 2; polled++) {
+    for (int busy = 0; busy < 2; busy++) {
+      for (uint32_t stall_us : stalls) {
+        sim = SimHardware();
+        engine = StepperEngine();
+        engine.init(board->step, board->dir, board->enable);
+        engine.setMaxSpeed(board->max_speed);
+        StepperEngine channel2;
+        if (busy) {
+          channel2.init(PHOTON_STEPPER_BOARD_2.step, PHOTON_STEPPER_BOARD_2.dir, PHOTON_STEPPER_BOARD_2.enable);
+          channel2.runInterval(StepperEngine::getIntervalForSpeed(3000 * 60.0), 1);
+        }
+        engine.arm(StepperEngine::getIntervalForSpeed(4000 * 60.0), 1, 0, DOSE_UNITS);
+        pinMode(board->trigger, INPUT_PULLDOWN);
+        if (!polled) attachInterrupt(board->trigger, triggerISR, RISING);
+        sim.startSignal(board->trigger, 101000, 5000, 1000);
+
+        uint64_t end = sim.now + (uint64_t) (seconds * 1e6), next_stall = 70000;
+        uint8_t level = LOW;
+        while (sim.now < end) {
+          if (polled) {
+            uint8_t now = digitalRead(board->trigger);
+            if (now == HIGH && level == LOW) engine.trigger(micros());
+            level = now;
+          }
+          sim.advance(200);
+          if (stall_us > 0 && sim.now >= next_stall) {
+            sim.advance(stall_us);
+            next_stall += 70000;
+          }
+        }
+        channel2.stop();
+        engine.stop();
+
+        SimTriggerStats stats = analyzeTrigger(sim.edges, board->trigger, board->step, HIGH, 0, end);
+        printf("%10s %10lu %10s %10lu %12.1fus %12lluus %14luus\n", polled ? "loop poll" : "interrupt", (unsigned long) stall_us,
+          busy ? "3000/s" : "-", stats.starts, stats.latency_mean, (unsigned long long) stats.latency_max,
+          engine.getTriggerTiming()->max_late);
+      }
+    }
+  }
+
+  return(0);
+}
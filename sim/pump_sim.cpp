@@ -0,0 +1,247 @@
+// host simulation of the stepper pump firmware (pump.cpp setup/loop) on a virtual clock
+// build: make sim, usage: sim/pump_sim -h
+
+#include "application.h"
+#include "../src/pump.cpp"
+#include "SimAnalysis.h"
+#include "SimEncoder.h"
+#include "SimRecording.h"
+#include <unistd.h>
+#include <termios.h>
+#include <chrono>
+#include <algorithm>
+
+// command scheduled at a virtual time
+struct SimCommand {
+  uint64_t time; // [us]
+  const char* command;
+};
+
+static void usage() {
+  printf(
+    "usage: pump_sim [-s seconds] [-l loop_us] [-p period_ms -d stall_us] [-i period_us:masked_us] [-g period_ms[:high_ms]] [-m pullout_sps[:slip[:block_s]]] [-c recording [-o replay]] [-t trace.csv] [-e eeprom.bin] [-r] [-u] [-q] [@sec] command ...\n"
+    "  -s  virtual seconds to run after the last command (default 10)\n"
+    "  -l  virtual duration of one loop() iteration in us (default 50)\n"
+    "  -p  every period_ms, the loop stalls for stall_us (emulates cloud/LCD load, default off)\n"
+    "  -i  interrupt load: the step interrupt is held off for masked_us of every period_us (higher priority interrupts,\n"
+    "      e.g. the radio stack), the step rate self-calibration limits the rpm accordingly\n"
+    "  -g  square wave on the board's trigger input from boot (high for high_ms of every period_ms, default half)\n"
+    "  -m  motor with an encoder on its shaft (PHOTON_ENCODER_400): loses sync above pullout_sps full steps/s (0 = never),\n"
+    "      loses each step with probability slip, is blocked from block_s on (the firmware notices with -DENCODER_FEEDBACK)\n"
+    "  -c  replay the commands of a recording (R: lines from 'record on') at their recorded times and compare the\n"
+    "      return codes and state changes, -o saves the replay's own recording\n"
+    "  -t  save every pin edge as csv (time_us,pin,level)\n"
+    "  -e  load the emulated EEPROM from this file at boot (if it exists) and save it at the end (power loss after -s seconds)\n"
+    "  -r  real time (virtual clock paced to the wall clock, e.g. for local control clients)\n"
+    "  -u  attach the USB serial port to a pty (local control over serial, the device path is printed at boot)\n"
+    "  -q  quiet (no firmware serial output on stdout)\n"
+    "commands are sent through the cloud function in order, an @sec argument schedules\n"
+    "the following commands at that virtual time, e.g.: pump_sim \"speed 10 rpm\" start @30 \"speed 20 rpm\"\n"
+  );
+}
+
+int main(int argc, char** argv) {
+
+  double run_s = 10;
+  uint64_t loop_us = 50;
+  uint64_t stall_period_ms = 0;
+  uint64_t stall_us = 0;
+  const char* trace_file = nullptr;
+  const char* eeprom_file = nullptr;
+  bool real_time = false;
+  bool serial_pty = false;
+  double signal_period_ms = 0;
+  double signal_high_ms = 0;
+  bool motor_model = false;
+  const char* recording_file = nullptr;
+  const char* replay_file = nullptr;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:l:p:d:i:g:m:c:o:t:e:ruqh")) != -1) {
+    switch (opt) {
+      case 's': run_s = atof(optarg); break;
+      case 'l': loop_us = strtoull(optarg, nullptr, 10); break;
+      case 'p': stall_period_ms = strtoull(optarg, nullptr, 10); break;
+      case 'd': stall_us = strtoull(optarg, nullptr, 10); break;
+      case 'i': {
+        char* masked;
+        sim.mask_period_us = strtoul(optarg, &masked, 10);
+        sim.mask_us = (*masked == ':') ? strtoul(masked + 1, nullptr, 10) : 0;
+        if (sim.mask_us >= sim.mask_period_us) sim.mask_period_us = sim.mask_us = 0;
+        break;
+      }
+      case 'g': {
+        char* high;
+        signal_period_ms = strtod(optarg, &high);
+        signal_high_ms = (*high == ':') ? atof(high + 1) : signal_period_ms / 2;
+        break;
+      }
+      case 'm': {
+        char* next;
+        motor_model = true;
+        sim_motor.pullout_sps = strtod(optarg, &next);
+        if (*next == ':') sim_motor.slip = strtod(next + 1, &next);
+        if (*next == ':') sim_motor.block_at = (uint64_t) (atof(next + 1) * 1e6);
+        break;
+      }
+      case 'c': recording_file = optarg; break;
+      case 'o': replay_file = optarg; break;
+      case 't': trace_file = optarg; break;
+      case 'e': eeprom_file = optarg; break;
+      case 'r': real_time = true; break;
+      case 'u': serial_pty = true; break;
+      case 'q': Serial.echo = false; break;
+      default: usage(); return(opt == 'h' ? 0 : 1);
+    }
+  }
+
+  // commands
+  std::vector<SimCommand> commands;
+  uint64_t at = 0;
+  for (int i = optind; i < argc; i++) {
+    if (argv[i][0] == '@') at = (uint64_t) (atof(argv[i] + 1) * 1e6);
+    else commands.push_back({at, argv[i]});
+  }
+
+  // replay: the recorded commands (the firmware records the replay the same way)
+  SimRecording recording;
+  std::string replay_output;
+  if (recording_file) {
+    if (!loadRecording(recording_file, &recording)) {
+      printf("SIM: could not read recording %s\n", recording_file);
+      return(1);
+    }
+    commands.insert(commands.begin(), {0, "record on"});
+    for (const SimRecordedCommand& recorded : recording.commands) commands.push_back({recorded.time, recorded.command.c_str()});
+    std::stable_sort(commands.begin(), commands.end(), [](const SimCommand& a, const SimCommand& b) { return(a.time < b.time); });
+    Serial.capture = &replay_output;
+  }
+
+  // boot
+  if (eeprom_file) {
+    FILE* file = fopen(eeprom_file, "rb");
+    if (file) {
+      printf("SIM: EEPROM loaded from %s (%lu bytes)\n", eeprom_file, (unsigned long) fread(sim.eeprom, 1, sizeof(sim.eeprom), file));
+      fclose(file);
+    }
+  }
+  if (serial_pty) {
+    // raw pty, the slave side stays open so the serial port works before and between clients
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+      printf("SIM: could not open a pty\n");
+      return(1);
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    Serial.fd = master;
+    printf("SIM: USB serial on %s\n", ptsname(master));
+    fflush(stdout);
+  }
+  if (signal_period_ms > 0 && !sim.startSignal(board->trigger, signal_period_ms * 1000, signal_high_ms * 1000, 0)) {
+    printf("SIM: invalid trigger signal (or the board has no trigger input)\n");
+    return(1);
+  }
+  if (motor_model) sim_motor.attach(board, driver, &PHOTON_ENCODER_400, motor->steps);
+  setup();
+  auto wall_start = std::chrono::steady_clock::now();
+  uint64_t virtual_start = sim.now;
+  uint64_t end = (commands.empty() ? sim.now : commands.back().time) + (uint64_t) (run_s * 1e6);
+  uint64_t next_stall = stall_period_ms * 1000;
+  uint64_t measure_from = 0;
+  size_t next_command = 0;
+
+  // run
+  while (sim.now < end) {
+    while (next_command < commands.size() && commands[next_command].time <= sim.now) {
+      int ret = Particle.call(nullptr, commands[next_command].command);
+      printf("SIM: %.6fs command '%s' returned %d\n", sim.now / 1e6, commands[next_command].command, ret);
+      measure_from = sim.now;
+      next_command++;
+    }
+    loop();
+    sim.advance(loop_us);
+    if (real_time) {
+      // wait whenever the virtual clock is more than 1ms ahead
+      int64_t ahead = (int64_t) (sim.now - virtual_start) -
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wall_start).count();
+      if (ahead > 1000) usleep(ahead);
+    }
+    if (stall_period_ms > 0 && sim.now >= next_stall) {
+      sim.advance(stall_us);
+      next_stall += stall_period_ms * 1000;
+    }
+  }
+
+  // analysis of the steady state after the last command
+  uint8_t step_on = driver->step_on;
+  uint8_t dir_forward = HIGH ^ (driver->dir_cw != LOW); // same pin inversion as StepperController::init()
+  SimStepStats stats = analyzeSteps(sim.edges, board->step, step_on, board->dir, dir_forward, measure_from, end);
+  double expected_rate = (state->status == STATUS_ON || state->status == STATUS_ROTATE || state->status == STATUS_RUN) ?
+    state->rpm / 60.0 * motor->steps * motor->gearing * state->ms_mode : 0.0;
+
+  printf("\nSIM: %.3fs virtual time, %lu pin edges recorded\n", sim.now / 1e6, (unsigned long) sim.edges.size());
+  printf("state:          status %d, %.4f rpm, ms %d%s, dir %d\n", state->status, state->rpm, state->ms_mode, state->ms_auto ? " (auto)" : "", state->direction);
+  printStepStats(stats, expected_rate);
+  if (pump->getSustainableRate() > 0) {
+    printf("limits:         %.0f steps/s (%.0f steps/s sustained in the self-calibration), full step rpm limit %.1f\n",
+      pump->getMaxSpeed(), pump->getSustainableRate(), pump->getMaxRpm());
+  } else {
+    printf("limits:         %.0f steps/s (board, not calibrated yet), full step rpm limit %.1f\n", pump->getMaxSpeed(), pump->getMaxRpm());
+  }
+  if (signal_period_ms > 0) {
+    // edge to first step pulse as seen on the pins (rising edges for dose, both for a gate)
+    SimTriggerStats trigger_stats = analyzeTrigger(sim.edges, board->trigger, board->step, step_on, measure_from, end);
+    printf("trigger:        %lu edges, %lu started steps, latency mean %.2fus, max %lluus\n", trigger_stats.edges,
+      trigger_stats.starts, trigger_stats.latency_mean, (unsigned long long) trigger_stats.latency_max);
+  }
+
+  if (recording_file) {
+    // return codes in order, changes of the settings in order
+    SimRecording replay = parseRecording(replay_output);
+    size_t n = std::min(recording.commands.size(), replay.commands.size()), codes = 0, states = 0, first = 0;
+    for (size_t i = 0; i < n; i++) if (recording.commands[i].ret != replay.commands[i].ret) codes++;
+    std::vector<SimRecordedState> recorded = getSettingChanges(recording.states), replayed = getSettingChanges(replay.states);
+    n = std::min(recorded.size(), replayed.size());
+    for (size_t i = 0; i < n; i++) {
+      if (recorded[i].state == replayed[i].state) states++;
+      else if (states == i) first = i + 1;
+    }
+    printf("replay:         %lu of %lu commands, %lu return codes differ, %lu of %lu state changes match (%lu replayed)\n",
+      (unsigned long) replay.commands.size(), (unsigned long) recording.commands.size(), (unsigned long) codes,
+      (unsigned long) states, (unsigned long) recorded.size(), (unsigned long) replayed.size());
+    if (first > 0) {
+      printf("   recorded %.3fs: %s\n", recorded[first - 1].time / 1e6, recorded[first - 1].state.c_str());
+      printf("   replayed %.3fs: %s\n", replayed[first - 1].time / 1e6, replayed[first - 1].state.c_str());
+    }
+    if (replay_file) {
+      FILE* file = fopen(replay_file, "w");
+      if (file && fputs(replay_output.c_str(), file) >= 0) printf("replay:         saved to %s\n", replay_file);
+      else printf("replay:         could not write %s\n", replay_file);
+      if (file) fclose(file);
+    }
+  }
+
+  if (motor_model) {
+    printf("motor:          %lu steps, %lu lost (first at %.6fs), rotor %.4f rotations behind\n", sim_motor.steps, sim_motor.lost,
+      sim_motor.first_lost / 1e6, (double) (sim_motor.commanded - sim_motor.rotor) / sim_motor.units_per_rotation);
+  }
+
+  if (eeprom_file) {
+    FILE* file = fopen(eeprom_file, "wb");
+    if (file && fwrite(sim.eeprom, 1, sizeof(sim.eeprom), file) == sizeof(sim.eeprom)) printf("eeprom:         saved to %s\n", eeprom_file);
+    else printf("eeprom:         could not write %s\n", eeprom_file);
+    if (file) fclose(file);
+  }
+
+  if (trace_file) {
+    if (sim.saveTrace(trace_file)) printf("trace:          saved to %s\n", trace_file);
+    else printf("trace:          could not write %s\n", trace_file);
+  }
+
+  return(0);
+}
@@ -0,0 +1,158 @@
+// host tool: compare the pin traces (pump_sim -t) of two firmware revisions replaying the same recording (pump_sim -c)
+// - step counts and net position have to match, the k-th steps of both traces are compared for timing deviation
+// - dir and enable edges are counted
+// - with the recording: latency from each command to the first step, dir or enable edge after it
+// exits with 1 (and FAIL lines) if the step counts or positions differ or a limit is exceeded, e.g. to gate a release
+// build: make sim, usage: sim/trace_diff -h
+
+#include "application.h"
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include "../src/StepperConfig.h"
+#include "SimRecording.h"
+
+struct TraceSteps {
+  std::vector<uint64_t> times; // [us] of each step
+  long position = 0;
+  unsigned long dir_edges = 0;
+  unsigned long enable_edges = 0;
+};
+
+static TraceSteps getSteps(const std::vector<SimEdge>& edges, const StepperBoard* board, const StepperDriver* driver) {
+  TraceSteps steps;
+  uint8_t forward = driver->dir_cw ? LOW : HIGH; // same pin inversion as StepperController::init()
+  uint8_t dir = forward;
+  for (const SimEdge& edge : edges) {
+    if (edge.pin == board->dir) {
+      dir = edge.level;
+      steps.dir_edges++;
+    } else if (edge.pin == board->enable) {
+      steps.enable_edges++;
+    } else if (edge.pin == board->step && edge.level == driver->step_on) {
+      steps.times.push_back(edge.time);
+      steps.position += (dir == forward) ? 1 : -1;
+    }
+  }
+  return(steps);
+}
+
+// [us] from each command to the first step, dir or enable edge after it (-1 if there is none)
+static std::vector<int64_t> getLatencies(const std::vector<SimEdge>& edges, const SimRecording& recording, const StepperBoard* board) {
+  std::vector<int64_t> latencies;
+  size_t i = 0;
+  for (const SimRecordedCommand& command : recording.commands) {
+    while (i < edges.size() && edges[i].time < command.time) i++;
+    size_t j = i;
+    while (j < edges.size() && edges[j].pin != board->step && edges[j].pin != board->dir && edges[j].pin != board->enable) j++;
+    latencies.push_back(j < edges.size() ? (int64_t) (edges[j].time - command.time) : -1);
+  }
+  return(latencies);
+}
+
+int main(int argc, char** argv) {
+
+  const char* recording_file = nullptr;
+  double max_jitter = -1, max_latency = -1;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:j:l:h")) != -1) {
+    switch (opt) {
+      case 'c': recording_file = optarg; break;
+      case 'j': max_jitter = atof(optarg); break;
+      case 'l': max_latency = atof(optarg); break;
+      default:
+        printf(
+          "usage: trace_diff [-c recording] [-j max_us] [-l max_us] a.csv b.csv\n"
+          "  -c  recording both traces replayed (pump_sim -c), for the command latencies\n"
+          "  -j  fail if any step of b is more than max_us off the same step of a\n"
+          "  -l  fail if a command latency of b is more than max_us longer than in a\n");
+        return(opt == 'h' ? 0 : 1);
+    }
+  }
+  if (argc - optind != 2) {
+    printf("ERROR: two traces required (see -h)\n");
+    return(1);
+  }
+
+  Serial.echo = false;
+  const StepperBoard* board = &PHOTON_STEPPER_BOARD;
+  const StepperDriver* driver = &DRV8825;
+  std::vector<SimEdge> edges[2];
+  TraceSteps steps[2];
+  for (int i = 0; i < 2; i++) {
+    if (!loadTrace(argv[optind + i], &edges[i])) {
+      printf("ERROR: could not read trace %s\n", argv[optind + i]);
+      return(1);
+    }
+    steps[i] = getSteps(edges[i], board, driver);
+  }
+  bool failed = false;
+
+  printf("steps:          %lu / %lu (net position %ld / %ld)\n", (unsigned long) steps[0].times.size(), (unsigned long) steps[1].times.size(),
+    steps[0].position, steps[1].position);
+  if (steps[0].times.size() != steps[1].times.size() || steps[0].position != steps[1].position) {
+    printf("FAIL: step counts or positions differ\n");
+    failed = true;
+  }
+
+  // k-th step of a vs. k-th step of b
+  size_t n = std::min(steps[0].times.size(), steps[1].times.size());
+  if (n > 0) {
+    double sum = 0, max = 0;
+    size_t worst = 0;
+    for (size_t k = 0; k < n; k++) {
+      double deviation = fabs((double) steps[1].times[k] - (double) steps[0].times[k]);
+      sum += deviation;
+      if (deviation > max) {
+        max = deviation;
+        worst = k;
+      }
+    }
+    printf("step timing:    deviation mean %.2fus, max %.0fus (step %lu at %.6fs)\n", sum / n, max, (unsigned long) worst + 1,
+      steps[0].times[worst] / 1e6);
+    if (max_jitter >= 0 && max > max_jitter) {
+      printf("FAIL: step timing deviation %.0fus > %.0fus\n", max, max_jitter);
+      failed = true;
+    }
+  }
+  printf("edges:          dir %lu / %lu, enable %lu / %lu\n", steps[0].dir_edges, steps[1].dir_edges, steps[0].enable_edges, steps[1].enable_edges);
+
+  if (recording_file) {
+    SimRecording recording;
+    if (!loadRecording(recording_file, &recording)) {
+      printf("ERROR: could not read recording %s\n", recording_file);
+      return(1);
+    }
+    std::vector<int64_t> latencies[2] = { getLatencies(edges[0], recording, board), getLatencies(edges[1], recording, board) };
+    for (int i = 0; i < 2; i++) {
+      double sum = 0;
+      int64_t max = 0;
+      size_t count = 0;
+      for (int64_t latency : latencies[i]) {
+        if (latency < 0) continue;
+        sum += latency;
+        if (latency > max) max = latency;
+        count++;
+      }
+      printf("latency %c:      %lu commands, mean %.1fus, max %ldus\n", 'a' + i, (unsigned long) count, count > 0 ? sum / count : 0.0, (long) max);
+    }
+    int64_t increase = 0;
+    size_t worst = 0;
+    for (size_t k = 0; k < recording.commands.size(); k++) {
+      if (latencies[0][k] < 0 || latencies[1][k] < 0) continue;
+      if (latencies[1][k] - latencies[0][k] > increase) {
+        increase = latencies[1][k] - latencies[0][k];
+        worst = k;
+      }
+    }
+    if (increase > 0) printf("latency b - a:  worst +%ldus ('%s' at %.3fs)\n", (long) increase, recording.commands[worst].command.c_str(),
+      recording.commands[worst].time / 1e6);
+    if (max_latency >= 0 && increase > max_latency) {
+      printf("FAIL: command latency +%ldus > %.0fus\n", (long) increase, max_latency);
+      failed = true;
+    }
+  }
+
+  printf("%s\n", failed ? "traces differ" : "traces match");
+  return(failed ? 1 : 0);
+}
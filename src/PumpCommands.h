@@ -1,8 +1,7 @@
+// PUMP SPECIFIC COMMANDS
+#define CMD_DISPENSE    "dispense" // pump dispense amount units [msg] : dispense a certain amount at the fastest speed the microstepping allows (requires step-flow calibration)
 
-// PUMP SPECIFIC COMMANDS - NOT IMPLEMENTED YET FIXME
-#define CMD_DISPENSE    "dispense" // pump dispense amount [msg] : dispense a certain amount (requires step-flow calibration)
-
-#define CMD_SET         "calibrate" // pump calibrate variable value [msg]
+#define CMD_SET         "calibrate" // pump calibrate variable value units [msg]
 #define SET_STEP_FLOW   "step-flow" // set flow per step (step-flow)
 #define SET_ROT_FLOW    "rotation-flow" // set step-flow (step-flow) from flow per rotation [requires step-angle]
 #define SET_FPM         "fpm" // set step-flow (step-flow) from flow per minute [requires step-angle and current speed]
@@ -11,3 +10,5 @@
 
 #define CMD_RET_ERR_SET  -4
 #define ERROR_SET        "unknown calibrate"
+#define CMD_RET_ERR_CALIB -5
+#define ERROR_CALIB      "requires step-flow calibration"
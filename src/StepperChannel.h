@@ -0,0 +1,424 @@
+#pragma once
+#include "StepperState.h"
+#include "StepperConfig.h"
+#include "StepperEngine.h"
+#include "StepperJournal.h"
+
+// motor channel: board pins, driver, motor, state and step engine of one motor run by the controller
+// - channel 1 is the controller's own motor, additional channels (e.g. a second pump head) are 2, 3, ... (see StepperController::addChannel())
+// - the step engines of all channels share the step scheduler's timer interrupt (see StepperScheduler.h)
+// - commands are addressed to a channel with 'ch <channel> <command>' (start, stop, hold, direction, speed, ms and ramp on all channels)
+// - every channel runs continuously (on, off, hold) with the same rpm limits, acceleration limit and auto microstepping,
+//   an extension adds the motion modes and bookkeeping of channel 1 ('rotate', 'run', 'dispense', trigger, program, odometer)
+#define STEPPER_CHANNELS_MAX        STEPPER_SCHEDULER_TASKS_MAX // including channel 1 (one step engine each)
+#define STEPPER_CHANNEL_INFO_SIZE   64
+
+// motion modes beyond on, off and hold (the controller for its own motor)
+class StepperChannelExtension {
+  public:
+    virtual bool updateMotion(float acceleration) = 0; // once the microstepping is updated, true if it drove the step engine
+    virtual void stateChanged() = 0; // after the state was queued for the journal
+};
+
+class StepperChannel {
+
+  private:
+
+    // configuration
+    const StepperBoard* board;
+    const StepperDriver* driver;
+    const StepperMotor* motor;
+    StepperEngine stepper;
+    StepperChannelExtension* extension = nullptr;
+    float rpm_limit; // full step rpm limit (limits of the microstepping modes are rpm_limit / mode)
+    float units_per_rotation; // step engine position units (steps in the finest microstepping mode) per rotation
+    int ms_index_active = -1; // ms index requested from the step engine (differs from state->ms_index while ramping in auto mode)
+    bool ramp_ms_update = false; // whether microstepping follows an ongoing ramp
+    bool batching = false;
+    bool batch_update = false; // whether the stepper needs an update once the batch is complete
+    float batch_rpm_per_s = -1; // acceleration for the deferred update (from a 'ramp' in the batch)
+
+    // state
+    StepperState* state;
+    StepperState defaults; // if the journal has no valid state for the channel
+    StepperJournal* journal = nullptr;
+    uint8_t journal_state;
+
+    // state information (reformatted after state changes)
+    char info[STEPPER_CHANNEL_INFO_SIZE];
+    bool info_dirty = true;
+
+    void updateRampMicrostepping(); // auto microstepping: follow the speed while ramping
+
+  public:
+
+    StepperChannel(const StepperBoard* board, const StepperDriver* driver, const StepperMotor* motor, StepperState* state) :
+      board(board), driver(driver), motor(motor), state(state), defaults(*state) {
+        // rpm limits are determined by how fast the step engine can go on this board
+        stepper.setMaxSpeed(board->max_speed);
+        rpm_limit = motor->getFullStepRpmLimit(stepper.getMaxSpeed());
+        units_per_rotation = motor->steps * motor->gearing * driver->getFullStepUnits();
+    };
+
+    void extend(StepperChannelExtension* extension) { this->extension = extension; }; // before init()
+    void addToJournal(StepperJournal* journal); // register the state (before the journal is restored)
+    bool restoreState(); // check the state restored from the journal (back to the initial state if invalid)
+    void restoreState(const StepperState& saved); // return to a saved state (a failed batch, the stepper was not updated)
+    void saveState(); // queue the state for the journal
+    void startBatch(); // defer stepper updates until the batch ends
+    void endBatch(bool apply); // one update if anything changed (apply = false: the batch failed)
+    void init(); // during the controller's init() (after restoring)
+    void update(); // during the controller's update()
+    void updateStepper(float rpm_per_s = -1); // update the step engine (speed changes ramp at rpm_per_s, default: motor acceleration limit)
+    void updateMicrostepping(int ms_index); // switch the step engine and driver to the ms index (once on the coarser mode's step grid)
+    bool changeMaxSpeed(float speed); // step rate limit [steps/s] (at most the board's), the speed follows the new rpm limits (true if they changed)
+
+    StepperEngine* getStepper() { return(&stepper); };
+    StepperState* getState() { return(state); };
+    float getMaxRpm() { return(rpm_limit); }; // full step rpm limit
+    float getUnitsPerRotation() { return(units_per_rotation); };
+    float getCurrentRpm() { return(stepper.getSpeed() * 60.0 / units_per_rotation); }; // actual rpm (differs from state->rpm while ramping)
+    StepTimingStats* getTiming() { return(stepper.getTiming()); };
+    const char* getStateInformation(uint8_t channel); // "ch<channel>":"<status> <dir> <speed> <ms>"
+    bool isRotating() { return(state->status == STATUS_ROTATE || state->status == STATUS_RUN); }; // towards a target position
+    StepInterval calculateUnitInterval(); // interval per position unit at the state's speed
+    float calculateAcceleration(float rpm_per_s) { return(rpm_per_s / 60.0 * units_per_rotation); }; // in position units/s^2
+    int findMicrostepIndexForRpm(float rpm); // finds the correct ms index for the requested rpm (takes ms_auto into consideration)
+    bool setSpeedWithSteppingLimit(float rpm); // sets state->rpm and returns true if request set, false if had to set to limit
+
+    bool changeStatus(int status, float rpm_per_s = -1); // (status changes ramp at rpm_per_s, default: motor acceleration limit)
+    bool changeDirection(int direction);
+    bool changeSpeedRpm(float rpm); // return false if had to limit speed, true if taking speed directly
+    bool changeToAutoMicrosteppingMode(); // set to automatic microstepping mode
+    bool changeMicrosteppingMode(int ms_mode); // set microstepping by mode, return false if can't find requested mode
+    bool ramp(float rpm, float minutes); // ramp linearly from the current speed to rpm over minutes (starts the motor if not running)
+
+};
+
+/**** SETUP AND LOOP ****/
+
+void StepperChannel::addToJournal(StepperJournal* journal) {
+  this->journal = journal;
+  journal_state = journal->addField(state);
+}
+
+bool StepperChannel::restoreState() {
+  // only continuous modes without an extension
+  bool valid = state->version == STATE_VERSION &&
+    (extension || state->status == STATUS_ON || state->status == STATUS_OFF || state->status == STATUS_HOLD);
+  if (!valid) {
+    *state = defaults;
+    saveState();
+  }
+  return(valid);
+}
+
+void StepperChannel::restoreState(const StepperState& saved) {
+  if (memcmp(state, &saved, sizeof(StepperState)) == 0) return;
+  *state = saved;
+  saveState();
+}
+
+void StepperChannel::saveState() {
+  if (journal != nullptr) journal->change(journal_state);
+  info_dirty = true;
+  if (extension) extension->stateChanged();
+}
+
+void StepperChannel::startBatch() {
+  batching = true;
+  batch_update = false;
+  batch_rpm_per_s = -1;
+}
+
+void StepperChannel::endBatch(bool apply) {
+  batching = false;
+  if (apply && batch_update) updateStepper(batch_rpm_per_s);
+  batch_update = false;
+}
+
+void StepperChannel::init() {
+  stepper.init(board->step, board->dir, board->enable);
+  stepper.setPinsInverted(driver->dir_cw != LOW, driver->step_on != HIGH, driver->enable_on != LOW);
+  stepper.disableOutputs();
+  state->ms_index = findMicrostepIndexForRpm(state->rpm);
+  state->ms_mode = driver->getMode(state->ms_index);
+  stepper.initMicrostepping(board->ms1, board->ms2, board->ms3);
+  updateStepper();
+}
+
+void StepperChannel::update() {
+  if (ramp_ms_update) updateRampMicrostepping();
+}
+
+/**** UPDATING STEPPER ****/
+
+void StepperChannel::updateStepper(float rpm_per_s) {
+  // batch: one update once all commands are parsed
+  if (batching) {
+    batch_update = true;
+    if (rpm_per_s >= 0) batch_rpm_per_s = rpm_per_s;
+    return;
+  }
+
+  // acceleration limit
+  if (rpm_per_s < 0) rpm_per_s = motor->acceleration;
+  bool running = state->status == STATUS_ON || isRotating();
+
+  // update microstepping (in auto mode, the mode follows the speed of a running ramp instead,
+  // and of a 'rotate' until it stops so it ends in a mode fine enough to land on the target exactly,
+  // a program picks the mode for its fastest segment in the extension)
+  bool ramping = state->ms_auto && rpm_per_s > 0 && stepper.isRunning();
+  if (!ramping && state->status != STATUS_PROGRAM) updateMicrostepping(state->ms_index);
+  ramp_ms_update = state->ms_auto && rpm_per_s > 0 && running;
+
+  // motion modes of the extension
+  float acceleration = calculateAcceleration(rpm_per_s);
+  if (extension && extension->updateMotion(acceleration)) return;
+
+  // update speed and enabled / disabled
+  if (state->status == STATUS_ON) {
+    stepper.enableOutputs();
+    stepper.runInterval(calculateUnitInterval(), state->direction, acceleration);
+  } else if (state->status == STATUS_HOLD) {
+    stepper.decelerate(acceleration);
+    stepper.enableOutputs();
+  } else {
+    // STATUS_OFF (outputs are disabled once stopped)
+    stepper.decelerate(acceleration, true);
+  }
+}
+
+// the rpm limits (and with them auto microstepping and the speed) follow the step rate the board sustains
+bool StepperChannel::changeMaxSpeed(float speed) {
+  stepper.setMaxSpeed(speed < board->max_speed ? speed : board->max_speed);
+  float rpm_limit_before = rpm_limit;
+  rpm_limit = motor->getFullStepRpmLimit(stepper.getMaxSpeed());
+  if (fabs(rpm_limit - rpm_limit_before) <= 0.0001) return(false);
+  changeSpeedRpm(state->rpm);
+  return(true);
+}
+
+// the step engine keeps position, speed and targets (all in mode independent units) across the change
+void StepperChannel::updateMicrostepping(int ms_index) {
+  if (ms_index < 0 || ms_index >= driver->ms_modes_n) return;
+  ms_index_active = ms_index;
+  stepper.setMicrostepping(driver->getStepUnits(ms_index),
+    driver->ms_modes[ms_index].ms1, driver->ms_modes[ms_index].ms2, driver->ms_modes[ms_index].ms3);
+}
+
+// switch to the coarser mode before a ramp reaches the rpm limit, to the finer mode once slow enough
+// (only coarser while accelerating: a ramp starting from standstill stays in the mode it started in until it is fast enough,
+// the first steps of a ramp are too few to carry over into a finer mode)
+void StepperChannel::updateRampMicrostepping() {
+  if (!stepper.isRamping() && !(isRotating() && stepper.isRunning())) {
+    // ramp complete (or stopped short at the active mode's limit): finish in the mode for the target speed
+    ramp_ms_update = false;
+    if (ms_index_active != state->ms_index) updateMicrostepping(state->ms_index);
+    return;
+  }
+  float rpm = getCurrentRpm();
+  if (stepper.isAccelerating()) rpm *= STEPPER_RAMP_MS_MARGIN;
+  int ms_index = driver->findMicrostepIndexForRpm(rpm, rpm_limit);
+  if (stepper.isAccelerating() ? ms_index < ms_index_active : ms_index > ms_index_active) {
+    #ifdef STEPPER_DEBUG_ON
+      Serial.printf("INFO: ramp at %.3f rpm switching to microstepping mode %d\n", getCurrentRpm(), driver->getMode(ms_index));
+    #endif
+    updateMicrostepping(ms_index);
+  }
+}
+
+// interval per position unit in 32.32 fixed point us (float math only here when the speed changes, stepping is integer only)
+StepInterval StepperChannel::calculateUnitInterval() {
+  double units_per_minute = (double) state->rpm * units_per_rotation;
+  StepInterval interval = StepperEngine::getIntervalForSpeed(units_per_minute);
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: calculated speed %.5f steps/s (step interval %.5fus in mode %d)\n",
+      units_per_minute / 60.0 / driver->getStepUnits(state->ms_index),
+      (double) interval * driver->getStepUnits(state->ms_index) / STEP_INTERVAL_US, state->ms_mode);
+  #endif
+  return(interval);
+}
+
+int StepperChannel::findMicrostepIndexForRpm(float rpm) {
+  if (state->ms_auto) {
+    // automatic mode --> find lowest MS mode that can handle these rpm (otherwise go to full step -> ms_index = 0)
+    return(driver->findMicrostepIndexForRpm(rpm, rpm_limit));
+  } else {
+    return(state->ms_index);
+  }
+}
+
+bool StepperChannel::setSpeedWithSteppingLimit(float rpm) {
+  if (driver->testRpmLimit(state->ms_index, rpm, rpm_limit)) {
+    state->rpm = driver->getRpmLimit(state->ms_index, rpm_limit);
+    Serial.printf("WARNING: stepping mode is not fast enough for the requested rpm: %.3f --> switching to MS mode rpm limit of %.3f\n", rpm, state->rpm);
+    return(false);
+  } else {
+    state->rpm = rpm;
+    return(true);
+  }
+}
+
+/**** STATE CHANGES ****/
+
+bool StepperChannel::changeStatus(int status, float rpm_per_s) {
+
+  // only update if necessary (statuses beyond on, off and hold need the extension)
+  bool valid = extension || status == STATUS_ON || status == STATUS_OFF || status == STATUS_HOLD;
+  bool changed = valid && status != state->status;
+
+  #ifdef STEPPER_DEBUG_ON
+    if (changed)
+      Serial.printf("INFO: status updating to %d\n", status);
+    else
+      Serial.printf("INFO: status unchanged (%d)\n", status);
+  #endif
+
+  if (changed) {
+    state->status = status;
+    updateStepper(rpm_per_s);
+    saveState();
+  }
+  return(changed);
+}
+
+bool StepperChannel::changeDirection(int direction) {
+
+  // only update if necessary
+  bool changed = (direction == DIR_CW || direction == DIR_CC) && state->direction != direction;
+
+  #ifdef STEPPER_DEBUG_ON
+    if (changed)
+      (direction == DIR_CW) ? Serial.println("INFO: changing direction to clockwise") : Serial.println("INFO: changing direction to counter clockwise");
+    else
+      (direction == DIR_CW) ? Serial.println("INFO: direction unchanged (clockwise)") : Serial.println("INFO: direction unchanged (counter clockwise)");
+  #endif
+
+  if (changed) {
+    state->direction = direction;
+    if (isRotating()) {
+      // if rotating to a specific position, changing direction turns the motor off
+      #ifdef STEPPER_DEBUG_ON
+        Serial.println("INFO: stepper stopped due to change in direction during 'rotate' or 'run'");
+      #endif
+      state->status = STATUS_OFF;
+    }
+    updateStepper();
+    saveState();
+  }
+
+  return(changed);
+}
+
+bool StepperChannel::changeSpeedRpm(float rpm) {
+  int original_ms_mode = state->ms_mode;
+  float original_rpm = state->rpm;
+  state->ms_index = findMicrostepIndexForRpm(rpm);
+  state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
+  setSpeedWithSteppingLimit(rpm);
+  bool changed = state->ms_mode != original_ms_mode || fabs(state->rpm - original_rpm) > 0.0001;
+
+  #ifdef STEPPER_DEBUG_ON
+    if (changed)
+      Serial.printf("INFO: changing rpm %.3f\n", state->rpm);
+    else
+      Serial.printf("INFO: rpm staying unchanged ()%.3f)\n", state->rpm);
+  #endif
+
+  if (changed) {
+    updateStepper();
+    saveState();
+  }
+  return(changed);
+}
+
+bool StepperChannel::changeToAutoMicrosteppingMode() {
+
+  bool changed = !state->ms_auto;
+
+  #ifdef STEPPER_DEBUG_ON
+    if (changed)
+      Serial.println("INFO: activating automatic microstepping");
+    else
+      Serial.println("INFO: automatic microstepping already active");
+  #endif
+
+  if (changed) {
+    state->ms_auto = true;
+    state->ms_index = findMicrostepIndexForRpm(state->rpm);
+    state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
+    updateStepper();
+    saveState();
+  }
+  return(changed);
+}
+
+bool StepperChannel::changeMicrosteppingMode(int ms_mode) {
+
+  // find index for requested microstepping mode
+  int ms_index = driver->findMicrostepIndexForMode(ms_mode);
+
+  // no index found for requested mode
+  if (ms_index == -1) {
+    Serial.printf("WARNING: could not find microstep index for mode %d\n", ms_mode);
+    return(false);
+  }
+
+  bool changed = state->ms_auto || state->ms_index != ms_index;
+  #ifdef STEPPER_DEBUG_ON
+    if (changed)
+      Serial.printf("INFO: activating microstepping index %d for mode %d\n", ms_index, ms_mode);
+    else
+      Serial.printf("INFO: microstepping mode already active (%d)\n", state->ms_mode);
+  #endif
+
+  if (changed) {
+    // update with new microstepping mode
+    state->ms_auto = false; // deactivate auto microstepping
+    state->ms_index = ms_index; // set the found index
+    state->ms_mode = driver->getMode(ms_index); // tracked for convenience
+    setSpeedWithSteppingLimit(state->rpm); // update speed (if necessary)
+    updateStepper();
+    saveState();
+  }
+  return(changed);
+}
+
+// ramp (linear in time, at most at the motor's acceleration limit)
+bool StepperChannel::ramp(float rpm, float minutes) {
+  float from_rpm = getCurrentRpm();
+  state->ms_index = findMicrostepIndexForRpm(rpm);
+  state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
+  setSpeedWithSteppingLimit(rpm);
+  float rpm_per_s = (minutes > 0) ? fabs(state->rpm - from_rpm) / (minutes * 60.0) : motor->acceleration;
+  if (motor->acceleration > 0 && rpm_per_s > motor->acceleration) {
+    Serial.printf("WARNING: ramp exceeds the acceleration limit --> ramping at %.1f rpm/s\n", motor->acceleration);
+    rpm_per_s = motor->acceleration;
+  }
+
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: ramping from %.3f to %.3f rpm at %.4f rpm/s\n", from_rpm, state->rpm, rpm_per_s);
+  #endif
+
+  // ramping from standstill starts the motor (like 'start', at the ramp's acceleration)
+  if (state->status == STATUS_ON || isRotating() || !changeStatus(STATUS_ON, rpm_per_s)) updateStepper(rpm_per_s);
+  saveState();
+  // ramp always counts as new command b/c it starts from the current speed
+  return(true);
+}
+
+/**** STATE INFORMATION ****/
+
+const char* StepperChannel::getStateInformation(uint8_t channel) {
+  if (info_dirty) {
+    char status[10], direction[10], speed[20], ms[10];
+    getStepperStateStatusInfo(state->status, status, sizeof(status), true);
+    getStepperStateDirectionInfo(state->direction, direction, sizeof(direction), true);
+    getStepperStateSpeedInfo(state->rpm, speed, sizeof(speed), true);
+    getStepperStateMSInfo(state->ms_auto, state->ms_mode, ms, sizeof(ms), true);
+    snprintf(info, sizeof(info), "\"ch%d\":\"%s %s %s %s\"", channel, status, direction, speed, ms);
+    info_dirty = false;
+  }
+  return(info);
+}
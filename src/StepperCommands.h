@@ -2,9 +2,14 @@
 #define CMD_START       "start" // device start [msg] : starts the stepper
 #define CMD_STOP        "stop" // device stop [msg] : stops the stepper (stops power)
 #define CMD_HOLD        "hold" // device hold [msg] : engage the stepper but not running (power on, no flow)
-#define CMD_RUN         "run" // device run minutes [msg] : runs the stepper for x minutes
-#define CMD_AUTO        "auto" // device auto [msg] : listens to external trigger on the trigger pin
+#define CMD_RUN         "run" // device run minutes [msg] : runs the stepper for x minutes (the duration at the current speed as an exact number of steps, rescaled when the speed changes)
+#define CMD_AUTO        "auto" // device auto [gate/dose rotations] [msg] : listens to the external trigger on the board's trigger pin (gate: run while high (default), dose: rotate by a fixed number of rotations on every rising edge)
+  #define CMD_AUTO_GATE   "gate"
+  #define CMD_AUTO_DOSE   "dose"
 #define CMD_ROTATE      "rotate" // device rotate number [msg] : run for x number of rotations
+#define CMD_PROGRAM     "program" // device program [segments/start] [msg] : load and start a speed program (saved) or start the saved one again, segments are comma separated rpm@length with the length in m(inutes), s(econds) or r(otations), negative rpm reverse, 0 rpm holds, a trailing ~ ramps linearly from the previous speed over the segment (e.g. 10@5m,40@2m~,0@30s,-10@3r)
+  #define CMD_PROGRAM_START     "start"
+  #define CMD_PROGRAM_SEPARATOR ','
 
 // direction
 #define CMD_DIR         "direction" // device direction cw/cc/switch [msg] : set the direction
@@ -21,6 +26,40 @@
 #define CMD_STEP        "ms" // device ms number/auto [msg] : set the microstepping
   #define CMD_STEP_AUTO   "auto" // signal to put microstepping into automatic mode (i.e. always pick the highest microstepping that the clockspeed supports)
 
+// batch
+#define CMD_BATCH       "batch" // device batch command; command; ... : execute the commands in order as one (all or none, one state save, rpm log and state update), returns the first error or the highest warning, data lists the result of each command
+  #define CMD_BATCH_SEPARATOR ';'
+
+// channels
+#define CMD_CHANNEL     "ch" // device ch channel command [msg] : send the command to a motor channel (1 = the controller's own motor, 2, 3, ... additional channels)
+
+// closed loop
+#define CMD_ENCODER     "encoder" // device encoder [off/stop/retry/backoff] [msg] : reaction to a stall or slip the encoder detects (off: open loop, stop: turn off, retry: restart, backoff: restart slower), not saved (default set in pump.cpp), reports the worst following error and number of stalls
+  #define CMD_ENCODER_OFF     "off"
+  #define CMD_ENCODER_STOP    "stop"
+  #define CMD_ENCODER_RETRY   "retry"
+  #define CMD_ENCODER_BACKOFF "backoff"
+
+// diagnostics
+#define CMD_TIMING      "timing" // device timing [reset] [msg] : report step timing statistics (missed deadlines, worst lateness, histogram on serial, trigger latency), reset to clear them
+  #define CMD_TIMING_RESET "reset"
+#define CMD_TELEMETRY   "telemetry" // device telemetry period_ms/off [serial/cloud] [msg] : sample the actual position, missed steps and loop lag every period_ms, flushed in encoded batches on serial (default) or as events (see StepperTelemetry.h)
+  #define CMD_TELEMETRY_OFF     "off"
+  #define CMD_TELEMETRY_SERIAL  "serial"
+  #define CMD_TELEMETRY_CLOUD   "cloud"
+#define CMD_RECORD      "record" // device record on/off [msg] : print every received command (time and return code) and state change on serial as R: lines for replaying them in the host simulation (sim/pump_sim -c), not saved
+  #define CMD_RECORD_ON   "on"
+  #define CMD_RECORD_OFF  "off"
+#define CMD_PROFILE     "profile" // device profile [msg] : report min/mean/p99/max duration of each loop phase (on serial) and reset (requires STEPPER_PROFILE_ON)
+
+// errors
+#define CMD_RET_ERR_TRIGGER   -6
+#define ERROR_TRIGGER         "board has no trigger input"
+#define CMD_RET_ERR_ENCODER   -7
+#define ERROR_ENCODER         "no encoder"
+#define CMD_RET_ERR_PROGRAM   -8
+#define ERROR_PROGRAM         "invalid or no program"
+
 // warnings
 #define CMD_RET_WARN_MAX_RPM      101
 #define CMD_RET_WARN_MAX_RPM_TEXT "exceeds max rpm"
@@ -1,5 +1,8 @@
 #pragma once
 
+// board, driver and motor configurations are literal types so the pre-configured options below
+// are constant expressions (stored in flash, nothing to allocate or fill in at startup)
+
 // board
 struct StepperBoard {
   const int dir; // direction
@@ -8,86 +11,81 @@ struct StepperBoard {
   const int ms1; // microstep 1
   const int ms2; // microstep 2
   const int ms3; // microstep 3
-  const float max_speed; // maximum # of steps/s the processor can reliably support (i.e. how often can the StepperController::update() be called?)
-  StepperBoard(int dir, int step, int enable, int ms1, int ms2, int ms3, float max_speed) :
-    dir(dir), step(step), enable(enable), ms1(ms1), ms2(ms2), ms3(ms3), max_speed(max_speed) {};
+  const float max_speed; // maximum # of steps/s the board can reliably support (further limited by the step engine, see STEPPER_ENGINE_MAX_SPEED)
+  const int trigger; // external trigger input ('auto' command, -1 = none), needs an interrupt capable pin
+  constexpr StepperBoard(int dir, int step, int enable, int ms1, int ms2, int ms3, float max_speed, int trigger = -1) :
+    dir(dir), step(step), enable(enable), ms1(ms1), ms2(ms2), ms3(ms3), max_speed(max_speed), trigger(trigger) {};
 };
 
 // microstep mode structure (driver chip specific)
 struct MicrostepMode {
-  int mode; // the mode for the ms mode
-  bool ms1; // HIGH or LOW for ms1
-  bool ms2; // HIGH or LOW for ms2
-  bool ms3; // HIGH or LOW for ms3
-  float rpm_limit; // the RPM limit for this microstepping mode (filled by StepperController later)
-  MicrostepMode() {};
-  MicrostepMode(int mode, bool ms1, bool ms2, bool ms3) :
-    mode(mode), ms1(ms1), ms2(ms2), ms3(ms3), rpm_limit(-1) {}
+  const int mode; // the mode for the ms mode
+  const bool ms1; // HIGH or LOW for ms1
+  const bool ms2; // HIGH or LOW for ms2
+  const bool ms3; // HIGH or LOW for ms3
+  constexpr MicrostepMode(int mode, bool ms1, bool ms2, bool ms3) :
+    mode(mode), ms1(ms1), ms2(ms2), ms3(ms3) {}
 };
 
+// auto microstepping during ramps: switch to the coarser mode once the speed is within this factor of the mode's rpm limit
+#define STEPPER_RAMP_MS_MARGIN  1.1
 
 // driver
+// microstep modes must be the consecutive powers of two 1, 2, 4, ... (checked at compile time)
+// so that mode lookups and rpm limits are constant time: mode = 1 << index, rpm limit = full step rpm limit / mode
 struct StepperDriver {
   const bool dir_cw; // is clockwise LOW or HIGH?
   const bool step_on; // is a step made on LOW or HIGH?
   const bool enable_on; // is enable on LOW or HIGH?
   const int ms_modes_n; // number of microstepping modes
-  MicrostepMode* ms_modes; // microstepping modes
-  StepperDriver(bool dir_cw, bool step_on, bool enable_on, MicrostepMode* ms_modes, int ms_modes_n) :
-    dir_cw(dir_cw), step_on(step_on), enable_on(enable_on), ms_modes_n(ms_modes_n) {
-      // allocate microstep modes (FIXME: is there a better way to do this with pointers?)
-      this->ms_modes = new MicrostepMode[ms_modes_n];
-      for (int i = 0; i < ms_modes_n; i++) this->ms_modes[i] = ms_modes[i];
-    };
-
-  // calculates rpm limits for all modes
-  void calculateRpmLimits(float max_speed, int steps, double gearing) {
-    for (int i = 0; i < ms_modes_n; i++)
-      this->ms_modes[i].rpm_limit = max_speed * 60.0 / (steps * gearing * ms_modes[i].mode);
+  const MicrostepMode* const ms_modes; // microstepping modes (the table is not copied)
+  template<int N> constexpr StepperDriver(bool dir_cw, bool step_on, bool enable_on, const MicrostepMode (&ms_modes)[N]) :
+    dir_cw(dir_cw), step_on(step_on), enable_on(enable_on), ms_modes_n(N), ms_modes(ms_modes) {};
+
+  // check that the microstep modes are 1, 2, 4, ... (used for static_assert)
+  constexpr bool hasPowerOfTwoModes(int i = 0) const {
+    return(i >= ms_modes_n || (ms_modes[i].mode == (1 << i) && hasPowerOfTwoModes(i + 1)));
   }
 
-  // find microstep index for specified rpm
-  int findMicrostepIndexForRpm(float rpm) {
-    //find lowest MS mode that can handle the rpm
-    int ms_index = 0;
-    for (int i = 1; i < ms_modes_n; i++) {
-      if (rpm <= ms_modes[i].rpm_limit) ms_index = i;
-    }
-    return(ms_index);
+  // find microstep index for specified rpm (lowest MS mode that can handle the rpm)
+  int findMicrostepIndexForRpm(float rpm, float full_step_rpm_limit) const {
+    // highest index with rpm <= full_step_rpm_limit / 2^index
+    float ratio = full_step_rpm_limit / rpm;
+    if (!(ratio >= 2.0)) return(0); // also catches rpm <= 0 / nan
+    if (ratio >= (float) (1 << (ms_modes_n - 1))) return(ms_modes_n - 1);
+    return(31 - __builtin_clz((uint32_t) ratio));
   }
 
-  // find microstep index for specified mode
-  int findMicrostepIndexForMode(int mode) {
-    // find index for requested microstepping mode
-    int ms_index = -1;
-    for (int i = 0; i < ms_modes_n; i++) {
-      if (ms_modes[i].mode == mode) {
-        ms_index = i;
-        break;
-      }
-    }
-    // none found --> -1
-    return(ms_index);
+  // find microstep index for specified mode (-1 if there is no such mode)
+  int findMicrostepIndexForMode(int mode) const {
+    if (mode <= 0 || (mode & (mode - 1)) != 0) return(-1); // not a power of two
+    int ms_index = __builtin_ctz(mode);
+    return(ms_index < ms_modes_n ? ms_index : -1);
   }
 
   // get mode for index
-  int getMode(int index) {
+  constexpr int getMode(int index) const {
     return(ms_modes[index].mode);
   }
 
-  // get rpm limit for mode index
-  float getRpmLimit(int index) {
-    return(ms_modes[index].rpm_limit);
+  // position units per full step (1 unit = 1 step in the finest mode)
+  constexpr int getFullStepUnits() const {
+    return(ms_modes[ms_modes_n - 1].mode);
   }
 
-  // test whether rpm is too high for the mode index
-  bool testRpmLimit(int index, float rpm) {
-    return(rpm > getRpmLimit(index));
+  // position units per step for mode index
+  constexpr int getStepUnits(int index) const {
+    return(getFullStepUnits() / ms_modes[index].mode);
   }
 
-  // destructor (deallocate ms_modes)
-  virtual ~StepperDriver(){
-     delete[] ms_modes;
+  // get rpm limit for mode index
+  constexpr float getRpmLimit(int index, float full_step_rpm_limit) const {
+    return(full_step_rpm_limit / ms_modes[index].mode);
+  }
+
+  // test whether rpm is too high for the mode index
+  constexpr bool testRpmLimit(int index, float rpm, float full_step_rpm_limit) const {
+    return(rpm > getRpmLimit(index, full_step_rpm_limit));
   }
 
 };
@@ -96,26 +94,60 @@ struct StepperDriver {
 struct StepperMotor {
   const int steps; // numer of steps / rotation
   const double gearing; // the gearing (if any, otherwise should be 1)
-  StepperMotor(int steps, double gearing) :
-    steps(steps), gearing(gearing) {};
+  const float acceleration; // acceleration limit for start, stop and speed changes [rpm/s] (0 = no limit, instant speed changes)
+  constexpr StepperMotor(int steps, double gearing, float acceleration) :
+    steps(steps), gearing(gearing), acceleration(acceleration) {};
 
+  // rpm limit in full step mode for a maximum # of steps/s
+  constexpr float getFullStepRpmLimit(float max_speed) const {
+    return(max_speed * 60.0 / (steps * gearing));
+  }
+};
+
+// quadrature encoder on the motor shaft (closed loop feedback, see StepperEncoder.h)
+struct StepperEncoderConfig {
+  const int a; // channel A, needs an interrupt capable pin
+  const int b; // channel B, needs an interrupt capable pin
+  const int counts; // counts per motor rotation (4x the encoder's lines, every edge of both channels counts)
+  const bool inverted; // whether the count goes down when the motor turns clockwise
+  constexpr StepperEncoderConfig(int a, int b, int counts, bool inverted = false) :
+    a(a), b(b), counts(counts), inverted(inverted) {};
 };
 
 /****** pre-configured options **********/
 
-StepperBoard PHOTON_STEPPER_BOARD (
+constexpr StepperBoard PHOTON_STEPPER_BOARD (
   /* dir */         D2,
   /* step */        D3,
   /* enable */      D7,
   /* ms1 */         D6,
   /* ms2 */         D5,
   /* ms3 */         D4,
-  /* max steps/s */ 1000.0
+  /* max steps/s */ 8000.0,
+  /* trigger */     A7 // WKP (own interrupt line)
+);
+
+// second pump head on the analog pins (additional motor channel, A5 is the controller's reset pin)
+// the step rates of all channels add up in the shared step interrupt, so this one is limited to half the rate
+constexpr StepperBoard PHOTON_STEPPER_BOARD_2 (
+  /* dir */         A0,
+  /* step */        A1,
+  /* enable */      A2,
+  /* ms1 */         A3,
+  /* ms2 */         A4,
+  /* ms3 */         A6,
+  /* max steps/s */ 4000.0
+);
+
+// 100 line encoder on the analog pins (shares them with the second pump head, one or the other)
+constexpr StepperEncoderConfig PHOTON_ENCODER_400 (
+  /* a */           A0,
+  /* b */           A1,
+  /* counts/rot */  400
 );
 
 // microstep modes of the DRV8825 chip
-const int DRV8825_MICROSTEP_MODES_N = 6;
-MicrostepMode DRV8825_MICROSTEP_MODES[DRV8825_MICROSTEP_MODES_N] =
+constexpr MicrostepMode DRV8825_MICROSTEP_MODES[] =
   {
     /* n_steps, MS1, MS2, MS3 */
     {1,  LOW,  LOW,  LOW},  // full step
@@ -126,16 +158,17 @@ MicrostepMode DRV8825_MICROSTEP_MODES[DRV8825_MICROSTEP_MODES_N] =
     {32, HIGH, LOW,  HIGH},  // 1/32 step
   };
 
-StepperDriver DRV8825(
+constexpr StepperDriver DRV8825(
   /* dir cw */      HIGH,
   /* step on */     HIGH,
   /* enable on */   HIGH,
-  /* modes */       DRV8825_MICROSTEP_MODES,
-  /* modes_n */     DRV8825_MICROSTEP_MODES_N
+  /* modes */       DRV8825_MICROSTEP_MODES
 );
+static_assert(DRV8825.hasPowerOfTwoModes(), "DRV8825 microstep modes must be 1, 2, 4, ...");
 
 // watson marlow pumphead
-StepperMotor WM114ST (
+constexpr StepperMotor WM114ST (
   /* steps */      200,  // 200 steps/rotation
-  /* gearing */      1
+  /* gearing */      1,
+  /* rpm/s */      300   // acceleration limit: 0 to 300 rpm in 1s
 );
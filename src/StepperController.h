@@ -2,40 +2,252 @@
 #include "StepperState.h"
 #include "StepperConfig.h"
 #include "StepperCommands.h"
+#include "PumpCommands.h"
+#include "StepperEngine.h"
+#include "StepperEncoder.h"
+#include "StepperProfiler.h"
+#include "StepperOdometer.h"
+#include "StepperJournal.h"
+#include "StepperStateFragments.h"
+#include "StepperDisplayBuffer.h"
+#include "StepperChannel.h"
+#include "StepperTelemetry.h"
+#include "StepperRateCalibration.h"
+#ifdef LOCAL_CONTROL_ON
+  #include "StepperLocalChannel.h"
+#endif
 #include "device/DeviceController.h"
-#include <AccelStepper.h>
 
-// stepper controller class
-class StepperController : public DeviceController {
+// state events: published when the settings change (instead of clients polling the state variable)
+// - settings are status, direction, speed, microstepping, lock, calibration, trigger mode and the other channels' settings,
+//   measured fields that change by themselves while running (odometer, volume, timing, run and program progress, limits,
+//   encoder) ride along in the next event or go out with the heartbeat (at most every STATE_EVENT_HEARTBEAT_MS)
+// - at most one event per STATE_EVENT_PERIOD_MS (Particle allows 1 event/s on average), changes in between are coalesced into the next event
+// - event data: {"seq":<sequence nr>,"state":<state information>} (state null if too long for an event, fetch the state variable instead)
+// - the sequence nr counts events since boot (also in the state_seq variable), a gap means a client missed an event
+#define STATE_EVENT               "state"
+#define STATE_EVENT_SEQ           "state_seq" // cloud variable
+#define STATE_EVENT_PERIOD_MS     1000
+#define STATE_EVENT_HEARTBEAT_MS  60000
+#define STATE_EVENT_MAX           622 // [chars] Particle event data limit
+
+// FNV-1a hash (state changes are detected without keeping a copy)
+#define STATE_HASH_SEED  2166136261u
+
+static uint32_t hashStateBytes(uint32_t hash, const void* data, size_t n) {
+  for (size_t i = 0; i < n; i++) hash = (hash ^ ((const uint8_t*) data)[i]) * 16777619u;
+  return(hash);
+}
+
+static uint32_t hashStateText(uint32_t hash, const char* text) {
+  return(hashStateBytes(hash, text, strlen(text)));
+}
+
+// telemetry batches: serial lines with the prefix or events (at most one per TELEMETRY_EVENT_PERIOD_MS, next to the state events)
+#define TELEMETRY_OFF               0
+#define TELEMETRY_SERIAL            1
+#define TELEMETRY_CLOUD             2
+#define TELEMETRY_SERIAL_PREFIX     "T:"
+#define TELEMETRY_EVENT             "telemetry"
+#define TELEMETRY_EVENT_PERIOD_MS   4000
+
+// speed program moves (compiled from the program's segments when it starts): a move runs a number of units at a speed,
+// consecutive moves in the same direction are chained by the step interrupt (see StepperEngine::queueSegment())
+#define PROGRAM_MOVES_MAX  (2 * PROGRAM_SEGMENTS_MAX) // a linear ramp into a standstill ends with a stop move
+
+// longest 'rotate', 'run' and 'dispense' [units] (a move relative to the step engine's 32 bit position)
+#define ROTATION_UNITS_MAX  INT32_MAX
+
+// command arguments: extracted and converted by the dispatch before the handler runs, as the command's table entry
+// describes them ('v' a value, 'u' units, e.g. "vuv" for 'ramp 10 rpm 2'), command.value keeps the first value
+// (keywords are matched with command.parseValue()) and command.units the units
+#define CMD_ARGS_MAX  2 // values
+
+struct StepperCommandArgs {
+  double number[CMD_ARGS_MAX]; // values as numbers
+  bool converted[CMD_ARGS_MAX]; // whether the value is a number
+};
+
+struct StepperProgramMove {
+  uint8_t segment; // index of the program segment
+  int8_t direction; // +1 or -1 (0 = hold)
+  float rpm; // speed at the end of the move
+  StepInterval unit_interval;
+  uint32_t units; // [units] (hold: [ms])
+  float acceleration; // [units/s^2] (0 = instant speed change)
+};
+
+// stepper controller class (channel 1's motion modes, cloud, LCD and journal, the motors are run by the channels)
+class StepperController : public DeviceController, public StepperChannelExtension {
 
   private:
 
     // internal functions
     void construct();
-    void updateStepper(bool init = false); // update stepper object
-    float calculateSpeed(); // calculate speed based on settings
-    int findMicrostepIndexForRpm(float rpm); // finds the correct ms index for the requested rpm (takes ms_auto into consideration)
-    bool setSpeedWithSteppingLimit(float rpm); // sets state->speed and returns true if request set, false if had to set to limit
+    void updateOdometer(); // add the step engine travel since the last update (saved periodically and once stopped)
+    void saveOdometer(); // queue odometer for the state journal
+    uint64_t getRotationSaveUnits(); // odometer units between saves during 'rotate', 'run' and 'dispense'
+    void restoreOdometer(); // check the odometer restored from the state journal
+    bool isRotationInRange(double units) { return(fabs(units) <= ROTATION_UNITS_MAX); };
+    long startRotation(int64_t units, float rpm_after = -1, bool dispense = false, float minutes = 0); // rotate by position units in the current direction (negative: against it, 'run' if minutes > 0)
+    bool isRotating() { return(head->isRotating()); }; // towards a target position ('rotate', 'dispense' or 'run')
+    void rescaleRun(); // keep the remaining time of a 'run' after a speed change
+    void completeRotation(); // once the step engine stopped at the end of a 'rotate' or 'dispense'
+    uint32_t hashStateSettings(); // of the settings in the state information (state event trigger)
+    void publishStateEvent(); // publish the changed state information once the rate limit allows
+    void updateStateFragments(); // reformat the invalidated state fragments
+    void updateTelemetry(); // sample and flush telemetry batches
+    void attachTrigger(); // (re)attach the trigger interrupt for the trigger mode
+    void detachTrigger();
+    static void triggerISR(); // trigger pin interrupt service routine
+    void handleStall(); // once the step interrupt stopped the engine on a stall or slip
+    void changeMaxSpeed(float speed); // rpm limits from the step rate limit [steps/s] (at most the board's)
+    bool compileProgram(); // moves from the program's segments (false if it can't run with the current settings)
+    void startProgramMove(uint8_t move); // from standstill (or the current motion when the program starts)
+    void queueProgramMove(uint8_t move); // continue with this move in the step interrupt (if it chains)
+    void updateProgram(); // follow the moves started by the step interrupt, time holds and start moves from standstill
+    double getProgramProgress(); // of the active segment (0 to 1)
+    int getProgramDirection(uint8_t segment) { float rpm = program.segments[segment].rpm; return(rpm > 0 ? state->direction : rpm < 0 ? -state->direction : 0); }; // 0 = hold
+    void flushTelemetry();
+    #ifdef LOCAL_CONTROL_ON
+      void updateLocalControl(); // serve requests from the local serial and TCP channels
+      void serveLocalChannel(StepperLocalChannel* channel);
+    #endif
+    void parseCommandArgs(const char* format); // extract and convert the command's arguments (see StepperCommandArgs)
 
     // configuration
-    StepperBoard* board;
-    StepperDriver* driver;
-    StepperMotor* motor;
-    AccelStepper stepper;
+    const StepperBoard* board;
+    const StepperDriver* driver;
+    const StepperMotor* motor;
+    StepperChannel* head; // channel 1 (the controller's own motor, extended by the controller's motion modes)
+    StepperEngine* stepper; // channel 1's step engine
+    float units_per_rotation; // channel 1's step engine position units (steps in the finest microstepping mode) per rotation
+    bool initialized = false; // init() complete
 
     // state
     StepperState* state;
     DeviceState* ds = state;
 
+    // persistence (state journal fields, channel 1 adds the state as the first one)
+    StepperJournal journal;
+    uint8_t journal_odometer;
+    uint8_t journal_rotation;
+    uint8_t journal_calibration;
+    uint8_t journal_trigger;
+    uint8_t journal_program;
+    StepperRotation rotation; // active 'rotate' or 'dispense'
+    bool rotate_pending = false; // whether the step engine still has to pick up the rotation target
+    long rotate_move = 0; // [units] relative to the position when it is picked up
+    float run_rpm = 0; // speed the remaining units of a 'run' are for
+
+    // batch of commands (the channels defer stepper updates until all commands are parsed)
+    bool batching = false;
+    bool batch_timing_reset = false; // side effects that can't be rolled back are deferred as well
+    bool batch_telemetry = false;
+    uint8_t batch_telemetry_output = TELEMETRY_OFF;
+    unsigned long batch_telemetry_period_ms = 0;
+    int8_t batch_recording = -1; // -1: unchanged
+
+    // motor channels (1, 2, 3, ...)
+    StepperChannel* channels[STEPPER_CHANNELS_MAX];
+    uint8_t channels_n = 0;
+
+    // external trigger
+    StepperTrigger trigger;
+    uint8_t trigger_attached = 0; // trigger mode the interrupt is attached for (0 = detached)
+    static StepperController* trigger_instance; // controller served by the trigger interrupt
+
+    // speed program
+    StepperProgram program;
+    StepperProgramMove program_moves[PROGRAM_MOVES_MAX];
+    uint8_t program_moves_n = 0;
+    uint8_t program_move = 0; // active move
+    uint8_t program_queued = 0; // last move handed to the step engine
+    int program_ms_index = 0; // microstepping mode for the whole program
+    bool program_pending = false; // whether the program still has to be started
+    uint32_t program_segments = 0; // step engine segment count at the active move
+    unsigned long program_hold_start = 0; // millis()
+
+    // closed loop encoder feedback (optional)
+    StepperEncoder* encoder = nullptr;
+    uint8_t encoder_mode = ENCODER_OFF; // reaction to a stall (not saved)
+    uint8_t encoder_retries = 0; // restarts since the last stall free period
+    unsigned long encoder_stalls = 0;
+    unsigned long encoder_last_stall = 0; // millis()
+
+    // step rate self-calibration (rpm limits from the measured step rate, board->max_speed until the first calibration)
+    StepperRateCalibration rate_calibration;
+
+    // calibration
+    StepperCalibration calibration;
+    double dispensed = -1; // volume of the last completed 'dispense' (< 0: none yet)
+
+    // odometer
+    StepperOdometer odometer;
+    uint32_t odometer_travel = 0; // step engine travel already counted
+    bool odometer_saved = true; // whether the saved odometer is up to date
+    unsigned long odometer_last_save = 0;
+    uint64_t odometer_saved_units = 0; // odometer at the last save
+
     // startup
     bool startup_rpm_logged = false;
 
+    // LCD lines (pushed to the panel from update(), one line at a time)
+    StepperDisplayBuffer display = StepperDisplayBuffer(lcd);
+
+    // serialized state (fragments reformatted only when invalidated)
+    StepperStateFragments fragments;
+    uint64_t fragments_odometer_units = 0; // odometer of the odometer and volume fragments
+    unsigned long fragments_timing_steps = 0; // step count of the timing fragment
+    unsigned long fragments_trigger_count = 0; // trigger count of the trigger fragment
+    long fragments_encoder_error = 0; // following error of the encoder fragment
+
+    // telemetry
+    StepperTelemetry telemetry;
+    uint8_t telemetry_output = TELEMETRY_OFF;
+    unsigned long telemetry_period_ms = TELEMETRY_PERIOD_MS;
+    unsigned long telemetry_last_sample = 0; // micros()
+    unsigned long telemetry_last_event = 0;
+    unsigned long loop_last = 0; // micros() of the last update()
+    unsigned long loop_lag_max = 0; // longest gap between update() calls since the last sample [us]
+
+    // command recording (R: lines on serial, see parseCommand())
+    bool recording = false;
+    uint8_t command_depth = 0; // nested parseCommand() calls (batch, channel 1)
+
+    // arguments of the command being parsed and the channel it is for ('ch <channel> <command>', channel 1 otherwise)
+    StepperCommandArgs args;
+    StepperChannel* command_channel;
+
+    // state events
+    uint32_t state_hash = 0; // of the last state information
+    uint32_t state_event_hash = 0; // of the settings in the last state information
+    uint32_t state_event_published = 0; // hash of the state information in the last event
+    bool state_event_pending = false; // settings changed since the last event
+    int state_event_seq = 0;
+    unsigned long state_event_last = 0;
+    unsigned long state_event_heartbeat = 0; // millis() of the last event or heartbeat check
+
+    // profiling
+    #ifdef STEPPER_PROFILE_ON
+      StepperProfiler profiler;
+    #endif
+
+    // local control
+    #ifdef LOCAL_CONTROL_ON
+      TCPServer local_server = TCPServer(LOCAL_CONTROL_PORT);
+      TCPClient local_client;
+      bool local_server_started = false;
+      StepperLocalChannel local_serial = StepperLocalChannel(&Serial);
+      StepperLocalChannel local_tcp = StepperLocalChannel(&local_client);
+    #endif
+
   public:
 
     // constructors
     StepperController() {};
 
-    StepperController (int reset_pin, DeviceDisplay* lcd, StepperBoard* board, StepperDriver* driver, StepperMotor* motor, StepperState* state) :
+    StepperController (int reset_pin, DeviceDisplay* lcd, const StepperBoard* board, const StepperDriver* driver, const StepperMotor* motor, StepperState* state) :
       DeviceController(reset_pin, lcd), board(board), driver(driver), motor(motor), state(state) {
         construct();
     };
@@ -43,44 +255,168 @@ class StepperController : public DeviceController {
     // methods
     void init(); // to be run during setup()
     void update(); // to be run during loop()
+    bool addChannel(StepperChannel* channel); // additional motor channel (2, 3, ... in the order added), before init()
+    void addEncoder(StepperEncoder* encoder, uint8_t mode = ENCODER_BACKOFF); // closed loop feedback for the controller's motor, before init()
 
-    float getMaxRpm(); // returns the maximum rpm for the pump
+    float getMaxRpm() { return(head->getMaxRpm()); }; // returns the maximum rpm for the pump (full step mode)
+    float getMaxSpeed() { return(stepper->getMaxSpeed()); }; // step rate limit [steps/s]
+    float getSustainableRate() { return(rate_calibration.getRate()); }; // measured by the last step rate calibration [steps/s] (0 = not yet)
+    double getOdometerRotations() { return(odometer.getRotations()); }; // total rotations the pump has turned
+    double getRotationFlow() { return(calibration.getVolume(units_per_rotation)); }; // volume per rotation (requires step-flow calibration)
 
-    bool changeDataLogging (bool on);
-    bool changeStatus(int status);
-    bool changeDirection(int direction);
-    bool changeSpeedRpm(float rpm); // return false if had to limit speed, true if taking speed directly
-    bool changeToAutoMicrosteppingMode(); // set to automatic microstepping mode
-    bool changeMicrosteppingMode(int ms_mode); // set microstepping by mode, return false if can't find requested mode
+    StepperChannel* getChannel(uint8_t channel) { return(channel >= 1 && channel <= channels_n ? channels[channel - 1] : nullptr); }; // 1 = the pump's own motor
+    bool updateMotion(float acceleration); // channel 1's motion modes (see StepperChannelExtension)
+    void stateChanged(); // channel 1's state queued for the journal
 
-    bool start(); // start the pump
-    bool stop(); // stop the pump
-    bool hold(); // hold position
-    long rotate(float number); // returns the number of steps the motor will take
+    bool changeDataLogging (bool on);
+    bool changeTrigger(uint8_t mode, float rotations = 0); // wait for the external trigger (gate or dose per rising edge)
+    bool changeEncoderMode(uint8_t mode); // reaction to a stall or slip (ENCODER_OFF, _STOP, _RETRY, _BACKOFF)
+    void resetTiming(); // step timing statistics (deferred in a batch)
+    void changeTelemetry(uint8_t output, unsigned long period_ms); // starts over with a sample right away (deferred in a batch)
+    void changeRecording(bool on); // command recording (deferred in a batch)
+    long rotate(float number); // returns the number of position units (steps in the finest mode) the motor will take (0 if too many)
+    bool changeProgram(const StepperProgram& program); // load (saved) and start a speed program
+    bool startProgram(); // start the saved speed program (again), false if there is none or it can't run with the current settings
+    long run(float minutes); // run for minutes at the current speed, returns the number of position units (0 if invalid: not at least one unit or too many)
+    bool dispense(double volume); // dispense a volume at the fastest speed the microstepping allows (requires step-flow calibration)
+    bool changeSpeedFpm(float fpm); // set speed in flow per minute (requires step-flow calibration)
+    bool changeCalibration(double volume, double per_units, char* units); // step-flow from a volume per number of position units
 
     DeviceState* getDS() { return(ds); }; // return device state
-    void saveDS(); // save device state to EEPROM
-    bool restoreDS(); // load device state from EEPROM
+    void saveDS(); // queue device state for the state journal (written to EEPROM once no further changes come in)
+    bool restoreDS(); // load device state from the state journal in EEPROM
 
-    void clearData(bool all) ;
+    void clearData(bool all); // overrides DeviceController::clearData(), never clears persistent data
     bool assembleDataLog();
     void logRpm();
 
     void assembleStateInformation();
     void updateStateInformation();
+    void invalidateStateInformation() { fragments.invalidate(FRAGMENTS_ALL); }; // reformat all fields at the next update
 
     void parseCommand();
     bool parseStatus();
     bool parseDirection();
     bool parseSpeed();
+    bool parseRamp();
+    bool parseDispense();
+    bool parseCalibrate();
+    bool parseBatch();
+    bool parseChannel();
+    bool parseEncoder();
     bool parseMS();
+    bool parseTiming();
+    bool parseTelemetry();
+    bool parseRecord();
+    bool parseProgram();
+    #ifdef STEPPER_PROFILE_ON
+      bool parseProfile();
+    #endif
 
 };
 
+/**** COMMAND DISPATCH ****/
+
+// command handlers with the format of their arguments (see StepperCommandArgs) and whether every motor channel takes
+// the command (the others are channel 1's), looked up by a hash of the command's first and last character and length
+// (one probe instead of trying every parser in turn)
+struct StepperCommandHandler {
+  const char* variable;
+  const char* args; // format ("" if the handler parses the command itself)
+  bool (StepperController::*parse)();
+  bool channels; // for any channel ('ch <channel> <command>')
+};
+
+constexpr StepperCommandHandler STEPPER_COMMAND_HANDLERS[] = {
+  {CMD_AUTO, "vv", &StepperController::parseStatus, false},
+  {CMD_BATCH, "", &StepperController::parseBatch, false},
+  {CMD_SET, "vvu", &StepperController::parseCalibrate, false},
+  {CMD_CHANNEL, "", &StepperController::parseChannel, false},
+  {CMD_DIR, "v", &StepperController::parseDirection, true},
+  {CMD_DISPENSE, "vu", &StepperController::parseDispense, false},
+  {CMD_ENCODER, "v", &StepperController::parseEncoder, false},
+  {CMD_HOLD, "", &StepperController::parseStatus, true},
+  {CMD_STEP, "v", &StepperController::parseMS, true},
+  #ifdef STEPPER_PROFILE_ON
+    {CMD_PROFILE, "", &StepperController::parseProfile, false},
+  #endif
+  {CMD_PROGRAM, "v", &StepperController::parseProgram, false},
+  {CMD_RAMP, "vuv", &StepperController::parseRamp, true},
+  {CMD_RECORD, "v", &StepperController::parseRecord, false},
+  {CMD_ROTATE, "v", &StepperController::parseStatus, false},
+  {CMD_RUN, "v", &StepperController::parseStatus, false},
+  {CMD_SPEED, "vu", &StepperController::parseSpeed, true},
+  {CMD_START, "", &StepperController::parseStatus, true},
+  {CMD_STOP, "", &StepperController::parseStatus, true},
+  {CMD_TELEMETRY, "vu", &StepperController::parseTelemetry, false},
+  {CMD_TIMING, "v", &StepperController::parseTiming, false}
+};
+#define STEPPER_COMMAND_HANDLERS_N (int) (sizeof(STEPPER_COMMAND_HANDLERS) / sizeof(StepperCommandHandler))
+
+// hash buckets (the factors keep the commands apart, checked below)
+#define STEPPER_COMMAND_BUCKETS  32
+
+constexpr int hashCommand(char first, char last, int length) {
+  return((first + 13 * last + 9 * length) & (STEPPER_COMMAND_BUCKETS - 1));
+}
+
+constexpr int getCommandLength(const char* variable) {
+  return(*variable == 0 ? 0 : 1 + getCommandLength(variable + 1));
+}
+
+constexpr int hashCommand(const char* variable) {
+  return(hashCommand(variable[0], getCommandLength(variable) > 0 ? variable[getCommandLength(variable) - 1] : 0, getCommandLength(variable)));
+}
+
+constexpr bool isCommandHashUnique(const StepperCommandHandler* handlers, int n, int i = 1) {
+  return(n < 2 || (i == n ? isCommandHashUnique(handlers + 1, n - 1) :
+    hashCommand(handlers[0].variable) != hashCommand(handlers[i].variable) && isCommandHashUnique(handlers, n, i + 1)));
+}
+
+static_assert(isCommandHashUnique(STEPPER_COMMAND_HANDLERS, STEPPER_COMMAND_HANDLERS_N),
+  "STEPPER_COMMAND_HANDLERS share a hash bucket (and commands must be unique), change the factors in hashCommand() after adding a command");
+
+// handler index by hash bucket (-1: none)
+constexpr int8_t findCommandBucketHandler(int bucket, int i = 0) {
+  return(i == STEPPER_COMMAND_HANDLERS_N ? -1 : hashCommand(STEPPER_COMMAND_HANDLERS[i].variable) == bucket ? i : findCommandBucketHandler(bucket, i + 1));
+}
+
+#define STEPPER_COMMAND_BUCKETS_4(b) findCommandBucketHandler(b), findCommandBucketHandler(b + 1), findCommandBucketHandler(b + 2), findCommandBucketHandler(b + 3)
+
+constexpr int8_t STEPPER_COMMAND_BUCKET_HANDLERS[STEPPER_COMMAND_BUCKETS] = {
+  STEPPER_COMMAND_BUCKETS_4(0), STEPPER_COMMAND_BUCKETS_4(4), STEPPER_COMMAND_BUCKETS_4(8), STEPPER_COMMAND_BUCKETS_4(12),
+  STEPPER_COMMAND_BUCKETS_4(16), STEPPER_COMMAND_BUCKETS_4(20), STEPPER_COMMAND_BUCKETS_4(24), STEPPER_COMMAND_BUCKETS_4(28)
+};
+
+// handler for the command variable (nullptr if there is none)
+const StepperCommandHandler* findStepperCommandHandler(const char* variable) {
+  int length = strlen(variable);
+  int i = STEPPER_COMMAND_BUCKET_HANDLERS[hashCommand(variable[0], length > 0 ? variable[length - 1] : 0, length)];
+  if (i < 0 || memcmp(variable, STEPPER_COMMAND_HANDLERS[i].variable, length + 1) != 0) return(nullptr);
+  return(&STEPPER_COMMAND_HANDLERS[i]);
+}
+
+StepperController* StepperController::trigger_instance = nullptr;
+
+// stall reactions by encoder mode
+static char* ENCODER_MODE_NAMES[] = {CMD_ENCODER_OFF, CMD_ENCODER_STOP, CMD_ENCODER_RETRY, CMD_ENCODER_BACKOFF};
+
 /**** SETUP AND LOOP ****/
 
 void StepperController::construct() {
-  driver->calculateRpmLimits(board->max_speed, motor->steps, motor->gearing);
+  // the pump's own motor is channel 1 (its state is the first journal field)
+  head = new StepperChannel(board, driver, motor, state);
+  head->extend(this);
+  head->addToJournal(&journal);
+  stepper = head->getStepper();
+  units_per_rotation = head->getUnitsPerRotation();
+  channels[channels_n++] = head;
+  command_channel = head;
+  journal_odometer = journal.addField(&odometer);
+  journal_rotation = journal.addField(&rotation);
+  journal_calibration = journal.addField(&calibration);
+  journal_trigger = journal.addField(&trigger);
+  journal_program = journal.addField(&program);
   data.resize(2);
   // same index to allow for step transition logging
   data[0] = DeviceData(1, "speed", "rpm", 1);
@@ -88,289 +424,793 @@ void StepperController::construct() {
   data[1] = DeviceData(1, "speed", "rpm", 1);
 }
 
+// each channel's state is a journal field (6 fields for the controller incl. channel 1 + 3 channels fit into JOURNAL_FIELDS_MAX)
+bool StepperController::addChannel(StepperChannel* channel) {
+  if (channels_n >= STEPPER_CHANNELS_MAX) return(false);
+  channel->addToJournal(&journal);
+  channels[channels_n++] = channel;
+  return(true);
+}
+
+void StepperController::addEncoder(StepperEncoder* encoder, uint8_t mode) {
+  this->encoder = encoder;
+  encoder_mode = mode;
+}
+
 void StepperController::init() {
 
   DeviceController::init();
-
-  stepper = AccelStepper(AccelStepper::DRIVER, board->step, board->dir);
-  stepper.setEnablePin(board->enable);
-  stepper.setPinsInverted	(
-            driver->dir_cw != LOW,
-            driver->step_on != HIGH,
-            driver->enable_on != LOW
-        );
-  stepper.disableOutputs();
-  stepper.setMaxSpeed(board->max_speed);
+  Particle.variable(STATE_EVENT_SEQ, &state_event_seq);
+  restoreOdometer();
 
   // microstepping
-  state->ms_index = findMicrostepIndexForRpm(state->rpm);
-  state->ms_mode = driver->getMode(state->ms_index);
-  pinMode(board->ms1, OUTPUT);
-  pinMode(board->ms2, OUTPUT);
-  pinMode(board->ms3, OUTPUT);
   #ifdef STEPPER_DEBUG_ON
     Serial.println("INFO: available microstepping modes");
     for (int i = 0; i < driver->ms_modes_n; i++) {
-      Serial.printf("   Mode %d: %s steps, max rpm: %.1f\n", i, driver->ms_modes[i].mode, driver->ms_modes[i].rpm_limit);
+      Serial.printf("   Mode %d: %d steps, max rpm: %.1f\n", i, driver->ms_modes[i].mode, driver->getRpmLimit(i, head->getMaxRpm()));
     }
   #endif
 
-  updateStepper(true);
+  // closed loop feedback (the encoder counts from where the motor is now)
+  if (encoder) {
+    encoder->init(motor->steps * driver->getFullStepUnits());
+    encoder->sync(stepper->currentPosition());
+    stepper->setMonitor(encoder_mode != ENCODER_OFF ? encoder : nullptr);
+  }
+
+  // resume an interrupted 'rotate', 'run' or 'dispense' with the remaining units
+  if (isRotating()) {
+    const char* name = state->status == STATUS_RUN ? "run" : rotation.dispense ? "dispense" : "rotate";
+    int64_t remaining = rotation.end - odometer.units;
+    if (remaining > (int64_t) rotation.units) {
+      // odometer saved before the rotation started: how far it got is unknown, don't risk repeating it
+      Serial.printf("INFO: %s interrupted without saved progress, turning off\n", name);
+      rotation.dispense = false; // dispensed volume unknown
+      completeRotation();
+      state->status = STATUS_OFF;
+      saveDS();
+    } else if (remaining > 0) {
+      Serial.printf("INFO: resuming %s with %.3f rotations remaining\n", name, remaining / units_per_rotation);
+      rotate_move = (rotation.reverse ? -state->direction : state->direction) * (long) remaining;
+      rotate_pending = true;
+      run_rpm = state->rpm;
+    } else {
+      completeRotation();
+      state->status = STATUS_OFF;
+      saveDS();
+    }
+  }
+
+  // trigger mode needs the board's trigger input
+  if (state->status == STATUS_TRIGGER && board->trigger < 0) {
+    Serial.println("INFO: board has no trigger input, turning off");
+    state->status = STATUS_OFF;
+    saveDS();
+  }
+
+  // a program's timing does not survive a power loss (start it again with 'program start')
+  if (state->status == STATUS_PROGRAM) {
+    Serial.println("INFO: speed program interrupted, turning off");
+    state->status = STATUS_OFF;
+    saveDS();
+  }
+
+  // channel 1 first (its motion modes pick up the checks above)
+  for (int i = 0; i < channels_n; i++) channels[i]->init();
+  initialized = true;
+  invalidateStateInformation(); // first assembled by DeviceController::init() before the odometer was restored
 }
 
-// loop function
+// loop function (stepping itself happens in the step engine's timer interrupt)
 void StepperController::update() {
-  if (state->status == STATUS_ROTATE) {
-    // WARNING: FIXME known bug, when power out, saved rotate status will lead to immediate stop of pump
-    if (stepper.distanceToGo() == 0) {
-      changeStatus(STATUS_OFF); // disengage if reached target location
+  PROFILE_BEGIN(PROFILE_TELEMETRY);
+  updateTelemetry();
+  PROFILE_END(PROFILE_TELEMETRY);
+
+  PROFILE_BEGIN(PROFILE_STEPPER);
+  for (int i = 0; i < channels_n; i++) channels[i]->update();
+  updateOdometer();
+  if (encoder && encoder->hasFault()) handleStall();
+  if (rate_calibration.update(state->status == STATUS_OFF || state->status == STATUS_HOLD)) changeMaxSpeed(rate_calibration.getMaxSpeed());
+  if (state->status == STATUS_PROGRAM) updateProgram();
+  if (isRotating()) {
+    if (!stepper->isRunning()) {
+      completeRotation();
+      head->changeStatus(STATUS_OFF); // disengage if reached target location
       updateStateInformation();
-    } else {
-      stepper.runSpeedToPosition();
     }
-  } else {
-    stepper.runSpeed();
   }
+  PROFILE_END(PROFILE_STEPPER);
+
+  // write queued state changes
+  PROFILE_BEGIN(PROFILE_SAVE_DS);
+  journal.update();
+  PROFILE_END(PROFILE_SAVE_DS);
 
   // log rpm once startup is complete
+  PROFILE_BEGIN(PROFILE_STARTUP);
   if (startup_logged && !startup_rpm_logged) {
     logRpm();
     startup_rpm_logged = true;
   }
+  PROFILE_END(PROFILE_STARTUP);
 
+  PROFILE_BEGIN(PROFILE_DEVICE);
   DeviceController::update();
+  PROFILE_END(PROFILE_DEVICE);
+
+  // push state changes (settings right away, measured fields with the heartbeat if they changed since the last event)
+  if (!state_event_pending && millis() - state_event_heartbeat >= STATE_EVENT_HEARTBEAT_MS) {
+    state_event_heartbeat = millis();
+    updateStateInformation();
+    if (state_hash != state_event_published) state_event_pending = true;
+  }
+  if (state_event_pending) publishStateEvent();
+
+  // push changed LCD lines
+  PROFILE_BEGIN(PROFILE_LCD);
+  display.update();
+  PROFILE_END(PROFILE_LCD);
+
+  #ifdef LOCAL_CONTROL_ON
+    PROFILE_BEGIN(PROFILE_LOCAL);
+    updateLocalControl();
+    PROFILE_END(PROFILE_LOCAL);
+  #endif
+}
+
+/**** TELEMETRY ****/
+
+void StepperController::updateTelemetry() {
+  unsigned long now = micros();
+  if (now - loop_last > loop_lag_max) loop_lag_max = now - loop_last;
+  loop_last = now;
+  if (telemetry_output == TELEMETRY_OFF) return;
+  if (now - telemetry_last_sample >= telemetry_period_ms * 1000) {
+    telemetry.add(now, stepper->currentPosition(), stepper->getTiming()->late, loop_lag_max);
+    telemetry_last_sample = now;
+    loop_lag_max = 0;
+  }
+  if (telemetry.getCount() >= TELEMETRY_BATCH_SAMPLES) flushTelemetry();
+}
+
+void StepperController::flushTelemetry() {
+  uint8_t batch[TELEMETRY_BATCH_MAX];
+  char text[TELEMETRY_BATCH_MAX / 3 * 4 + 5];
+  uint32_t period_us = telemetry_period_ms * 1000;
+  if (telemetry_output == TELEMETRY_CLOUD) {
+    // one batch per event (the ring buffer keeps the rest until the next one)
+    if (millis() - telemetry_last_event < TELEMETRY_EVENT_PERIOD_MS || !Particle.connected()) return;
+    int n = telemetry.encode(batch, sizeof(batch), period_us);
+    StepperTelemetry::toBase64(batch, n, text, sizeof(text));
+    Particle.publish(TELEMETRY_EVENT, text, PRIVATE);
+    telemetry_last_event = millis();
+    #ifdef CLOUD_DEBUG_ON
+      Serial.printf("INFO: telemetry batch published (%d bytes)\n", n);
+    #endif
+  } else {
+    while (telemetry.getCount() > 0) {
+      int n = telemetry.encode(batch, sizeof(batch), period_us);
+      StepperTelemetry::toBase64(batch, n, text, sizeof(text));
+      Serial.printf("%s%s\r\n", TELEMETRY_SERIAL_PREFIX, text);
+    }
+  }
+}
+
+/**** LOCAL CONTROL ****/
+
+#ifdef LOCAL_CONTROL_ON
+void StepperController::updateLocalControl() {
+  // the TCP server needs the network (restarted after reconnects)
+  if (!WiFi.ready()) {
+    local_server_started = false;
+  } else if (!local_server_started) {
+    local_server_started = local_server.begin();
+    #ifdef STEPPER_DEBUG_ON
+      if (local_server_started) Serial.printf("INFO: local control listening on port %d\n", LOCAL_CONTROL_PORT);
+    #endif
+  }
+  if (local_server_started && !local_client.connected()) {
+    local_client.stop();
+    local_client = local_server.available();
+  }
+
+  serveLocalChannel(&local_serial);
+  if (local_client.connected()) serveLocalChannel(&local_tcp);
 }
 
+void StepperController::serveLocalChannel(StepperLocalChannel* channel) {
+  // same command path as the cloud function
+  for (int i = 0; i < LOCAL_REQUESTS_PER_UPDATE && channel->receive(); i++) {
+    unsigned long seq;
+    char* request;
+    if (channel->parseRequest(&seq, &request) < 0) {
+      channel->respond(seq, LOCAL_RET_ERR_REQUEST, LOCAL_ERROR_REQUEST);
+    } else {
+      int ret_val = receiveCommand(request);
+      channel->respond(seq, ret_val, command.data);
+    }
+  }
+}
+#endif
+
 /**** STATE PERSISTENCE ****/
 
-// save device state to EEPROM
+// queue device state for the journal (written from update() once no further changes come in)
 void StepperController::saveDS() {
-  EEPROM.put(STATE_ADDRESS, *state);
+  head->saveState();
+}
+
+void StepperController::stateChanged() {
+  fragments.invalidate(FRAGMENTS_STATE);
   #ifdef STATE_DEBUG_ON
-    Serial.println("INFO: stepper state saved in memory (if any updates were necessary)");
+    Serial.println("INFO: stepper state change queued for saving in memory");
   #endif
 }
 
-// load device state from EEPROM
+// load device state (and the other journal fields) from EEPROM
 bool StepperController::restoreDS(){
-  StepperState saved_state;
-  EEPROM.get(STATE_ADDRESS, saved_state);
-  bool recoverable = saved_state.version == STATE_VERSION;
+  StepperState defaults = *state;
+  bool journal_found = journal.restore();
+  // no journal yet: state saved by earlier versions as a single struct
+  if (!journal_found) EEPROM.get(STATE_ADDRESS, *state);
+  bool recoverable = state->version == STATE_VERSION;
   if(recoverable) {
-    EEPROM.get(STATE_ADDRESS, *state);
     Serial.printf("INFO: successfully restored state from memory (version %d)\n", STATE_VERSION);
   } else {
-    Serial.printf("INFO: could not restore state from memory (found version %d), sticking with initial default\n", saved_state.version);
-    saveDS();
+    Serial.printf("INFO: could not restore state from memory (found version %d), sticking with initial default\n", state->version);
+    *state = defaults;
+  }
+  if (!recoverable || !journal_found) saveDS();
+  if (!trigger.isValid()) {
+    trigger = StepperTrigger();
+    journal.change(journal_trigger);
+  }
+  if (!program.isValid()) {
+    program = StepperProgram();
+    journal.change(journal_program);
+  }
+  for (int i = 1; i < channels_n; i++) {
+    if (!channels[i]->restoreState()) Serial.printf("INFO: could not restore channel %d state from memory, sticking with initial default\n", i + 1);
   }
   return(recoverable);
 }
 
-/**** UPDATING STEPPER ****/
+// queue odometer for the journal
+void StepperController::saveOdometer() {
+  journal.progress(journal_odometer);
+  odometer_saved = true;
+  odometer_saved_units = odometer.units;
+  odometer_last_save = millis();
+  #ifdef STATE_DEBUG_ON
+    Serial.printf("INFO: odometer queued for saving in memory (%.3f rotations)\n", odometer.getRotations());
+  #endif
+}
 
-void StepperController::updateStepper(bool init) {
-  // update microstepping
-  if (state->ms_index >= 0 && state->ms_index < driver->ms_modes_n) {
-    digitalWrite(board->ms1, driver->ms_modes[state->ms_index].ms1);
-    digitalWrite(board->ms2, driver->ms_modes[state->ms_index].ms2);
-    digitalWrite(board->ms3, driver->ms_modes[state->ms_index].ms3);
+// check odometer restored from the journal
+void StepperController::restoreOdometer() {
+  if (odometer.version != ODOMETER_VERSION || !(odometer.units_per_rotation > 0)) {
+    Serial.printf("INFO: could not restore odometer from memory (found version %d), starting from 0 rotations\n", odometer.version);
+    odometer = StepperOdometer(units_per_rotation);
+    saveOdometer();
+  } else {
+    if (odometer.units_per_rotation != units_per_rotation) {
+      // motor or driver configuration changed: keep the rotations
+      Serial.printf("INFO: odometer units changed from %.1f to %.1f per rotation\n", odometer.units_per_rotation, units_per_rotation);
+      odometer.units = (uint64_t) (odometer.getRotations() * units_per_rotation + 0.5);
+      odometer.units_per_rotation = units_per_rotation;
+      saveOdometer();
+    }
+    Serial.printf("INFO: successfully restored odometer from memory (%.3f rotations)\n", odometer.getRotations());
+  }
+  odometer_travel = stepper->getTravel();
+  odometer_saved_units = odometer.units;
+}
+
+void StepperController::updateOdometer() {
+  uint32_t travel = stepper->getTravel();
+  if (travel != odometer_travel) {
+    odometer.units += (uint32_t) (travel - odometer_travel);
+    odometer_travel = travel;
+    odometer_saved = false;
   }
+  if (odometer_saved) return;
+  if (!stepper->isRunning()) saveOdometer();
+  else if (isRotating()) {
+    // progress of a rotation (what a resume after a power loss repeats)
+    if (odometer.units - odometer_saved_units >= getRotationSaveUnits() || millis() - odometer_last_save > ODOMETER_ROTATE_SAVE_PERIOD) saveOdometer();
+  } else if (millis() - odometer_last_save > ODOMETER_SAVE_PERIOD) saveOdometer();
+}
 
-  // update speed
-  stepper.setSpeed(calculateSpeed());
+uint64_t StepperController::getRotationSaveUnits() {
+  return(llround(fmax(rotation.units * ODOMETER_ROTATE_SAVE_FRACTION, ODOMETER_ROTATE_SAVE_MIN * units_per_rotation)));
+}
+
+/**** UPDATING STEPPER ****/
+
+// motion modes beyond on, off and hold (channel 1's extension, see StepperChannel::updateStepper())
+bool StepperController::updateMotion(float acceleration) {
+  // the step engine may start (a step rate calibration would be in its way)
+  rate_calibration.abort();
+
+  // a program keeps the mode for its fastest segment throughout
+  if (state->status == STATUS_PROGRAM) head->updateMicrostepping(program_ms_index);
+
+  // segments only continue a program's moves
+  if (state->status != STATUS_PROGRAM) stepper->clearSegment();
+
+  // external trigger only in trigger mode
+  if (state->status != STATUS_TRIGGER) detachTrigger();
 
-  // update enabled / disabled
-  if (state->status == STATUS_ON || state->status == STATUS_ROTATE) {
-    stepper.enableOutputs();
-  } else if (state->status == STATUS_HOLD) {
-    stepper.setSpeed(0);
-    stepper.enableOutputs();
+  // a start from standstill counts the following error from here (an unhandled stall keeps the engine stopped)
+  if (encoder && !stepper->isRunning() && !encoder->hasFault()) encoder->sync(stepper->currentPosition());
+
+  bool driven = true;
+  if (isRotating()) {
+    if (state->status == STATUS_RUN && state->rpm != run_rpm) rescaleRun();
+    if (rotate_pending) {
+      stepper->moveTo(stepper->currentPosition() + rotate_move);
+      rotate_pending = false;
+    }
+    stepper->enableOutputs();
+    stepper->runIntervalToPosition(head->calculateUnitInterval(), acceleration);
+  } else if (state->status == STATUS_TRIGGER) {
+    // energized and armed, the trigger interrupt starts and stops the steps (settings apply from the next trigger)
+    uint32_t dose = (trigger.mode == TRIGGER_DOSE) ? lround((double) trigger.rotations * units_per_rotation) : 0;
+    stepper->enableOutputs();
+    stepper->arm(head->calculateUnitInterval(), state->direction, acceleration, dose);
+    attachTrigger();
+  } else if (state->status == STATUS_PROGRAM) {
+    // the program's moves drive the step engine (speed and direction settings apply once it completes)
+    stepper->enableOutputs();
+    if (program_pending) {
+      program_pending = false;
+      startProgramMove(0);
+    }
   } else {
-    // STATUS_OFF
-    stepper.setSpeed(0);
-    stepper.disableOutputs();
+    // on, off and hold (the channel drives the step engine)
+    driven = false;
   }
 
-  // log rpm (if necessary - determined in function)
-  if (!init) logRpm();
+  // log rpm (if necessary - determined in function, not before init() is complete)
+  if (initialized) logRpm();
+  return(driven);
 }
 
-float StepperController::calculateSpeed() {
-  float speed = state->rpm/60.0 * motor->steps * motor->gearing * state->ms_mode * state->direction;
-  #ifdef STEPPER_DEBUG_ON
-    Serial.printf("INFO: calculated speed %.5f\n", speed);
-  #endif
-  return(speed);
+// edges only matter in trigger mode: gate on both edges, dose on rising edges
+void StepperController::attachTrigger() {
+  if (trigger_attached == trigger.mode) return;
+  detachTrigger();
+  trigger_instance = this;
+  pinMode(board->trigger, INPUT_PULLDOWN);
+  attachInterrupt(board->trigger, triggerISR, trigger.mode == TRIGGER_GATE ? CHANGE : RISING);
+  trigger_attached = trigger.mode;
+  // pick up the current level (a running pump keeps running if the gate is open, stops otherwise)
+  noInterrupts();
+  if (trigger.mode == TRIGGER_GATE && digitalRead(board->trigger) == HIGH) stepper->trigger(micros());
+  else stepper->release();
+  interrupts();
 }
 
-/* DEVICE STATE CHANGE FUNCTIONS */
+void StepperController::detachTrigger() {
+  if (trigger_attached == 0) return;
+  detachInterrupt(board->trigger);
+  trigger_attached = 0;
+  stepper->disarm();
+}
 
-bool StepperController::changeDataLogging (bool on) {
-  bool changed = DeviceController::changeDataLogging (on);
-  if (on && changed) logRpm();
-  return(changed);
+// edge to first step pulse in this interrupt (no loop() involved)
+void StepperController::triggerISR() {
+  uint32_t time = micros();
+  StepperController* pump = trigger_instance;
+  if (pump->trigger.mode == TRIGGER_DOSE || digitalRead(pump->board->trigger) == HIGH) pump->stepper->trigger(time);
+  else pump->stepper->release();
 }
 
-bool StepperController::changeStatus(int status) {
+/**** STEP RATE ****/
+
+// the rpm limits (and with them auto microstepping and the speed) follow the step rate the board sustains
+void StepperController::changeMaxSpeed(float speed) {
+  fragments.invalidate(FRAGMENT_BIT(FRAGMENT_LIMIT));
+  if (head->changeMaxSpeed(speed)) {
+    Serial.printf("INFO: step rate calibrated to %.0f steps/s, limiting to %.0f steps/s (full step rpm limit %.1f)\n",
+      rate_calibration.getRate(), stepper->getMaxSpeed(), head->getMaxRpm());
+  }
+  for (int i = 1; i < channels_n; i++) channels[i]->changeMaxSpeed(speed);
+  updateStateInformation();
+}
 
-  // only update if necessary
-  bool changed = status != state->status;
+/**** SPEED PROGRAM ****/
+
+// transitions within a run in one direction happen in the step interrupt on the step that completes a move, standstills
+// (holds, reversals) stop on the exact position and are timed from the loop, time lengths are converted to unit budgets:
+// - at the acceleration limit: the speed change at the start and the stop at the end are part of the segment's time
+// - linear ramp: the average speed over the time, a ramp into a standstill stops at the acceleration limit after the time
+bool StepperController::compileProgram() {
+  if (program.n == 0) return(false);
+
+  // one microstepping mode for the whole program (budgets on its step grid, no mode changes in between)
+  float max_rpm = 0;
+  for (uint8_t i = 0; i < program.n; i++) if (fabs(program.segments[i].rpm) > max_rpm) max_rpm = fabs(program.segments[i].rpm);
+  int ms_index = head->findMicrostepIndexForRpm(max_rpm);
+  if (driver->testRpmLimit(ms_index, max_rpm, head->getMaxRpm())) return(false);
+  double step_units = driver->getStepUnits(ms_index);
+  double limit = head->calculateAcceleration(motor->acceleration); // [units/s^2]
+
+  uint8_t n = 0;
+  double v0 = 0; // speed the segment starts from [units/s]
+  for (uint8_t i = 0; i < program.n; i++) {
+    StepperProgramSegment* segment = &program.segments[i];
+    int direction = getProgramDirection(i);
+    double seconds = (segment->flags & PROGRAM_ROTATIONS) ? 0 : segment->length * 60.0;
+    if (!(segment->length > 0)) return(false);
 
+    // hold
+    if (direction == 0) {
+      if (seconds == 0) return(false);
+      program_moves[n++] = {i, 0, 0, 0, (uint32_t) lround(seconds * 1000), 0};
+      v0 = 0;
+      continue;
+    }
+
+    bool stops = i + 1 == program.n || getProgramDirection(i + 1) != direction;
+    double v = fabs(segment->rpm) * units_per_rotation / 60.0;
+    double units = (seconds > 0) ? v * seconds : segment->length * units_per_rotation;
+    double acceleration = limit;
+    double stop_units = 0;
+    if (segment->flags & PROGRAM_RAMP) {
+      if (seconds > 0) units = (v0 + v) / 2 * seconds;
+      acceleration = fabs(v * v - v0 * v0) / (2 * units);
+      if (limit > 0 && acceleration > limit) acceleration = limit;
+      if (stops && limit > 0) stop_units = lround(v * v / (2 * limit) / step_units) * step_units;
+      if (seconds == 0) units -= stop_units;
+    } else if (seconds > 0 && limit > 0) {
+      units -= (v - v0) * fabs(v - v0) / (2 * limit) + (stops ? v * v / (2 * limit) : 0);
+    }
+    units = lround(units / step_units) * step_units;
+    if (units < step_units || units > INT32_MAX) return(false);
+
+    StepInterval unit_interval = StepperEngine::getIntervalForSpeed(fabs(segment->rpm) * units_per_rotation);
+    program_moves[n++] = {i, (int8_t) direction, fabs(segment->rpm), unit_interval, (uint32_t) units, (float) acceleration};
+    if (stop_units > 0) program_moves[n++] = {i, (int8_t) direction, fabs(segment->rpm), unit_interval, (uint32_t) stop_units, (float) limit};
+    v0 = stops ? 0 : v;
+  }
+
+  program_moves_n = n;
+  program_ms_index = ms_index;
   #ifdef STEPPER_DEBUG_ON
-    if (changed)
-      Serial.printf("INFO: status updating to %d\n", status);
-    else
-      Serial.printf("INFO: status unchanged (%d)\n", status);
+    Serial.printf("INFO: speed program of %d segments in %d moves (microstepping mode %d)\n", program.n, n, driver->getMode(ms_index));
   #endif
+  return(true);
+}
 
-  if (changed) {
-    state->status = status;
-    updateStepper();
-    saveDS();
+void StepperController::startProgramMove(uint8_t move) {
+  stepper->clearSegment();
+  program_segments = stepper->getSegments();
+  program_move = move;
+  program_queued = move;
+  if (move >= program_moves_n) return;
+  StepperProgramMove* next = &program_moves[move];
+  if (next->direction == 0) {
+    program_hold_start = millis();
+    return;
   }
-  return(changed);
+  stepper->moveTo(stepper->currentPosition() + next->direction * (long) next->units);
+  queueProgramMove(move + 1);
+  stepper->runIntervalToPosition(next->unit_interval, next->acceleration);
 }
 
-bool StepperController::changeDirection(int direction) {
+void StepperController::queueProgramMove(uint8_t move) {
+  if (move >= program_moves_n || program_moves[move].direction != program_moves[move - 1].direction) return;
+  stepper->queueSegment(program_moves[move].unit_interval, program_moves[move].units, program_moves[move].acceleration);
+  program_queued = move;
+}
 
-  // only update if necessary
-  bool changed = (direction == DIR_CW || direction == DIR_CC) && state->direction != direction;
+void StepperController::updateProgram() {
+  uint8_t segment = program_moves[program_move].segment;
 
-  #ifdef STEPPER_DEBUG_ON
-    if (changed)
-      (direction == DIR_CW) ? Serial.println("INFO: changing direction to clockwise") : Serial.println("INFO: changing direction to counter clockwise");
-    else
-      (direction == DIR_CW) ? Serial.println("INFO: direction unchanged (clockwise)") : Serial.println("INFO: direction unchanged (counter clockwise)");
-  #endif
+  // moves the step interrupt continued with since the last update (counted after checking whether it stopped)
+  bool running = stepper->isRunning();
+  uint32_t segments = stepper->getSegments();
+  if (segments != program_segments) {
+    program_move += segments - program_segments;
+    program_segments = segments;
+  }
 
-  if (changed) {
-    state->direction = direction;
-    if (state->status == STATUS_ROTATE) {
-      // if rotating to a specific position, changing direction turns the pump off
-      #ifdef STEPPER_DEBUG_ON
-        Serial.println("INFO: stepper stopped due to change in direction during 'rotate'");
-      #endif
-      state->status = STATUS_OFF;
+  if (running) {
+    // keep the next move queued
+    if (program_queued == program_move) queueProgramMove(program_move + 1);
+  } else if (program_moves[program_move].direction != 0 || millis() - program_hold_start >= program_moves[program_move].units) {
+    // move complete (at its target) or hold over
+    startProgramMove(program_move + 1);
+    if (program_move >= program_moves_n) {
+      Serial.println("INFO: speed program complete");
+      program_move = program_moves_n - 1;
+      head->changeStatus(STATUS_OFF);
+      updateStateInformation();
+      return;
     }
-    updateStepper();
-    saveDS();
   }
 
-  return(changed);
+  if (program_moves[program_move].segment != segment) {
+    #ifdef STEPPER_DEBUG_ON
+      Serial.printf("INFO: speed program segment %d of %d\n", program_moves[program_move].segment + 1, program.n);
+    #endif
+    logRpm();
+    updateStateInformation();
+  }
 }
 
-bool StepperController::changeSpeedRpm(float rpm) {
-  int original_ms_mode = state->ms_mode;
-  float original_rpm = state->rpm;
-  state->ms_index = findMicrostepIndexForRpm(rpm);
-  state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
-  setSpeedWithSteppingLimit(rpm);
-  bool changed = state->ms_mode != original_ms_mode | fabs(state->rpm - original_rpm) > 0.0001;
+double StepperController::getProgramProgress() {
+  StepperProgramMove* move = &program_moves[program_move];
+  if (move->direction == 0) {
+    unsigned long elapsed = millis() - program_hold_start;
+    return(elapsed < move->units ? (double) elapsed / move->units : 1.0);
+  }
+  // units of the segment's moves (a ramp into a standstill has two)
+  long remaining = labs(stepper->distanceToGo());
+  double done = (remaining < (long) move->units) ? move->units - remaining : 0;
+  double total = 0;
+  for (uint8_t i = 0; i < program_moves_n; i++) {
+    if (program_moves[i].segment != move->segment) continue;
+    total += program_moves[i].units;
+    if (i < program_move) done += program_moves[i].units;
+  }
+  return(done / total);
+}
+
+/**** CLOSED LOOP ****/
+
+// the engine stopped at the step the motor fell behind (or ran ahead) by more than the tolerance
+// and continues from where the motor actually is (a 'rotate' or 'run' still ends at its target)
+void StepperController::handleStall() {
+  long error = encoder->getFaultError();
+  if (millis() - encoder_last_stall > STEPPER_ENCODER_RETRY_RESET) encoder_retries = 0;
+  encoder_last_stall = millis();
+  encoder_stalls++;
+  fragments.invalidate(FRAGMENT_BIT(FRAGMENT_ENC));
+
+  // the driver re-energizes the motor at a full step
+  long full_step = driver->getFullStepUnits();
+  long measured = lround((double) encoder->getMeasuredPosition() / full_step) * full_step;
+  long target = stepper->targetPosition();
+  stepper->setCurrentPosition(measured);
+  stepper->moveTo(target);
+  encoder->sync(measured);
+
+  // (a program's timing can't be resumed)
+  bool running = state->status == STATUS_ON || isRotating() || state->status == STATUS_TRIGGER || state->status == STATUS_PROGRAM;
+  bool restart = running && encoder_mode != ENCODER_STOP && encoder_retries < STEPPER_ENCODER_RETRIES && state->status != STATUS_PROGRAM;
+  Serial.printf("WARNING: stall detected (following error %ld counts), %s\n", error,
+    !running ? "stopped" : !restart ? "turning off" : encoder_mode == ENCODER_BACKOFF ? "backing off" : "restarting");
+  if (!running) return;
+  if (!restart) {
+    head->changeStatus(STATUS_OFF);
+    updateStateInformation();
+    return;
+  }
+  encoder_retries++;
+  if (encoder_mode != ENCODER_BACKOFF || !head->changeSpeedRpm(state->rpm * STEPPER_ENCODER_BACKOFF)) head->updateStepper();
+  updateStateInformation();
+}
 
+bool StepperController::changeEncoderMode(uint8_t mode) {
+  if (!encoder) return(false);
+  bool changed = mode != encoder_mode;
   #ifdef STEPPER_DEBUG_ON
-    if (changed)
-      Serial.printf("INFO: changing rpm %.3f\n", state->rpm);
-    else
-      Serial.printf("INFO: rpm staying unchanged ()%.3f)\n", state->rpm);
+    Serial.printf("INFO: encoder stall reaction %s%s\n", ENCODER_MODE_NAMES[mode], changed ? "" : " (unchanged)");
   #endif
-
   if (changed) {
-    updateStepper();
-    saveDS();
+    encoder_mode = mode;
+    encoder_retries = 0;
+    stepper->setMonitor(mode != ENCODER_OFF ? encoder : nullptr);
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_ENC));
   }
   return(changed);
 }
 
-bool StepperController::setSpeedWithSteppingLimit(float rpm) {
-  if (driver->testRpmLimit(state->ms_index, rpm)) {
-    state->rpm = driver->getRpmLimit(state->ms_index);
-    Serial.printf("WARNING: stepping mode is not fast enough for the requested rpm: %.3f --> switching to MS mode rpm limit of %.3f\n", rpm, state->rpm);
-    return(false);
-  } else {
-    state->rpm = rpm;
-    return(true);
+void StepperController::resetTiming() {
+  // batch: once all commands are parsed
+  if (batching) {
+    batch_timing_reset = true;
+    return;
   }
+  stepper->resetTiming();
 }
 
-bool StepperController::changeToAutoMicrosteppingMode() {
+void StepperController::changeTelemetry(uint8_t output, unsigned long period_ms) {
+  // batch: once all commands are parsed
+  if (batching) {
+    batch_telemetry = true;
+    batch_telemetry_output = output;
+    batch_telemetry_period_ms = period_ms;
+    return;
+  }
+  telemetry.clear();
+  telemetry_output = output;
+  telemetry_period_ms = period_ms;
+  telemetry_last_sample = micros() - telemetry_period_ms * 1000;
+  loop_lag_max = 0;
+}
 
-  bool changed = !state->ms_auto;
+void StepperController::changeRecording(bool on) {
+  // batch: once all commands are parsed
+  if (batching) {
+    batch_recording = on;
+    return;
+  }
+  if (on && !recording) {
+    // starts with the current state
+    updateStateInformation();
+    recording = true;
+    Serial.printf("R:%lu,state,%s\n", millis(), state_information);
+  } else if (!on) {
+    recording = false;
+  }
+}
+
+/* DEVICE STATE CHANGE FUNCTIONS */
+
+bool StepperController::changeDataLogging (bool on) {
+  bool changed = DeviceController::changeDataLogging (on);
+  if (on && changed) logRpm();
+  return(changed);
+}
 
+bool StepperController::changeTrigger(uint8_t mode, float rotations) {
+  if (board->trigger < 0) return(false);
+  if (mode != TRIGGER_DOSE) rotations = 0;
+  bool changed = mode != trigger.mode || rotations != trigger.rotations;
   #ifdef STEPPER_DEBUG_ON
-    if (changed)
-      Serial.println("INFO: activating automatic microstepping");
-    else
-      Serial.println("INFO: automatic microstepping already active");
+    if (mode == TRIGGER_DOSE) Serial.printf("INFO: trigger mode dose %.3f rotations per rising edge\n", rotations);
+    else Serial.println("INFO: trigger mode gate");
   #endif
-
   if (changed) {
-    state->ms_auto = true;
-    state->ms_index = findMicrostepIndexForRpm(state->rpm);
-    state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
-    updateStepper();
-    saveDS();
+    trigger.mode = mode;
+    trigger.rotations = rotations;
+    journal.change(journal_trigger);
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_TRIG));
   }
+  if (head->changeStatus(STATUS_TRIGGER)) return(true);
+  if (changed) head->updateStepper();
   return(changed);
 }
 
-bool StepperController::changeMicrosteppingMode(int ms_mode) {
-
-  // find index for requested microstepping mode
-  int ms_index = driver->findMicrostepIndexForMode(ms_mode);
+// number of rotations
+long StepperController::rotate(float number) {
+  // position units are the same in all microstepping modes, the target holds across mode changes
+  if (!isRotationInRange((double) number * units_per_rotation)) return(0);
+  long units = lround((double) number * units_per_rotation);
+  return(startRotation(units));
+}
 
-  // no index found for requested mode
-  if (ms_index == -1) {
-    Serial.printf("WARNING: could not find microstep index for mode %d\n", ms_mode);
+bool StepperController::changeProgram(const StepperProgram& program) {
+  StepperProgram before = this->program;
+  this->program = program;
+  if (!startProgram()) {
+    this->program = before;
     return(false);
   }
+  journal.change(journal_program);
+  return(true);
+}
+
+// starts over if the program is already running
+bool StepperController::startProgram() {
+  if (!compileProgram()) return(false);
+  program_pending = true;
+  if (!head->changeStatus(STATUS_PROGRAM)) head->updateStepper();
+  return(true);
+}
 
-  bool changed = state->ms_auto | (state->ms_index != ms_index);
+// run: the duration at the current speed in position units (the step engine stops on the last one, no timing in the loop)
+long StepperController::run(float minutes) {
+  // a positive duration at a positive speed (negative ones would run in reverse)
+  double exact = (double) minutes * state->rpm * units_per_rotation;
+  if (!(minutes > 0 && state->rpm > 0) || !isRotationInRange(exact) || llround(exact) == 0) return(0);
+  uint64_t units = llround(exact);
+  run_rpm = state->rpm;
   #ifdef STEPPER_DEBUG_ON
-    if (changed)
-      Serial.printf("INFO: activating microstepping index %d for mode %d\n", ms_index, ms_mode);
-    else
-      Serial.printf("INFO: microstepping mode already active (%d)\n", state->ms_mode);
+    Serial.printf("INFO: running for %.3f minutes (%llu units at %.3f rpm)\n", minutes, (unsigned long long) units, state->rpm);
   #endif
+  return(startRotation(units, -1, false, minutes));
+}
 
-  if (changed) {
-    // update with new microstepping mode
-    state->ms_auto = false; // deactivate auto microstepping
-    state->ms_index = ms_index; // set the found index
-    state->ms_mode = driver->getMode(ms_index); // tracked for convenience
-    setSpeedWithSteppingLimit(state->rpm); // update speed (if necessary)
-    updateStepper();
-    saveDS();
-  }
-  return(changed);
+long StepperController::startRotation(int64_t units, float rpm_after, bool dispense, float minutes) {
+  if (!isRotationInRange(units)) return(0);
+  long move = state->direction * (long) units;
+  rotate_move = move;
+  rotate_pending = true;
+  // remember where the rotation ends on the odometer (resumes after a power loss, the odometer counts either direction)
+  updateOdometer();
+  saveOdometer(); // committed together with the rotation (the resume counts from it)
+  rotation.end = odometer.units + llabs(units);
+  rotation.units = llabs(units);
+  rotation.reverse = units < 0;
+  rotation.rpm_after = rpm_after;
+  rotation.dispense = dispense;
+  rotation.minutes = minutes;
+  journal.change(journal_rotation);
+  // restart the step engine if already rotating (it stops by itself at the previous target)
+  if (!head->changeStatus(minutes > 0 ? STATUS_RUN : STATUS_ROTATE)) head->updateStepper();
+  return(move);
 }
 
-int StepperController::findMicrostepIndexForRpm(float rpm) {
-  if (state->ms_auto) {
-    // automatic mode --> find lowest MS mode that can handle these rpm (otherwise go to full step -> ms_index = 0)
-    return(driver->findMicrostepIndexForRpm(rpm));
-  } else {
-    return(state->ms_index);
+// the remaining units scale with the speed (the engine's target moves by the difference, the odometer end with it)
+void StepperController::rescaleRun() {
+  float from_rpm = run_rpm;
+  run_rpm = state->rpm;
+  if (!(from_rpm > 0)) return;
+  double scale = (double) state->rpm / from_rpm;
+  long remaining = rotate_pending ? rotate_move : stepper->distanceToGo();
+  // a faster speed can't extend the remaining units beyond a move of the step engine (the run ends early then)
+  double exact = remaining * scale;
+  long rescaled = isRotationInRange(exact) ? lround(exact) : (exact < 0 ? -ROTATION_UNITS_MAX : ROTATION_UNITS_MAX);
+  if (rotate_pending) rotate_move = rescaled;
+  else stepper->moveTo(stepper->targetPosition() + (rescaled - remaining));
+  int64_t change = labs(rescaled) - labs(remaining);
+  rotation.end += change;
+  rotation.units += change;
+  journal.change(journal_rotation);
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: run rescaled from %.3f to %.3f rpm (%ld units remaining)\n", from_rpm, state->rpm, labs(rescaled));
+  #endif
+}
+
+// report a completed dispense and return to the speed from before
+void StepperController::completeRotation() {
+  if (rotation.dispense) {
+    updateOdometer();
+    uint64_t start = rotation.end - rotation.units;
+    dispensed = calibration.getVolume(odometer.units > start ? odometer.units - start : 0);
+    Serial.printf("INFO: dispensed %.4f%s\n", dispensed, calibration.units);
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_DISP));
+  }
+  if (rotation.rpm_after >= 0) {
+    state->ms_index = head->findMicrostepIndexForRpm(rotation.rpm_after);
+    state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
+    head->setSpeedWithSteppingLimit(rotation.rpm_after);
   }
+  rotation = StepperRotation();
+  journal.change(journal_rotation);
 }
 
-// start, stop, hold
-bool StepperController::start() { return(changeStatus(STATUS_ON)); }
-bool StepperController::stop() { return(changeStatus(STATUS_OFF)); }
-bool StepperController::hold() { return(changeStatus(STATUS_HOLD)); }
+// dispense (at the fastest speed the microstepping mode allows, decelerating in time to stop at the exact volume)
+bool StepperController::dispense(double volume) {
+  if (!calibration.isCalibrated() || !(volume > 0) || volume > calibration.getVolume(ROTATION_UNITS_MAX)) return(false);
+  uint64_t units = calibration.getUnits(volume);
+  // return to the current speed afterwards (or the one from before if already dispensing)
+  float rpm_after = (isRotating() && rotation.rpm_after >= 0) ? rotation.rpm_after : state->rpm;
+  float rpm = state->ms_auto ? head->getMaxRpm() : driver->getRpmLimit(state->ms_index, head->getMaxRpm());
+  state->ms_index = head->findMicrostepIndexForRpm(rpm);
+  state->ms_mode = driver->getMode(state->ms_index); // tracked for convenience
+  state->rpm = rpm;
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: dispensing %.4f%s (%.3f rotations) at %.3f rpm\n", volume, calibration.units, units / units_per_rotation, rpm);
+  #endif
+  startRotation(units, rpm_after, true);
+  saveDS();
+  return(true);
+}
 
-// number of rotations
-long StepperController::rotate(float number) {
-  long steps = state->direction * number * motor->steps * motor->gearing * state->ms_mode;
-  stepper.setCurrentPosition(0);
-  stepper.moveTo(steps);
-  changeStatus(STATUS_ROTATE);
-  return(steps);
+bool StepperController::changeSpeedFpm(float fpm) {
+  return(head->changeSpeedRpm(fpm / getRotationFlow()));
+}
+
+bool StepperController::changeCalibration(double volume, double per_units, char* units) {
+  if (!calibration.setFlow(volume, per_units, units)) return(false);
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: step-flow calibrated to %.6f%s/rotation\n", getRotationFlow(), calibration.units);
+  #endif
+  journal.change(journal_calibration);
+  fragments.invalidate(FRAGMENTS_CALIB);
+  return(true);
 }
 
 /***** DATA INFORMATION *****/
 
-void StepperController::clearData(bool all) {
-  // never clear persistent data
+void StepperController::clearData(bool /* all */) {
+  // never clear persistent data (whatever the caller asks for)
   DeviceController::clearData(false);
 }
 
@@ -384,10 +1224,14 @@ bool StepperController::assembleDataLog() {
 
 void StepperController::logRpm() {
 
+  PROFILE_BEGIN(PROFILE_LOG_RPM);
+
   // new rpm
   float new_rpm;
-  if (state->status == STATUS_ON || state->status == STATUS_ROTATE) {
+  if (state->status == STATUS_ON || isRotating()) {
     new_rpm = state->rpm * state->direction;
+  } else if (state->status == STATUS_PROGRAM && program_move < program_moves_n) {
+    new_rpm = program_moves[program_move].rpm * program_moves[program_move].direction;
   } else {
     new_rpm = 0.0;
   }
@@ -418,80 +1262,236 @@ void StepperController::logRpm() {
     updateDataInformation();
     clearData(false);
   }
+
+  PROFILE_END(PROFILE_LOG_RPM);
 }
 
 /****** STATE INFORMATION *******/
 
+void StepperController::updateStateFragments() {
+  // continuously changing fields
+  if (odometer.units != fragments_odometer_units) {
+    fragments_odometer_units = odometer.units;
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_ODO) | FRAGMENT_BIT(FRAGMENT_VOL) | FRAGMENT_BIT(FRAGMENT_RUN));
+  }
+  StepTimingStats* timing = stepper->getTiming();
+  if (timing->steps != fragments_timing_steps) {
+    fragments_timing_steps = timing->steps;
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_LATE));
+  }
+  StepTimingStats* trigger_timing = stepper->getTriggerTiming();
+  if (trigger_timing->steps != fragments_trigger_count) {
+    fragments_trigger_count = trigger_timing->steps;
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_TRIG));
+  }
+  if (encoder && encoder->getMaxError() != fragments_encoder_error) {
+    fragments_encoder_error = encoder->getMaxError();
+    fragments.invalidate(FRAGMENT_BIT(FRAGMENT_ENC));
+  }
+
+  if (fragments.refresh(FRAGMENT_STATUS)) {
+    getStepperStateStatusInfo(state->status, fragments.getJson(FRAGMENT_STATUS), STATE_FRAGMENT_JSON_SIZE);
+    getStepperStateStatusInfo(state->status, fragments.getText(FRAGMENT_STATUS), STATE_FRAGMENT_TEXT_SIZE, true);
+  }
+  if (fragments.refresh(FRAGMENT_DIR)) {
+    getStepperStateDirectionInfo(state->direction, fragments.getJson(FRAGMENT_DIR), STATE_FRAGMENT_JSON_SIZE);
+    getStepperStateDirectionInfo(state->direction, fragments.getText(FRAGMENT_DIR), STATE_FRAGMENT_TEXT_SIZE, true);
+  }
+  if (fragments.refresh(FRAGMENT_SPEED)) {
+    getStepperStateSpeedInfo(state->rpm, fragments.getJson(FRAGMENT_SPEED), STATE_FRAGMENT_JSON_SIZE);
+    getStepperStateSpeedInfo(state->rpm, fragments.getText(FRAGMENT_SPEED), STATE_FRAGMENT_TEXT_SIZE, true);
+  }
+  if (fragments.refresh(FRAGMENT_MS)) {
+    getStepperStateMSInfo(state->ms_auto, state->ms_mode, fragments.getJson(FRAGMENT_MS), STATE_FRAGMENT_JSON_SIZE);
+    getStepperStateMSInfo(state->ms_auto, state->ms_mode, fragments.getText(FRAGMENT_MS), STATE_FRAGMENT_TEXT_SIZE, true);
+  }
+  if (fragments.refresh(FRAGMENT_ODO)) {
+    getStepperStateOdometerInfo(odometer.getRotations(), fragments.getJson(FRAGMENT_ODO), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_CALIB) && calibration.isCalibrated()) {
+    getStepperStateCalibrationInfo(getRotationFlow(), calibration.units, fragments.getJson(FRAGMENT_CALIB), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_VOL) && calibration.isCalibrated()) {
+    getStepperStateVolumeInfo("vol", calibration.getVolume(odometer.units), calibration.units, fragments.getJson(FRAGMENT_VOL), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_DISP) && calibration.isCalibrated() && dispensed >= 0) {
+    getStepperStateVolumeInfo("disp", dispensed, calibration.units, fragments.getJson(FRAGMENT_DISP), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_LATE)) {
+    getStepperStateTimingInfo(timing->late, timing->steps, timing->max_late, fragments.getJson(FRAGMENT_LATE), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_RUN) && state->status == STATUS_RUN) {
+    // remaining time at the current speed, elapsed in terms of the run's duration
+    int64_t remaining = rotation.end - odometer.units;
+    double minutes = (remaining > 0 && state->rpm > 0) ? remaining / (state->rpm * units_per_rotation) : 0.0;
+    double elapsed = rotation.minutes > minutes ? rotation.minutes - minutes : 0.0;
+    getStepperStateRunInfo(elapsed, minutes, fragments.getJson(FRAGMENT_RUN), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_TRIG) && state->status == STATUS_TRIGGER) {
+    getStepperStateTriggerInfo(trigger.mode, trigger.rotations, trigger_timing->max_late, fragments.getJson(FRAGMENT_TRIG), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_ENC) && encoder) {
+    getStepperStateEncoderInfo(ENCODER_MODE_NAMES[encoder_mode], encoder->getMaxError(), STEPPER_ENCODER_TOLERANCE, encoder_stalls,
+      fragments.getJson(FRAGMENT_ENC), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (state->status == STATUS_PROGRAM) fragments.invalidate(FRAGMENT_BIT(FRAGMENT_PROG));
+  if (fragments.refresh(FRAGMENT_PROG) && state->status == STATUS_PROGRAM && program_move < program_moves_n) {
+    getStepperStateProgramInfo(program_moves[program_move].segment + 1, program.n, getProgramProgress(), fragments.getJson(FRAGMENT_PROG), STATE_FRAGMENT_JSON_SIZE);
+  }
+  if (fragments.refresh(FRAGMENT_LIMIT)) {
+    getStepperStateLimitInfo(stepper->getMaxSpeed(), rate_calibration.getRate(), head->getMaxRpm(), fragments.getJson(FRAGMENT_LIMIT), STATE_FRAGMENT_JSON_SIZE);
+  }
+}
+
 void StepperController::assembleStateInformation() {
   DeviceController::assembleStateInformation();
-  char pair[60];
-  getStepperStateStatusInfo(state->status, pair, sizeof(pair)); addToStateInformation(pair);
-  getStepperStateDirectionInfo(state->direction, pair, sizeof(pair)); addToStateInformation(pair);
-  getStepperStateSpeedInfo(state->rpm, pair, sizeof(pair)); addToStateInformation(pair);
-  getStepperStateMSInfo(state->ms_auto, state->ms_mode, pair, sizeof(pair)); addToStateInformation(pair);
+  updateStateFragments();
+  for (int i = 0; i < FRAGMENTS_N; i++) {
+    char* json = fragments.getJson((StateFragment) i);
+    if (json[0] != 0) addToStateInformation(json);
+  }
+  for (int i = 0; i < channels_n; i++) addToStateInformation(channels[i]->getStateInformation(i + 2));
 }
 
 void StepperController::updateStateInformation() {
 
+  PROFILE_BEGIN(PROFILE_STATE_INFO);
+
   // state information
   DeviceController::updateStateInformation();
 
-  // LCD update
-  if (lcd) {
+  // record any change, queue a state event if a setting changed
+  uint32_t hash = hashStateText(STATE_HASH_SEED, state_information);
+  if (hash != state_hash) {
+    state_hash = hash;
+    if (recording) Serial.printf("R:%lu,state,%s\n", millis(), state_information);
+  }
+  uint32_t settings = hashStateSettings();
+  if (settings != state_event_hash) {
+    state_event_hash = settings;
+    state_event_pending = true;
+  }
+
+  // LCD lines from the state fragments (formatted by assembleStateInformation()), pushed to the panel from update()
+  // (appended in bounded pieces, a long value is cut off at the end of the line)
+  snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Status: ");
+  snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", fragments.getText(FRAGMENT_STATUS));
+  display.print(2, lcd_buffer);
 
-    snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Status: ");
-    getStepperStateStatusInfo(state->status, lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), true);
-    lcd->printLine(2, lcd_buffer);
+  snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Speed: ");
+  snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", fragments.getText(FRAGMENT_SPEED));
+  display.print(3, lcd_buffer);
 
-    snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Speed: ");
-    getStepperStateSpeedInfo(state->rpm, lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), true);
-    lcd->printLine(3, lcd_buffer);
+  snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Dir: ");
+  snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", fragments.getText(FRAGMENT_DIR));
+  snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", "  MS: ");
+  snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", fragments.getText(FRAGMENT_MS));
+  display.print(4, lcd_buffer);
 
-    snprintf(lcd_buffer, sizeof(lcd_buffer), "%s", "Dir: ");
-    getStepperStateDirectionInfo(state->direction, lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), true);
-    snprintf(lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), "%s", "  MS: ");
-    getStepperStateMSInfo(state->ms_auto, state->ms_mode, lcd_buffer + strlen(lcd_buffer), sizeof(lcd_buffer) - strlen(lcd_buffer), true);
-    lcd->printLine(4, lcd_buffer);
+  PROFILE_END(PROFILE_STATE_INFO);
+}
 
+// fragments and fields the state information formats them from (measured fields are left out)
+uint32_t StepperController::hashStateSettings() {
+  const StateFragment settings[] = {FRAGMENT_STATUS, FRAGMENT_DIR, FRAGMENT_SPEED, FRAGMENT_MS, FRAGMENT_CALIB};
+  uint32_t hash = STATE_HASH_SEED;
+  for (StateFragment fragment : settings) hash = hashStateText(hash, fragments.getJson(fragment));
+  hash = hashStateBytes(hash, &state->locked, sizeof(state->locked));
+  if (state->status == STATUS_TRIGGER) {
+    hash = hashStateBytes(hash, &trigger.mode, sizeof(trigger.mode));
+    hash = hashStateBytes(hash, &trigger.rotations, sizeof(trigger.rotations));
   }
+  for (int i = 0; i < channels_n; i++) hash = hashStateText(hash, channels[i]->getStateInformation(i + 2));
+  return(hash);
+}
+
+void StepperController::publishStateEvent() {
+  if (millis() - state_event_last < STATE_EVENT_PERIOD_MS || !Particle.connected()) return;
+  PROFILE_BEGIN(PROFILE_STATE_INFO);
+  char event[STATE_EVENT_MAX + 1];
+  int length = snprintf(event, sizeof(event), "{\"seq\":%d,\"state\":%s}", state_event_seq + 1, state_information);
+  if (length >= (int) sizeof(event)) snprintf(event, sizeof(event), "{\"seq\":%d,\"state\":null}", state_event_seq + 1);
+  if (Particle.publish(STATE_EVENT, event, PRIVATE)) {
+    state_event_seq++;
+    state_event_pending = false;
+    state_event_published = state_hash;
+    state_event_heartbeat = millis();
+    #ifdef CLOUD_DEBUG_ON
+      Serial.printf("INFO: state event %d published\n", state_event_seq);
+    #endif
+  }
+  state_event_last = millis();
+  PROFILE_END(PROFILE_STATE_INFO);
 }
 
 /****** WEB COMMAND PROCESSING *******/
 
+void StepperController::parseCommandArgs(const char* format) {
+  args = StepperCommandArgs();
+  char first[sizeof(command.value)] = "";
+  int n = 0;
+  for (const char* f = format; *f != 0; f++) {
+    if (*f == 'u') {
+      command.extractUnits();
+    } else if (n < CMD_ARGS_MAX) {
+      command.extractValue();
+      char* end;
+      args.number[n] = strtod(command.value, &end);
+      args.converted[n] = end > command.value;
+      if (n++ == 0) strcpy(first, command.value);
+    }
+  }
+  if (n > 1) strcpy(command.value, first);
+}
+
 bool StepperController::parseStatus() {
   if (command.parseVariable(CMD_START)) {
     // start
-    command.success(start());
+    command.success(command_channel->changeStatus(STATUS_ON));
   } else if (command.parseVariable(CMD_STOP)) {
     // stop
-    command.success(stop());
+    command.success(command_channel->changeStatus(STATUS_OFF));
   } else if (command.parseVariable(CMD_HOLD)) {
     // hold
-    command.success(hold());
+    command.success(command_channel->changeStatus(STATUS_HOLD));
   } else if (command.parseVariable(CMD_RUN)) {
-    // run - not yet implemented FIXME
+    // run
+    if (args.converted[0] && run(args.number[0]) != 0) {
+      // run always counts as new command b/c it starts from scratch
+      command.success(true);
+    } else {
+      // no number, invalid value (not a positive duration at a positive speed, or more steps than a move can take)
+      command.errorValue();
+    }
   } else if (command.parseVariable(CMD_AUTO)) {
-    // auto - not yet implemented FIXME
+    // auto: gate (default) or dose per rising edge
+    if (board->trigger < 0) {
+      command.error(CMD_RET_ERR_TRIGGER, ERROR_TRIGGER);
+    } else if (command.value[0] == 0 || command.parseValue(CMD_AUTO_GATE)) {
+      command.success(changeTrigger(TRIGGER_GATE));
+    } else if (command.parseValue(CMD_AUTO_DOSE)) {
+      if (args.converted[1] && args.number[1] > 0) command.success(changeTrigger(TRIGGER_DOSE, args.number[1]));
+      else command.errorValue();
+    } else {
+      command.errorValue();
+    }
   } else if (command.parseVariable(CMD_ROTATE)) {
     // rotate
-    command.extractValue();
-    char* end;
-    float number = strtof (command.value, &end);
-    int converted = end - command.value;
-    if (converted > 0) {
+    float number = args.number[0];
+    if (args.converted[0] && isRotationInRange((double) number * units_per_rotation)) {
       // valid number
       rotate(number);
       // rotate always counts as new command b/c rotation starts from scratch
       command.success(true);
     } else {
-      // no number, invalid value
+      // no number, invalid value (or more steps than a move can take)
       command.errorValue();
     }
   }
 
   // set command data if type defined
   if (command.isTypeDefined()) {
-    getStepperStateStatusInfo(state->status, command.data, sizeof(command.data));
+    getStepperStateStatusInfo(command_channel->getState()->status, command.data, sizeof(command.data));
   }
 
   return(command.isTypeDefined());
@@ -499,18 +1499,18 @@ bool StepperController::parseStatus() {
 
 bool StepperController::parseDirection() {
 
+  StepperState* channel_state = command_channel->getState();
   if (command.parseVariable(CMD_DIR)) {
     // direction
-    command.extractValue();
     if (command.parseValue(CMD_DIR_CW)) {
       // clockwise
-      command.success(changeDirection(DIR_CW));
+      command.success(command_channel->changeDirection(DIR_CW));
     } else if (command.parseValue(CMD_DIR_CC)) {
       // counter clockwise
-      command.success(changeDirection(DIR_CC));
+      command.success(command_channel->changeDirection(DIR_CC));
     } else if (command.parseValue(CMD_DIR_SWITCH)) {
       // switch
-      command.success(changeDirection(-state->direction));
+      command.success(command_channel->changeDirection(-channel_state->direction));
     } else {
       // invalid
       command.errorValue();
@@ -519,7 +1519,7 @@ bool StepperController::parseDirection() {
 
   // set command data if type defined
   if (command.isTypeDefined()) {
-    getStepperStateDirectionInfo(state->direction, command.data, sizeof(command.data));
+    getStepperStateDirectionInfo(channel_state->direction, command.data, sizeof(command.data));
   }
 
   return(command.isTypeDefined());
@@ -527,20 +1527,17 @@ bool StepperController::parseDirection() {
 
 bool StepperController::parseSpeed() {
 
+  StepperState* channel_state = command_channel->getState();
   if (command.parseVariable(CMD_SPEED)) {
     // speed
-    command.extractValue();
-    command.extractUnits();
-
+    float number = args.number[0];
+    bool converted = args.converted[0];
     if (command.parseUnits(SPEED_RPM)) {
       // speed rpm
-      char* end;
-      float number = strtof (command.value, &end);
-      int converted = end - command.value;
-      if (converted > 0) {
+      if (converted) {
         // valid number
-        command.success(changeSpeedRpm(number));
-        if( (state->rpm - number) < 0.0 ) {
+        command.success(command_channel->changeSpeedRpm(number));
+        if( (channel_state->rpm - number) < 0.0 ) {
           // could not set to rpm, hit the max --> set warning
           command.warning(CMD_RET_WARN_MAX_RPM, CMD_RET_WARN_MAX_RPM_TEXT);
         }
@@ -548,9 +1545,21 @@ bool StepperController::parseSpeed() {
         // no number, invalid value
         command.errorValue();
       }
-    //} else if (command.parseUnits(SPEED_FPM)) {
-      // speed fpm
-      // TODO
+    } else if (command.parseUnits(SPEED_FPM) && command_channel == head) {
+      // speed fpm (the calibration is channel 1's)
+      if (!calibration.isCalibrated()) {
+        command.error(CMD_RET_ERR_CALIB, ERROR_CALIB);
+      } else if (converted) {
+        // valid number
+        command.success(changeSpeedFpm(number));
+        if( (state->rpm - number / getRotationFlow()) < 0.0 ) {
+          // could not set to fpm, hit the max --> set warning
+          command.warning(CMD_RET_WARN_MAX_RPM, CMD_RET_WARN_MAX_RPM_TEXT);
+        }
+      } else {
+        // no number, invalid value
+        command.errorValue();
+      }
     } else {
       command.errorUnits();
     }
@@ -558,7 +1567,104 @@ bool StepperController::parseSpeed() {
 
   // set command data if type defined
   if (command.isTypeDefined()) {
-    getStepperStateSpeedInfo(state->rpm, command.data, sizeof(command.data));
+    getStepperStateSpeedInfo(channel_state->rpm, command.data, sizeof(command.data));
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseRamp() {
+
+  StepperState* channel_state = command_channel->getState();
+  if (command.parseVariable(CMD_RAMP)) {
+    // ramp
+    if (command.parseUnits(SPEED_RPM)) {
+      // ramp rpm, the duration follows the units
+      float number = args.number[0], minutes = args.number[1];
+      if (args.converted[0] && args.converted[1] && minutes >= 0) {
+        // valid numbers
+        command.success(command_channel->ramp(number, minutes));
+        if( (channel_state->rpm - number) < 0.0 ) {
+          // could not set to rpm, hit the max --> set warning
+          command.warning(CMD_RET_WARN_MAX_RPM, CMD_RET_WARN_MAX_RPM_TEXT);
+        }
+      } else {
+        // no number, invalid value
+        command.errorValue();
+      }
+    } else {
+      command.errorUnits();
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined()) {
+    getStepperStateSpeedInfo(channel_state->rpm, command.data, sizeof(command.data));
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseDispense() {
+
+  if (command.parseVariable(CMD_DISPENSE)) {
+    // dispense
+    double volume = args.number[0];
+    bool converted = args.converted[0];
+    if (!calibration.isCalibrated()) {
+      command.error(CMD_RET_ERR_CALIB, ERROR_CALIB);
+    } else if (!command.parseUnits(calibration.units)) {
+      command.errorUnits();
+    } else if (converted && volume > 0 && volume <= calibration.getVolume(ROTATION_UNITS_MAX)) {
+      // valid volume, dispense always counts as new command b/c it starts from scratch
+      command.success(dispense(volume));
+    } else {
+      // no number, invalid value (or more steps than a move can take)
+      command.errorValue();
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined()) {
+    getStepperStateStatusInfo(state->status, command.data, sizeof(command.data));
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseCalibrate() {
+
+  if (command.parseVariable(CMD_SET)) {
+    // calibrate: which calibration, then volume and volume units
+    double per_units = -1; // position units the volume is measured over
+    if (command.parseValue(SET_STEP_FLOW)) {
+      // volume per (full) step
+      per_units = driver->getFullStepUnits();
+    } else if (command.parseValue(SET_ROT_FLOW)) {
+      // volume per rotation
+      per_units = units_per_rotation;
+    } else if (command.parseValue(SET_FPM)) {
+      // volume per minute at the current speed
+      per_units = (double) state->rpm * units_per_rotation;
+    }
+    if (per_units < 0) {
+      command.error(CMD_RET_ERR_SET, ERROR_SET);
+    } else if (per_units == 0) {
+      // fpm calibration without a speed
+      command.errorValue();
+    } else {
+      double volume = args.number[1];
+      if (args.converted[1] && volume > 0 && command.units[0] != 0) {
+        command.success(changeCalibration(volume, per_units, command.units));
+      } else {
+        command.errorValue();
+      }
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined() && calibration.isCalibrated()) {
+    getStepperStateCalibrationInfo(getRotationFlow(), calibration.units, command.data, sizeof(command.data));
   }
 
   return(command.isTypeDefined());
@@ -566,41 +1672,381 @@ bool StepperController::parseSpeed() {
 
 bool StepperController::parseMS() {
 
+  StepperState* channel_state = command_channel->getState();
   if (command.parseVariable(CMD_STEP)) {
     // microstepping
-    command.extractValue();
     if (command.parseValue(CMD_STEP_AUTO)) {
-      command.success(changeToAutoMicrosteppingMode());
+      command.success(command_channel->changeToAutoMicrosteppingMode());
     } else {
-      int ms_mode = atoi(command.value);
-      command.success(changeMicrosteppingMode(ms_mode));
+      int ms_mode = args.converted[0] ? (int) args.number[0] : 0;
+      command.success(command_channel->changeMicrosteppingMode(ms_mode));
     }
   }
 
   // set command data if type defined
   if (command.isTypeDefined()) {
-    getStepperStateMSInfo(state->ms_auto, state->ms_mode, command.data, sizeof(command.data));
+    getStepperStateMSInfo(channel_state->ms_auto, channel_state->ms_mode, command.data, sizeof(command.data));
   }
 
   return(command.isTypeDefined());
 }
 
-void StepperController::parseCommand() {
+bool StepperController::parseTiming() {
+
+  if (command.parseVariable(CMD_TIMING)) {
+    // step timing statistics
+    StepTimingStats* timing = stepper->getTiming();
+    Serial.printf("INFO: step timing: %lu steps, %lu late (> %dus), max late %luus, max early %luus\n",
+      timing->steps, timing->late, STEP_TIMING_LATE_US, timing->max_late, timing->max_early);
+    for (int i = 0; i < STEP_TIMING_BUCKETS; i++) {
+      if (timing->histogram[i] > 0)
+        Serial.printf("   |deviation| >= %luus: %lu\n", StepTimingStats::getBucketStart(i), timing->histogram[i]);
+    }
+    StepTimingStats* trigger_timing = stepper->getTriggerTiming();
+    if (trigger_timing->steps > 0) {
+      Serial.printf("INFO: trigger latency: %lu triggers, max %luus to the first step\n", trigger_timing->steps, trigger_timing->max_late);
+      for (int i = 0; i < STEP_TIMING_BUCKETS; i++) {
+        if (trigger_timing->histogram[i] > 0)
+          Serial.printf("   latency >= %luus: %lu\n", StepTimingStats::getBucketStart(i), trigger_timing->histogram[i]);
+      }
+    }
+    getStepperStateTimingInfo(timing->late, timing->steps, timing->max_late, command.data, sizeof(command.data));
+    if (command.parseValue(CMD_TIMING_RESET)) {
+      // reset
+      resetTiming();
+      command.success(true);
+    } else if (command.value[0] == 0) {
+      // report only
+      command.success(true);
+    } else {
+      // invalid
+      command.errorValue();
+    }
+  }
 
-  DeviceController::parseCommand();
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseTelemetry() {
 
+  if (command.parseVariable(CMD_TELEMETRY)) {
+    // sampling period (or off) and output
+    float period = args.number[0];
+    if (command.parseValue(CMD_TELEMETRY_OFF)) {
+      command.success(telemetry_output != TELEMETRY_OFF);
+      changeTelemetry(TELEMETRY_OFF, telemetry_period_ms);
+    } else if (!args.converted[0] || period < TELEMETRY_PERIOD_MIN_MS) {
+      command.errorValue();
+    } else if (command.units[0] != 0 && !command.parseUnits(CMD_TELEMETRY_SERIAL) && !command.parseUnits(CMD_TELEMETRY_CLOUD)) {
+      command.errorUnits();
+    } else {
+      uint8_t output = command.parseUnits(CMD_TELEMETRY_CLOUD) ? TELEMETRY_CLOUD : TELEMETRY_SERIAL;
+      bool changed = output != telemetry_output || (unsigned long) period != telemetry_period_ms;
+      if (changed) changeTelemetry(output, period);
+      command.success(changed);
+    }
+  }
+
+  // set command data if type defined
   if (command.isTypeDefined()) {
-    // command processed successfully by parent function
-  } else if (parseStatus()) {
-    // check for status commands
-  } else if (parseDirection()) {
-    // check for direction commands
-  } else if (parseSpeed()) {
-    // check for speed commands
-  //} else if (parseRamp()) {
-    // check for ramp commands - TODO
-  } else if (parseMS()) {
-    // check for microstepping commands
+    if (telemetry_output == TELEMETRY_OFF) {
+      snprintf(command.data, sizeof(command.data), "\"telemetry\":\"off\"");
+    } else {
+      snprintf(command.data, sizeof(command.data), "\"telemetry\":\"%lums %s\",\"dropped\":%lu", telemetry_period_ms,
+        telemetry_output == TELEMETRY_CLOUD ? CMD_TELEMETRY_CLOUD : CMD_TELEMETRY_SERIAL, telemetry.getDropped());
+    }
+  }
+
+  return(command.isTypeDefined());
+}
+
+#ifdef STEPPER_PROFILE_ON
+bool StepperController::parseProfile() {
+
+  if (command.parseVariable(CMD_PROFILE)) {
+    // dump and reset the loop profile
+    ProfilePhase worst = profiler.dump();
+    snprintf(command.data, sizeof(command.data), "max %s %luus", PROFILE_PHASE_NAMES[worst], profiler.getMax(worst));
+    profiler.reset();
+    command.success(true);
+  }
+
+  return(command.isTypeDefined());
+}
+#endif
+
+bool StepperController::parseBatch() {
+
+  if (command.parseVariable(CMD_BATCH)) {
+    // commands follow the batch keyword
+    char batch[sizeof(command.command)];
+    strncpy(batch, command.command, sizeof(batch) - 1);
+    batch[sizeof(batch) - 1] = 0;
+    char* next = strstr(batch, CMD_BATCH) + strlen(CMD_BATCH);
+
+    // snapshot to roll back to if a command fails
+    StepperRotation saved_rotation = rotation;
+    StepperCalibration saved_calibration = calibration;
+    StepperTrigger saved_trigger = trigger;
+    StepperProgram saved_program = program;
+    bool saved_rotate_pending = rotate_pending;
+    long saved_rotate_move = rotate_move;
+    uint8_t saved_encoder_mode = encoder_mode;
+    uint8_t saved_encoder_retries = encoder_retries;
+    // compiled by 'program' (the running program's moves)
+    StepperProgramMove saved_program_moves[PROGRAM_MOVES_MAX];
+    memcpy(saved_program_moves, program_moves, sizeof(program_moves));
+    uint8_t saved_program_moves_n = program_moves_n;
+    int saved_program_ms_index = program_ms_index;
+    bool saved_program_pending = program_pending;
+    StepperState saved_channels[STEPPER_CHANNELS_MAX]; // incl. channel 1
+    for (int i = 0; i < channels_n; i++) saved_channels[i] = *channels[i]->getState();
+
+    batching = true;
+    batch_timing_reset = false;
+    batch_telemetry = false;
+    batch_recording = -1;
+    for (int i = 0; i < channels_n; i++) channels[i]->startBatch();
+    int ret_val = CMD_RET_SUCCESS;
+    int n = 0;
+    char codes[sizeof(command.data)] = "";
+    while (next) {
+      char* single = next;
+      next = strchr(next, CMD_BATCH_SEPARATOR);
+      if (next) *next++ = 0;
+      while (*single == ' ') single++;
+      if (*single == 0) continue;
+      command.load(single);
+      command.extractVariable();
+      if (command.parseVariable(CMD_BATCH)) {
+        // no batches within batches
+        command.errorCommand();
+      } else {
+        parseCommand();
+        if (!command.isTypeDefined()) command.errorCommand();
+      }
+      snprintf(codes + strlen(codes), sizeof(codes) - strlen(codes), n++ > 0 ? ",%d" : "%d", command.ret_val);
+      if (command.ret_val < 0) {
+        ret_val = command.ret_val;
+        break;
+      }
+      if (command.ret_val > ret_val) ret_val = command.ret_val;
+    }
+    batching = false;
+
+    if (ret_val < 0) {
+      // all or none
+      #ifdef STEPPER_DEBUG_ON
+        Serial.printf("INFO: batch command %d failed (%d), rolling back\n", n, ret_val);
+      #endif
+      rotation = saved_rotation;
+      calibration = saved_calibration;
+      trigger = saved_trigger;
+      program = saved_program;
+      rotate_pending = saved_rotate_pending;
+      rotate_move = saved_rotate_move;
+      if (encoder_mode != saved_encoder_mode) changeEncoderMode(saved_encoder_mode);
+      encoder_retries = saved_encoder_retries;
+      memcpy(program_moves, saved_program_moves, sizeof(program_moves));
+      program_moves_n = saved_program_moves_n;
+      program_ms_index = saved_program_ms_index;
+      program_pending = saved_program_pending;
+      for (int i = 0; i < channels_n; i++) {
+        channels[i]->endBatch(false);
+        channels[i]->restoreState(saved_channels[i]);
+      }
+      invalidateStateInformation();
+    } else {
+      for (int i = 0; i < channels_n; i++) channels[i]->endBatch(true);
+      if (batch_timing_reset) resetTiming();
+      if (batch_telemetry) changeTelemetry(batch_telemetry_output, batch_telemetry_period_ms);
+      if (batch_recording >= 0) changeRecording(batch_recording);
+    }
+
+    // report as the batch command with the result of each command
+    command.load(batch);
+    command.extractVariable();
+    command.parseVariable(CMD_BATCH);
+    if (ret_val < 0) command.error(ret_val, "batch command failed");
+    else if (ret_val > 0) command.warning(ret_val, "batch command warning");
+    else command.success(true);
+    snprintf(command.data, sizeof(command.data), "%s", codes);
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseChannel() {
+
+  if (command.parseVariable(CMD_CHANNEL)) {
+    // channel number, the channel's command follows
+    char channel_command[sizeof(command.command)];
+    strncpy(channel_command, command.command, sizeof(channel_command) - 1);
+    channel_command[sizeof(channel_command) - 1] = 0;
+    char* number = strstr(channel_command, CMD_CHANNEL) + strlen(CMD_CHANNEL);
+    char* next;
+    long channel = strtol(number, &next, 10);
+    while (*next == ' ') next++;
+    if (next == number || channel < 1 || channel > channels_n || *next == 0) {
+      command.errorValue();
+    } else {
+      command.load(next);
+      command.extractVariable();
+      if (command.parseVariable(CMD_CHANNEL) || (batching && command.parseVariable(CMD_BATCH))) {
+        // no channels within channels (or batches within batches)
+        command.errorCommand();
+      } else {
+        // channel 1 is the controller's own motor (all commands), the others take the channel commands
+        command_channel = channels[channel - 1];
+        parseCommand();
+        command_channel = head;
+        if (!command.isTypeDefined()) command.errorCommand();
+      }
+    }
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseRecord() {
+
+  if (command.parseVariable(CMD_RECORD)) {
+    // on or off
+    if (command.parseValue(CMD_RECORD_ON)) {
+      command.success(!recording);
+      changeRecording(true);
+    } else if (command.parseValue(CMD_RECORD_OFF)) {
+      command.success(recording);
+      changeRecording(false);
+    } else {
+      command.errorValue();
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined()) {
+    snprintf(command.data, sizeof(command.data), "\"record\":\"%s\"", recording ? CMD_RECORD_ON : CMD_RECORD_OFF);
+  }
+
+  return(command.isTypeDefined());
+}
+
+// segments: rpm@length[m/s/r][~] separated by commas (more than a command value holds, parsed from the command itself)
+bool StepperController::parseProgram() {
+
+  if (command.parseVariable(CMD_PROGRAM)) {
+    char text[sizeof(command.command)];
+    strncpy(text, command.command, sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    char* next = strstr(text, CMD_PROGRAM) + strlen(CMD_PROGRAM);
+    while (*next == ' ') next++;
+    if (command.value[0] == 0) {
+      // report only
+      command.success(true);
+    } else if (command.parseValue(CMD_PROGRAM_START)) {
+      if (startProgram()) command.success(true);
+      else command.error(CMD_RET_ERR_PROGRAM, ERROR_PROGRAM);
+    } else {
+      StepperProgram loaded;
+      bool valid = true;
+      while (valid && *next != 0 && *next != ' ') {
+        StepperProgramSegment* segment = &loaded.segments[loaded.n];
+        char* end;
+        segment->rpm = strtod(next, &end);
+        valid = end > next && *end == '@' && loaded.n < PROGRAM_SEGMENTS_MAX;
+        next = end + 1;
+        if (valid) segment->length = strtod(next, &end);
+        valid = valid && end > next;
+        next = end;
+        segment->flags = 0;
+        if (*next == 's') segment->length /= 60.0;
+        else if (*next == 'r') segment->flags |= PROGRAM_ROTATIONS;
+        else if (*next != 'm') valid = false;
+        next++;
+        if (valid && *next == '~') {
+          segment->flags |= PROGRAM_RAMP;
+          next++;
+        }
+        if (valid && *next == CMD_PROGRAM_SEPARATOR) next++;
+        else if (valid && *next != 0 && *next != ' ') valid = false;
+        loaded.n++;
+      }
+      if (!valid) command.errorValue();
+      else if (changeProgram(loaded)) command.success(true);
+      else command.error(CMD_RET_ERR_PROGRAM, ERROR_PROGRAM);
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined()) {
+    if (state->status == STATUS_PROGRAM && program_move < program_moves_n) {
+      getStepperStateProgramInfo(program_moves[program_move].segment + 1, program.n, getProgramProgress(), command.data, sizeof(command.data));
+    } else {
+      snprintf(command.data, sizeof(command.data), "\"prog\":\"%d segments\"", program.n);
+    }
+  }
+
+  return(command.isTypeDefined());
+}
+
+bool StepperController::parseEncoder() {
+
+  if (command.parseVariable(CMD_ENCODER)) {
+    // stall reaction (or report only)
+    if (!encoder) {
+      command.error(CMD_RET_ERR_ENCODER, ERROR_ENCODER);
+    } else if (command.value[0] == 0) {
+      command.success(true);
+    } else if (command.parseValue(CMD_ENCODER_OFF)) {
+      command.success(changeEncoderMode(ENCODER_OFF));
+    } else if (command.parseValue(CMD_ENCODER_STOP)) {
+      command.success(changeEncoderMode(ENCODER_STOP));
+    } else if (command.parseValue(CMD_ENCODER_RETRY)) {
+      command.success(changeEncoderMode(ENCODER_RETRY));
+    } else if (command.parseValue(CMD_ENCODER_BACKOFF)) {
+      command.success(changeEncoderMode(ENCODER_BACKOFF));
+    } else {
+      command.errorValue();
+    }
+  }
+
+  // set command data if type defined
+  if (command.isTypeDefined() && encoder) {
+    getStepperStateEncoderInfo(ENCODER_MODE_NAMES[encoder_mode], encoder->getMaxError(), STEPPER_ENCODER_TOLERANCE, encoder_stalls,
+      command.data, sizeof(command.data));
+  }
+
+  return(command.isTypeDefined());
+}
+
+// recording ('record on') prints every command as received and every state change on serial, for replaying them in the
+// host simulation (sim/pump_sim -c):
+//   R:<millis>,cmd,<return code>,<command>  once the command is parsed (cloud function or local control, not 'record' itself)
+//   R:<millis>,state,<state information>    whenever the state information changes (and once when the recording starts)
+void StepperController::parseCommand() {
+
+  // top level command as received (batch and channel commands load their parts into the command)
+  char received[sizeof(command.command)];
+  bool record = recording && command_depth == 0 && strcmp(command.variable, CMD_RECORD) != 0;
+  if (record) snprintf(received, sizeof(received), "%s", command.command);
+  command_depth++;
+
+  // device commands (lock, logging, ...) are channel 1's
+  if (command_channel == head) DeviceController::parseCommand();
+
+  if (!command.isTypeDefined()) {
+    // stepper and pump commands (unless processed by the parent function)
+    const StepperCommandHandler* handler = findStepperCommandHandler(command.variable);
+    if (handler != nullptr && (handler->channels || command_channel == head)) {
+      parseCommandArgs(handler->args);
+      (this->*handler->parse)();
+    }
+  }
+
+  command_depth--;
+  if (record) {
+    if (!command.isTypeDefined()) command.errorCommand();
+    Serial.printf("R:%lu,cmd,%d,%s\n", millis(), command.ret_val, received);
   }
 
 }
@@ -0,0 +1,59 @@
+#pragma once
+#include "device/DeviceController.h"
+
+// shadow framebuffer of the LCD lines written by the controller
+// - print() only updates the shadow (no I2C on the command path), lines that differ from the panel are marked dirty
+// - update() (time-sliced from the loop) pushes at most DISPLAY_LINES_PER_UPDATE dirty lines to the panel per call
+#define DISPLAY_LINES             4
+#define DISPLAY_COLS              20
+#define DISPLAY_LINES_PER_UPDATE  1
+
+class StepperDisplayBuffer {
+
+  private:
+
+    DeviceDisplay* lcd;
+    char shadow[DISPLAY_LINES][DISPLAY_COLS + 1]; // written by the controller
+    char panel[DISPLAY_LINES][DISPLAY_COLS + 1]; // last pushed to the LCD
+    uint8_t dirty = 0; // bit per line
+    uint8_t next = 0; // next line to check (round robin)
+
+  public:
+
+    StepperDisplayBuffer(DeviceDisplay* lcd) : lcd(lcd) {
+      for (int i = 0; i < DISPLAY_LINES; i++) {
+        shadow[i][0] = 0;
+        panel[i][0] = 0;
+      }
+    };
+
+    void print(int line, const char* text); // line 1 to DISPLAY_LINES (same as DeviceDisplay::printLine)
+    void update(); // push dirty lines
+    bool isDirty() { return(dirty != 0); };
+
+};
+
+void StepperDisplayBuffer::print(int line, const char* text) {
+  if (line < 1 || line > DISPLAY_LINES) return;
+  int i = line - 1;
+  // at most one line of characters (longer text is cut off)
+  size_t n = strnlen(text, DISPLAY_COLS);
+  memcpy(shadow[i], text, n);
+  shadow[i][n] = 0;
+  if (strcmp(shadow[i], panel[i]) != 0) dirty |= 1 << i;
+  else dirty &= ~(1 << i);
+}
+
+void StepperDisplayBuffer::update() {
+  if (lcd == nullptr) return;
+  for (int pushed = 0, checked = 0; dirty != 0 && pushed < DISPLAY_LINES_PER_UPDATE && checked < DISPLAY_LINES; checked++) {
+    int i = next;
+    next = (next + 1) % DISPLAY_LINES;
+    if (dirty & (1 << i)) {
+      lcd->printLine(i + 1, shadow[i]);
+      strcpy(panel[i], shadow[i]);
+      dirty &= ~(1 << i);
+      pushed++;
+    }
+  }
+}
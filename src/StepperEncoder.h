@@ -0,0 +1,115 @@
+#pragma once
+#include "application.h"
+#include "StepperConfig.h"
+#include "StepperEngine.h"
+
+// closed loop feedback from a quadrature encoder on the motor shaft
+// - every edge of both channels is counted in their pin change interrupts (4x decoding with a transition table,
+//   a transition with both channels changed means an edge was missed and is not counted)
+// - the step interrupt compares the engine position, scaled to counts, with the count since the last sync after every step:
+//   a following error beyond the tolerance is a stall or slip, the engine stops at that step and the fault stays latched
+//   until the controller handled it (stop, retry or back off, see StepperController)
+// - scaling is 16.16 fixed point counts per unit (one multiply per step), so a motor that stops following is caught
+//   within tolerance + 1 counts worth of steps
+#define STEPPER_ENCODER_TOLERANCE     6 // [counts] following error that counts as a stall or slip (a full step is 2 counts at 400 counts/rotation)
+#define STEPPER_ENCODER_RETRIES       3 // restarts after a stall before the pump turns off
+#define STEPPER_ENCODER_RETRY_RESET   10000 // [ms] without a stall that restore the retries
+#define STEPPER_ENCODER_BACKOFF       0.8 // speed factor for each restart in backoff mode
+
+// reaction to a stall
+#define ENCODER_OFF     0 // counted only (open loop)
+#define ENCODER_STOP    1 // stop the pump
+#define ENCODER_RETRY   2 // restart at the same speed
+#define ENCODER_BACKOFF 3 // restart at a lower speed
+
+// count change for (last A, last B, A, B), A leads B in the positive direction: 00 -> 10 -> 11 -> 01 -> 00
+static const int8_t ENCODER_TRANSITIONS[16] = { 0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0 };
+
+class StepperEncoder : public StepperStepMonitor {
+
+  private:
+
+    const StepperEncoderConfig* config;
+
+    // counting (modified by the pin interrupts)
+    static StepperEncoder* instance; // encoder served by the pin interrupts
+    static void encoderISR() { instance->decode(); };
+    volatile int32_t count = 0;
+    volatile uint8_t channels = 0; // last levels of A (bit 1) and B (bit 0)
+    volatile uint32_t missed = 0; // transitions with both channels changed
+
+    // following error (checked by the step interrupt)
+    int32_t scale = 0; // counts per unit [16.16]
+    volatile int32_t sync_position = 0; // engine position and count that correspond
+    volatile int32_t sync_count = 0;
+    volatile int32_t max_error = 0; // worst |error| since the last sync [counts]
+    volatile bool fault = false;
+    volatile int32_t fault_error = 0; // error that stopped the engine [counts]
+
+    void decode();
+    int32_t getMeasured() { return(config->inverted ? sync_count - count : count - sync_count); }; // [counts] since the sync
+
+  public:
+
+    StepperEncoder(const StepperEncoderConfig* config) : config(config) {};
+
+    void init(float units_per_motor_rotation);
+    void sync(int32_t position); // the motor is at the engine position (at standstill), clears a fault
+    bool check(int32_t position) override; // from the step interrupt, false on a stall or slip
+    int32_t getMeasuredPosition(); // [units] where the motor actually is
+    int32_t getMaxError() { return(max_error); }; // [counts]
+    bool hasFault() { return(fault); };
+    int32_t getFaultError() { return(fault_error); }; // [counts] expected - measured position
+    uint32_t getMissed() { return(missed); };
+
+};
+
+StepperEncoder* StepperEncoder::instance = nullptr;
+
+void StepperEncoder::init(float units_per_motor_rotation) {
+  scale = lround(65536.0 * config->counts / units_per_motor_rotation);
+  instance = this;
+  pinMode(config->a, INPUT);
+  pinMode(config->b, INPUT);
+  channels = (pinReadFast(config->a) ? 2 : 0) | (pinReadFast(config->b) ? 1 : 0);
+  attachInterrupt(config->a, encoderISR, CHANGE);
+  attachInterrupt(config->b, encoderISR, CHANGE);
+}
+
+void StepperEncoder::sync(int32_t position) {
+  noInterrupts();
+  sync_position = position;
+  sync_count = count;
+  max_error = 0;
+  fault = false;
+  fault_error = 0;
+  interrupts();
+}
+
+void StepperEncoder::decode() {
+  uint8_t now = (pinReadFast(config->a) ? 2 : 0) | (pinReadFast(config->b) ? 1 : 0);
+  uint8_t transition = (channels << 2) | now;
+  if ((channels ^ now) == 3) missed++;
+  count += ENCODER_TRANSITIONS[transition];
+  channels = now;
+}
+
+bool StepperEncoder::check(int32_t position) {
+  if (fault) return(false);
+  int32_t expected = ((int64_t) (int32_t) ((uint32_t) position - (uint32_t) sync_position) * scale) >> 16;
+  int32_t error = expected - getMeasured();
+  int32_t magnitude = (error < 0) ? -error : error;
+  if (magnitude > max_error) max_error = magnitude;
+  if (magnitude <= STEPPER_ENCODER_TOLERANCE) return(true);
+  fault = true;
+  fault_error = error;
+  return(false);
+}
+
+int32_t StepperEncoder::getMeasuredPosition() {
+  noInterrupts();
+  int32_t measured = getMeasured();
+  int32_t position = sync_position;
+  interrupts();
+  return((uint32_t) position + (uint32_t) (((int64_t) measured << 16) / scale));
+}
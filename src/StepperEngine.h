@@ -0,0 +1,813 @@
+#pragma once
+#include "application.h"
+#include "StepperScheduler.h"
+#include "StepperTiming.h"
+
+// timer interrupt driven step pulse generator
+// owns the step pin and keeps stepping at the set interval independent of how fast loop() runs
+// (the engines of all motor channels share the step scheduler's timer interrupt, see StepperScheduler.h)
+// step times are scheduled with a 32.32 fixed point phase accumulator (integer math only in the interrupt),
+// the fractional us are carried from step to step so the long-run step rate is exact
+// acceleration ramps update the interval incrementally in the interrupt (see updateRamp)
+// positions, speeds and accelerations are in microstepping independent units (1 unit = 1 step in the finest mode),
+// microstepping changes are applied by the interrupt right after a step that lands on the step grid of the coarser mode
+// (a position all modes down to the finer one share, so finer modes switch right away and exact targets stay reachable)
+// external triggers: arm() prepares the start (float math) in the thread, trigger() and release() run from the trigger's
+// pin interrupt with integer math only and the first step pulse goes out right in the trigger interrupt
+// closed loop: a step monitor (encoder feedback) checks the position after every step and can stop the engine right there
+// segments: a queued segment continues a move towards a target on the very step that reaches it (target moved on by the
+// segment's units in the same direction, ramp to the segment's speed from there), the thread queues the next one meanwhile
+#define STEPPER_ENGINE_MAX_SPEED    8000 // maximum # of steps/s the step interrupt can reliably generate
+#define STEPPER_ENGINE_PULSE_WIDTH  2 // step pulse width in us (DRV8825 requires at least 1.9us)
+
+// step interval: us between steps in 32.32 fixed point
+typedef uint64_t StepInterval;
+#define STEP_INTERVAL_US        ((StepInterval) 1 << 32) // 1 us
+#define STEP_INTERVAL_MAX       ((StepInterval) 0x7fffffff << 32) // ~35 minutes
+
+// acceleration ramps: intervals in 1/16 us (32 bit integer math in the interrupt)
+#define STEPPER_ENGINE_RAMP_C_MAX   0x1fffffff // longest ramp interval (~33s) so 2c + rest stays within 31 bits
+#define STEPPER_ENGINE_RAMP_N_MAX   0x07ffffff // most steps from standstill so 4n + 1 stays within 31 bits
+#define STEPPER_ENGINE_RAMP_N_EXACT 64 // below this, ramps from a running speed resume the exact sequence from standstill
+#define RAMP_NONE   0 // constant interval
+#define RAMP_UP     1 // accelerating towards the target interval
+#define RAMP_DOWN   2 // decelerating towards the target interval
+#define RAMP_STOP   3 // decelerating to standstill
+
+// checks the position after every step from the step interrupt (see StepperEncoder.h)
+class StepperStepMonitor {
+
+  public:
+
+    virtual bool check(int32_t position) = 0; // false stops the engine at this step
+
+};
+
+class StepperEngine : public StepperSchedulerTask {
+
+  private:
+
+    // interrupt
+    volatile bool timer_running = false; // scheduled with the step scheduler
+
+    // pins
+    int step_pin;
+    int dir_pin;
+    int enable_pin;
+    int ms1_pin = -1;
+    int ms2_pin = -1;
+    int ms3_pin = -1;
+    bool step_inverted = false;
+    bool dir_inverted = false;
+    bool enable_inverted = false;
+
+    // microstepping (units per step are powers of two)
+    volatile uint8_t step_shift = 0; // units per step in the active mode = 1 << step_shift
+    volatile bool ms_pending = false; // mode change waiting for the coarser mode's step grid
+    volatile uint8_t ms_pending_shift = 0;
+    volatile uint32_t ms_pending_mask = 0; // position bits that have to be 0 for the switch
+    volatile uint8_t ms_pending_pins = 0; // ms1, ms2, ms3 levels in bits 0, 1, 2
+
+    // speed
+    float max_speed = STEPPER_ENGINE_MAX_SPEED;
+    StepInterval min_interval = STEP_INTERVAL_US * 1000000 / STEPPER_ENGINE_MAX_SPEED;
+    int direction = 1; // +1 or -1
+
+    // stepping (modified by the interrupt)
+    volatile StepInterval unit_interval = 0; // requested interval per unit (step intervals follow the microstepping)
+    volatile StepInterval interval = 0; // current step interval (0 = not stepping)
+    volatile uint32_t fraction = 0; // fractional us accumulated towards next_step (phase accumulator)
+    volatile int32_t position = 0; // [units] (wraps around, differences are taken modulo 2^32)
+    volatile int32_t target = 0; // [units]
+    volatile bool to_target = false; // stop once the target position is reached
+    volatile uint32_t travel = 0; // [units] stepped in either direction (wraps around, differences are taken modulo 2^32)
+
+    // acceleration ramp (D. Austin, "Generate stepper-motor speed profiles in real time"):
+    // c_n = c_n-1 - (2 c_n-1 + rest) / (4n + 1) with the remainder carried to the next step (no sqrt, no float),
+    // n ~ v^2 / 2a is the number of steps to stop from the current speed (negative while decelerating)
+    float unit_acceleration = 0; // [units/s^2] (0 = speed changes are instant)
+    volatile uint8_t ramp = RAMP_NONE;
+    volatile int32_t ramp_n = 0;
+    volatile int32_t ramp_c = 0; // current interval [1/16 us]
+    volatile int32_t ramp_rest = 0; // remainder of the last interval update
+    volatile int32_t ramp_target_c = 0; // target interval [1/16 us]
+    volatile StepInterval ramp_target = 0; // target interval (adopted exactly once the ramp completes)
+    volatile bool disable_at_stop = false; // disable the outputs once a ramp to standstill completes
+
+    // external trigger (armed from the thread, started and released from the trigger interrupt)
+    volatile bool armed = false;
+    StepInterval armed_interval = 0; // unit interval
+    int armed_direction = 1;
+    float armed_acceleration = 0;
+    int32_t armed_c0 = 0; // first ramp interval from standstill [1/16 us] (active mode when armed)
+    uint32_t armed_dose = 0; // [units] per trigger (0 = run until released)
+    StepTimingStats trigger_timing; // trigger to first step pulse latency (ideal 0)
+
+    // queued segment (queued from the thread, started by the interrupt)
+    volatile bool segment_queued = false;
+    StepInterval segment_interval = 0; // unit interval
+    uint32_t segment_units = 0; // [units] beyond the current target
+    float segment_acceleration = 0; // [units/s^2]
+    uint64_t segment_k = 0; // ramp steps for interval c are (k << step_shift) / c^2 (0 = instant speed change)
+    volatile uint32_t segments = 0; // queued segments started
+
+    // closed loop feedback
+    StepperStepMonitor* volatile monitor = nullptr;
+
+    // step timing
+    StepTimingStats timing;
+    volatile uint32_t last_step_time = 0; // micros() of the last step
+    volatile uint32_t last_step_interval = 0; // scheduled us between the last and the next step
+    volatile bool last_step_valid = false; // whether the next step interval is measurable (not after a (re)start)
+
+    void setDirection(int dir);
+    void schedule(); // reschedule for next_step
+    void startTimer(StepInterval interval); // start stepping at interval (or adopt the new interval if already running)
+    void stopTimer();
+    void startRamp(StepInterval unit_interval, float unit_acceleration); // move to unit_interval at the acceleration (instantly if 0)
+    void setRamp(StepInterval target, int32_t n, int32_t c); // ramp from interval c [1/16 us] to target (n: steps to stop from c)
+    static int32_t getRampSteps(double acceleration, int32_t* c); // n for interval c at the acceleration [steps/s^2] (adjusts low speed c)
+    static int32_t getRampStartInterval(double acceleration); // first interval from standstill c0 [1/16 us] at the acceleration [steps/s^2]
+    StepInterval getStepInterval(StepInterval unit_interval); // step interval in the active mode
+    int32_t getRemaining() { return((int32_t) ((uint32_t) target - (uint32_t) position) * direction); }; // [units] towards the target
+    static int32_t toRampInterval(StepInterval interval);
+    static int32_t toRampSteps(double steps);
+    void writeMicrostepping(uint8_t pins);
+    void applyMicrostepping(); // adopt the pending microstepping mode (on the coarser mode's step grid)
+    void halt(); // stop from the interrupt
+    void startSegment(); // continue with the queued segment from the interrupt
+    bool updateRamp(); // next ramp interval, false if stopped
+    void step() override; // interrupt service routine (called by the step scheduler once next_step is due)
+
+  public:
+
+    StepperEngine() {};
+
+    void init(int step_pin, int dir_pin, int enable_pin);
+    void setPinsInverted(bool dir_invert, bool step_invert, bool enable_invert);
+    void enableOutputs();
+    void disableOutputs();
+
+    // microstepping
+    void initMicrostepping(int ms1_pin, int ms2_pin, int ms3_pin); // without it, 1 unit = 1 step
+    void setMicrostepping(int step_units, bool ms1, bool ms2, bool ms3); // right away if stopped on the coarser mode's step grid, otherwise at the next step onto it
+    int getStepUnits() { return(1 << step_shift); }; // units per step in the active mode
+    bool isMicrosteppingPending() { return(ms_pending); };
+
+    // speed (the maximum is in steps/s of any mode, everything else is in units)
+    void setMaxSpeed(float speed); // limited to what the engine can generate (STEPPER_ENGINE_MAX_SPEED)
+    float getMaxSpeed() { return(max_speed); };
+    StepInterval getInterval() { return(interval); };
+    float getSpeed(); // current speed [units/s] (follows ramps)
+    static StepInterval getIntervalForSpeed(double units_per_minute); // only used when the speed changes, never per step
+
+    // position [units]
+    long currentPosition();
+    void setCurrentPosition(long position); // grid alignment of mode changes assumes a multiple of full steps
+    void moveTo(long absolute);
+    long targetPosition() { return(target); };
+    long distanceToGo();
+    uint32_t getTravel() { return(travel); }; // [units] stepped in either direction (for odometers, read at least every 2^32 units)
+
+    // run (acceleration in units/s^2 ramps from the current speed, 0 changes speed instantly)
+    void runInterval(StepInterval unit_interval, int direction, float unit_acceleration = 0); // step continuously (direction +1 or -1)
+    void runIntervalToPosition(StepInterval unit_interval, float unit_acceleration = 0); // step towards the target position and stop there (decelerating in time)
+    void decelerate(float unit_acceleration, bool disable = false); // ramp down to standstill (and disable the outputs once stopped)
+    void stop(); // stop stepping immediately
+    bool isRunning() { return(timer_running); };
+    bool isRamping() { return(ramp != RAMP_NONE); };
+    bool isAccelerating() { return(ramp == RAMP_UP); };
+
+    // external trigger (arm and disarm from the thread, trigger and release from the trigger interrupt)
+    void arm(StepInterval unit_interval, int direction, float unit_acceleration = 0, uint32_t dose = 0); // start with these settings at the next trigger (dose [units] per trigger, 0 = run until released)
+    void disarm();
+    bool isArmed() { return(armed); };
+    void trigger(uint32_t time); // start stepping (or add a dose), time: micros() at interrupt entry (for the latency)
+    void release(); // ramp down to standstill (right away without acceleration), doses complete regardless
+
+    // segments (queue and clear from the thread, one queued at a time, started by the interrupt at the target)
+    void queueSegment(StepInterval unit_interval, uint32_t units, float unit_acceleration = 0); // continue by units at unit_interval once the target is reached
+    void clearSegment();
+    bool isSegmentQueued() { return(segment_queued); };
+    uint32_t getSegments() { return(segments); }; // queued segments started so far (wraps around)
+
+    // closed loop feedback (nullptr = open loop)
+    void setMonitor(StepperStepMonitor* monitor) { this->monitor = monitor; };
+
+    // timing
+    StepTimingStats* getTiming() { return(&timing); };
+    StepTimingStats* getTriggerTiming() { return(&trigger_timing); };
+    void resetTiming() { noInterrupts(); timing.reset(); trigger_timing.reset(); interrupts(); };
+
+};
+
+/**** SETUP ****/
+
+void StepperEngine::init(int step_pin, int dir_pin, int enable_pin) {
+  this->step_pin = step_pin;
+  this->dir_pin = dir_pin;
+  this->enable_pin = enable_pin;
+  pinMode(step_pin, OUTPUT);
+  pinMode(dir_pin, OUTPUT);
+  pinMode(enable_pin, OUTPUT);
+}
+
+// same semantics as AccelStepper::setPinsInverted
+void StepperEngine::setPinsInverted(bool dir_invert, bool step_invert, bool enable_invert) {
+  dir_inverted = dir_invert;
+  step_inverted = step_invert;
+  enable_inverted = enable_invert;
+  digitalWrite(step_pin, LOW ^ step_inverted);
+  digitalWrite(dir_pin, (direction > 0 ? HIGH : LOW) ^ dir_inverted);
+}
+
+void StepperEngine::enableOutputs() {
+  digitalWrite(enable_pin, HIGH ^ enable_inverted);
+}
+
+void StepperEngine::disableOutputs() {
+  digitalWrite(enable_pin, LOW ^ enable_inverted);
+}
+
+/**** MICROSTEPPING ****/
+
+// the driver powers up at its home position (a full step), position 0 is aligned with it
+void StepperEngine::initMicrostepping(int ms1_pin, int ms2_pin, int ms3_pin) {
+  this->ms1_pin = ms1_pin;
+  this->ms2_pin = ms2_pin;
+  this->ms3_pin = ms3_pin;
+  pinMode(ms1_pin, OUTPUT);
+  pinMode(ms2_pin, OUTPUT);
+  pinMode(ms3_pin, OUTPUT);
+}
+
+void StepperEngine::setMicrostepping(int step_units, bool ms1, bool ms2, bool ms3) {
+  noInterrupts();
+  ms_pending_shift = __builtin_ctz(step_units);
+  ms_pending_pins = (ms1 ? 1 : 0) | (ms2 ? 2 : 0) | (ms3 ? 4 : 0);
+  // the position is always on the active mode's grid, so only a coarser mode has to wait for its grid
+  ms_pending_mask = (1 << ms_pending_shift) - 1;
+  ms_pending = true;
+  // a running engine switches right after its next step onto the grid
+  if (!timer_running && (position & ms_pending_mask) == 0) applyMicrostepping();
+  interrupts();
+}
+
+void StepperEngine::writeMicrostepping(uint8_t pins) {
+  if (ms1_pin < 0) return;
+  digitalWriteFast(ms1_pin, (pins & 1) ? HIGH : LOW);
+  digitalWriteFast(ms2_pin, (pins & 2) ? HIGH : LOW);
+  digitalWriteFast(ms3_pin, (pins & 4) ? HIGH : LOW);
+}
+
+// the physical speed and ramp carry over, the step interval and steps to stop change by the step size ratio
+void StepperEngine::applyMicrostepping() {
+  int change = (int) ms_pending_shift - (int) step_shift; // > 0: coarser
+  writeMicrostepping(ms_pending_pins);
+  step_shift = ms_pending_shift;
+  ms_pending = false;
+  if (change == 0 || interval == 0) return;
+
+  int32_t n = (ramp_n < 0) ? -ramp_n : ramp_n;
+  if (change > 0) {
+    interval = (interval < (STEP_INTERVAL_MAX >> change)) ? interval << change : STEP_INTERVAL_MAX;
+    n >>= change;
+  } else {
+    interval >>= -change;
+    n = (n < (STEPPER_ENGINE_RAMP_N_MAX >> -change)) ? n << -change : STEPPER_ENGINE_RAMP_N_MAX;
+  }
+  if (interval < min_interval) interval = min_interval;
+
+  if (ramp == RAMP_STOP) {
+    ramp_c = toRampInterval(interval);
+    ramp_n = -n;
+    ramp_rest = 0;
+  } else if (unit_acceleration > 0) {
+    // the target may have been limited by the previous mode's maximum speed, ramp on from here
+    setRamp(getStepInterval(unit_interval), n, toRampInterval(interval));
+  } else {
+    interval = getStepInterval(unit_interval);
+  }
+}
+
+/**** SPEED ****/
+
+void StepperEngine::setMaxSpeed(float speed) {
+  max_speed = (speed < STEPPER_ENGINE_MAX_SPEED) ? speed : STEPPER_ENGINE_MAX_SPEED;
+  min_interval = STEP_INTERVAL_US * 1000000.0 / max_speed;
+}
+
+float StepperEngine::getSpeed() {
+  noInterrupts();
+  StepInterval current = interval;
+  int units = 1 << step_shift;
+  interrupts();
+  if (!timer_running || current == 0) return(0.0);
+  return(1.0e6 * units / ((double) current / STEP_INTERVAL_US));
+}
+
+StepInterval StepperEngine::getIntervalForSpeed(double units_per_minute) {
+  if (units_per_minute <= 0) return(0);
+  double us = 60.0e6 / units_per_minute;
+  if (us >= (double) (STEP_INTERVAL_MAX / STEP_INTERVAL_US)) return(STEP_INTERVAL_MAX);
+  return((StepInterval) (us * STEP_INTERVAL_US + 0.5));
+}
+
+StepInterval StepperEngine::getStepInterval(StepInterval unit_interval) {
+  StepInterval interval = (unit_interval < (STEP_INTERVAL_MAX >> step_shift)) ? unit_interval << step_shift : STEP_INTERVAL_MAX;
+  return(interval < min_interval ? min_interval : interval);
+}
+
+/**** POSITION ****/
+
+long StepperEngine::currentPosition() {
+  return(position);
+}
+
+void StepperEngine::setCurrentPosition(long position) {
+  noInterrupts();
+  this->position = position;
+  this->target = position;
+  interrupts();
+}
+
+void StepperEngine::moveTo(long absolute) {
+  noInterrupts();
+  target = absolute;
+  if (to_target) setDirection((int32_t) ((uint32_t) target - (uint32_t) position) >= 0 ? 1 : -1);
+  interrupts();
+}
+
+long StepperEngine::distanceToGo() {
+  noInterrupts();
+  long distance = (int32_t) ((uint32_t) target - (uint32_t) position);
+  interrupts();
+  return(distance);
+}
+
+/**** RUN ****/
+
+void StepperEngine::setDirection(int dir) {
+  if (dir != direction) {
+    direction = dir;
+    digitalWrite(dir_pin, (direction > 0 ? HIGH : LOW) ^ dir_inverted);
+  }
+}
+
+void StepperEngine::runInterval(StepInterval unit_interval, int direction, float unit_acceleration) {
+  if (unit_interval == 0) {
+    stop();
+    return;
+  }
+  direction = (direction > 0) ? 1 : -1;
+  // reversing while ramped up starts over from standstill
+  if (unit_acceleration > 0 && timer_running && direction != this->direction) stop();
+  noInterrupts();
+  to_target = false;
+  setDirection(direction);
+  interrupts();
+  startRamp(unit_interval, unit_acceleration);
+}
+
+void StepperEngine::runIntervalToPosition(StepInterval unit_interval, float unit_acceleration) {
+  if (unit_interval == 0) {
+    stop();
+    return;
+  }
+  int direction = (distanceToGo() >= 0) ? 1 : -1;
+  if (unit_acceleration > 0 && timer_running && direction != this->direction) stop();
+  noInterrupts();
+  to_target = true;
+  setDirection(direction);
+  interrupts();
+  startRamp(unit_interval, unit_acceleration);
+}
+
+void StepperEngine::decelerate(float unit_acceleration, bool disable) {
+  if (!timer_running || unit_acceleration <= 0) {
+    stop();
+    if (disable) disableOutputs();
+    return;
+  }
+  double speed = getSpeed();
+  double n_units = speed * speed / (2.0 * unit_acceleration);
+  noInterrupts();
+  this->unit_acceleration = unit_acceleration;
+  to_target = false;
+  ramp = RAMP_STOP;
+  ramp_n = -toRampSteps(n_units / (1 << step_shift));
+  ramp_c = toRampInterval(interval);
+  ramp_rest = 0;
+  disable_at_stop = disable;
+  interrupts();
+}
+
+void StepperEngine::stop() {
+  stopTimer();
+  noInterrupts();
+  interval = 0;
+  segment_queued = false;
+  ramp = RAMP_NONE;
+  ramp_n = 0;
+  disable_at_stop = false;
+  interrupts();
+}
+
+void StepperEngine::startTimer(StepInterval interval) {
+  if (interval < min_interval) interval = min_interval;
+  // already stepping at this interval
+  if (timer_running && interval == this->interval) return;
+  noInterrupts();
+  this->interval = interval;
+  fraction = 0;
+  uint32_t now = micros();
+  last_step_interval = interval >> 32;
+  // continue from the last step if running (speed change takes effect on the next step), otherwise one interval from now
+  next_step = ((timer_running && last_step_valid) ? last_step_time : now) + last_step_interval;
+  last_step_valid = false;
+  bool scheduled = stepper_scheduler.add(this);
+  timer_running = scheduled;
+  interrupts();
+  if (!scheduled) Serial.println("WARNING: step scheduler is full, engine not started");
+}
+
+void StepperEngine::stopTimer() {
+  if (timer_running) {
+    noInterrupts();
+    stepper_scheduler.remove(this);
+    timer_running = false;
+    interrupts();
+  }
+}
+
+void StepperEngine::startRamp(StepInterval unit_interval, float unit_acceleration) {
+
+  // no acceleration limit
+  if (unit_acceleration <= 0) {
+    noInterrupts();
+    this->unit_interval = unit_interval;
+    this->unit_acceleration = 0;
+    ramp = RAMP_NONE;
+    StepInterval step_interval = getStepInterval(unit_interval);
+    interrupts();
+    startTimer(step_interval);
+    return;
+  }
+
+  // already running: ramp from the current speed (the interrupt picks up the ramp on the next step)
+  if (timer_running) {
+    int32_t c, n;
+    uint8_t shift;
+    // float math outside the critical section, repeated if the interrupt switched microstepping modes meanwhile
+    do {
+      shift = step_shift;
+      c = toRampInterval(interval);
+      int32_t c_start = c;
+      n = getRampSteps(unit_acceleration / (1 << shift), &c_start);
+      // only accelerating ramps adopt the adjusted low speed interval
+      if (toRampInterval(getStepInterval(unit_interval)) < c) c = c_start;
+      noInterrupts();
+      if (shift == step_shift) break;
+      interrupts();
+    } while (true);
+    this->unit_interval = unit_interval;
+    this->unit_acceleration = unit_acceleration;
+    disable_at_stop = false;
+    setRamp(getStepInterval(unit_interval), n, c);
+    interrupts();
+    return;
+  }
+
+  // from standstill
+  int32_t c0 = getRampStartInterval(unit_acceleration / (1 << step_shift));
+  noInterrupts();
+  this->unit_interval = unit_interval;
+  this->unit_acceleration = unit_acceleration;
+  disable_at_stop = false;
+  StepInterval step_interval = getStepInterval(unit_interval);
+  ramp_target = step_interval;
+  ramp_target_c = toRampInterval(step_interval);
+  ramp_rest = 0;
+  ramp_n = 0;
+  if (c0 > ramp_target_c) {
+    ramp = RAMP_UP;
+    ramp_c = c0;
+    step_interval = (StepInterval) c0 << 28;
+  } else {
+    // slow enough to start right at the target speed
+    ramp = RAMP_NONE;
+    ramp_c = ramp_target_c;
+  }
+  interrupts();
+  startTimer(step_interval);
+}
+
+void StepperEngine::setRamp(StepInterval target, int32_t n, int32_t c) {
+  ramp_target = target;
+  ramp_target_c = toRampInterval(target);
+  ramp_rest = 0;
+  ramp_c = c;
+  if (ramp_target_c < c) {
+    ramp = RAMP_UP;
+    ramp_n = n;
+    interval = (StepInterval) c << 28;
+  } else if (ramp_target_c > c) {
+    ramp = RAMP_DOWN;
+    ramp_n = -n;
+  } else {
+    ramp = RAMP_NONE;
+    ramp_n = n;
+    interval = target;
+  }
+}
+
+// the recurrence keeps c sqrt(n) constant so any mismatch between c and n would scale the acceleration of the whole ramp,
+// its intervals converge to 1/sqrt(2an) as ~(1 - 1/4n): n = v^2 / 2a + 1/2 at higher speeds, at low speeds the ramp
+// resumes the sequence from standstill at its first interval <= c (a small speed step up)
+int32_t StepperEngine::getRampSteps(double acceleration, int32_t* c) {
+  double c_us = *c / 16.0;
+  double n = 1.0e12 / (2.0 * acceleration * c_us * c_us) + 0.5;
+  if (n >= STEPPER_ENGINE_RAMP_N_EXACT) return(toRampSteps(n));
+  int32_t c_k = getRampStartInterval(acceleration);
+  int32_t rest = 0;
+  int32_t k = 0;
+  while (c_k > *c && k < STEPPER_ENGINE_RAMP_N_EXACT) {
+    k++;
+    int32_t num = 2 * c_k + rest;
+    c_k -= num / (4 * k + 1);
+    rest = num % (4 * k + 1);
+  }
+  if (k > 0) *c = c_k;
+  return(k);
+}
+
+// c0 = 0.676 sqrt(2/a) (sqrt only here, once per start)
+int32_t StepperEngine::getRampStartInterval(double acceleration) {
+  return(toRampInterval((StepInterval) (0.676 * sqrt(2.0 / acceleration) * 1e6 * STEP_INTERVAL_US)));
+}
+
+int32_t StepperEngine::toRampInterval(StepInterval interval) {
+  StepInterval c = interval >> 28;
+  if (c > STEPPER_ENGINE_RAMP_C_MAX) return(STEPPER_ENGINE_RAMP_C_MAX);
+  if (c < 1) return(1);
+  return(c);
+}
+
+int32_t StepperEngine::toRampSteps(double steps) {
+  if (steps >= STEPPER_ENGINE_RAMP_N_MAX) return(STEPPER_ENGINE_RAMP_N_MAX);
+  if (steps <= -STEPPER_ENGINE_RAMP_N_MAX) return(-STEPPER_ENGINE_RAMP_N_MAX);
+  return((int32_t) steps);
+}
+
+/**** SEGMENTS ****/
+
+// float math here, the interrupt only needs one 64 bit division for the ramp's steps to stop (n = v^2 / 2a as in getRampSteps())
+void StepperEngine::queueSegment(StepInterval unit_interval, uint32_t units, float unit_acceleration) {
+  double k = (unit_acceleration > 0) ? 128.0e12 / unit_acceleration : 0;
+  noInterrupts();
+  segment_interval = unit_interval;
+  segment_units = units;
+  segment_acceleration = unit_acceleration;
+  segment_k = (k < 1.0e17) ? (uint64_t) k : (uint64_t) 1.0e17;
+  segment_queued = units > 0 && unit_interval > 0;
+  interrupts();
+}
+
+void StepperEngine::clearSegment() {
+  noInterrupts();
+  segment_queued = false;
+  interrupts();
+}
+
+/**** EXTERNAL TRIGGER ****/
+
+void StepperEngine::arm(StepInterval unit_interval, int direction, float unit_acceleration, uint32_t dose) {
+  direction = (direction > 0) ? 1 : -1;
+  // reversing while moving stops first (the next trigger starts over in the new direction)
+  if (timer_running && direction != this->direction) stop();
+  int32_t c0 = (unit_acceleration > 0) ? getRampStartInterval(unit_acceleration / (1 << step_shift)) : 0;
+  noInterrupts();
+  armed_interval = unit_interval;
+  armed_direction = direction;
+  armed_acceleration = unit_acceleration;
+  armed_c0 = c0;
+  armed_dose = dose;
+  // direction set up ahead of the first step
+  if (!timer_running) setDirection(direction);
+  armed = unit_interval > 0;
+  interrupts();
+}
+
+void StepperEngine::disarm() {
+  noInterrupts();
+  armed = false;
+  interrupts();
+}
+
+// same start from standstill as startRamp() with the precomputed c0
+void StepperEngine::trigger(uint32_t time) {
+  if (!armed) return;
+  int32_t dose = (armed_direction > 0) ? (int32_t) armed_dose : -(int32_t) armed_dose;
+
+  // already moving: add the dose, ramp back up if stopping (released or short of the extended target)
+  if (timer_running) {
+    if (armed_dose > 0) {
+      target = (uint32_t) (to_target ? target : position) + (uint32_t) dose;
+      to_target = true;
+    }
+    if (ramp == RAMP_STOP) {
+      disable_at_stop = false;
+      setRamp(getStepInterval(unit_interval), -ramp_n, ramp_c);
+    }
+    return;
+  }
+
+  to_target = armed_dose > 0;
+  if (to_target) target = (uint32_t) position + (uint32_t) dose;
+  setDirection(armed_direction);
+  unit_interval = armed_interval;
+  unit_acceleration = armed_acceleration;
+  disable_at_stop = false;
+  StepInterval step_interval = getStepInterval(armed_interval);
+  ramp = RAMP_NONE;
+  ramp_n = 0;
+  ramp_rest = 0;
+  if (armed_acceleration > 0) {
+    ramp_target = step_interval;
+    ramp_target_c = toRampInterval(step_interval);
+    ramp_c = ramp_target_c;
+    if (armed_c0 > ramp_target_c) {
+      ramp = RAMP_UP;
+      ramp_c = armed_c0;
+      step_interval = (StepInterval) armed_c0 << 28;
+    }
+  }
+  interval = (step_interval < min_interval) ? min_interval : step_interval;
+  fraction = 0;
+  last_step_valid = false;
+
+  // first step right away, scheduled from there on (unless that was all of the dose)
+  next_step = micros();
+  timer_running = true;
+  step();
+  if (last_step_valid) trigger_timing.record(last_step_time - time, 0);
+  if (timer_running) timer_running = stepper_scheduler.add(this);
+}
+
+// integer only version of decelerate(): the steps to stop are the ramp's current n
+void StepperEngine::release() {
+  if (!timer_running || to_target) return;
+  if (unit_acceleration <= 0) {
+    halt();
+    return;
+  }
+  ramp = RAMP_STOP;
+  ramp_n = (ramp_n > 0) ? -ramp_n : ramp_n;
+  ramp_c = toRampInterval(interval);
+  ramp_rest = 0;
+}
+
+/**** INTERRUPT ****/
+
+void StepperEngine::schedule() {
+  stepper_scheduler.update(this);
+}
+
+void StepperEngine::halt() {
+  stepper_scheduler.remove(this);
+  timer_running = false;
+  segment_queued = false;
+  ramp = RAMP_NONE;
+  ramp_n = 0;
+  if (disable_at_stop) {
+    disableOutputs();
+    disable_at_stop = false;
+  }
+}
+
+// on the step that reaches the target (the next step already follows the segment's ramp)
+void StepperEngine::startSegment() {
+  target = (uint32_t) target + (direction > 0 ? segment_units : -segment_units);
+  unit_interval = segment_interval;
+  unit_acceleration = segment_acceleration;
+  segment_queued = false;
+  segments++;
+  if (segment_k == 0) {
+    ramp = RAMP_NONE;
+    ramp_n = 0;
+    interval = getStepInterval(segment_interval);
+    return;
+  }
+  int32_t c = toRampInterval(interval);
+  uint64_t n = (segment_k << step_shift) / ((uint64_t) c * c);
+  setRamp(getStepInterval(segment_interval), n < STEPPER_ENGINE_RAMP_N_MAX ? (int32_t) n : STEPPER_ENGINE_RAMP_N_MAX, c);
+}
+
+// one division per step (hardware divide on the Cortex-M3), the remainder keeps the long ramp exact
+bool StepperEngine::updateRamp() {
+
+  // start decelerating in time to stop at the target position (unless a segment continues from there)
+  if (to_target && ramp != RAMP_STOP && !segment_queued) {
+    int32_t remaining = getRemaining() >> step_shift;
+    int32_t to_stop = (ramp_n < 0) ? -ramp_n : ramp_n;
+    if (remaining <= to_stop) {
+      ramp = RAMP_STOP;
+      ramp_n = -remaining;
+      ramp_rest = 0;
+    }
+  }
+
+  if (ramp == RAMP_NONE) return(true);
+
+  // reached standstill (towards a target, the last step keeps the slowest interval)
+  if (++ramp_n >= 0 && ramp == RAMP_STOP) {
+    ramp_n = 0;
+    if (to_target) return(true);
+    halt();
+    return(false);
+  }
+
+  // slowing down to a target slower than the first step from standstill: the ramp ends there
+  // (the recurrence is undefined at n = 0)
+  if (ramp_n >= 0 && ramp == RAMP_DOWN) {
+    ramp = RAMP_NONE;
+    ramp_n = 0;
+    interval = ramp_target;
+    return(true);
+  }
+
+  int32_t num = 2 * ramp_c + ramp_rest;
+  int32_t den = 4 * ramp_n + 1;
+  ramp_c -= num / den;
+  ramp_rest = num % den;
+  if (ramp_c > STEPPER_ENGINE_RAMP_C_MAX) ramp_c = STEPPER_ENGINE_RAMP_C_MAX;
+  if (ramp_c < 1) ramp_c = 1;
+
+  if (ramp == RAMP_UP && ramp_c <= ramp_target_c) {
+    ramp = RAMP_NONE;
+    interval = ramp_target;
+  } else if (ramp == RAMP_DOWN && ramp_c >= ramp_target_c) {
+    ramp = RAMP_NONE;
+    ramp_n = -ramp_n;
+    interval = ramp_target;
+  } else {
+    interval = (StepInterval) ramp_c << 28;
+  }
+  if (interval < min_interval) interval = min_interval;
+  return(true);
+}
+
+void StepperEngine::step() {
+
+  uint32_t now = micros();
+
+  // reached target (less than a step of the active mode left)
+  if (to_target && getRemaining() < (1 << step_shift)) {
+    if (!segment_queued) {
+      halt();
+      return;
+    }
+    startSegment();
+  }
+
+  // step timing
+  if (last_step_valid) timing.record(now - last_step_time, last_step_interval);
+  last_step_time = now;
+  last_step_valid = true;
+
+  // step pulse
+  digitalWriteFast(step_pin, HIGH ^ step_inverted);
+  delayMicroseconds(STEPPER_ENGINE_PULSE_WIDTH);
+  digitalWriteFast(step_pin, LOW ^ step_inverted);
+  uint32_t units = 1 << step_shift;
+  position = (uint32_t) position + (direction > 0 ? units : -units);
+  travel += units;
+
+  // microstepping changes right after landing on the coarser mode's step grid
+  if (ms_pending && (position & ms_pending_mask) == 0) applyMicrostepping();
+
+  // the motor is not following (stall or slip): no further steps
+  if (monitor && !monitor->check(position)) {
+    halt();
+    return;
+  }
+
+  // stop right away if this was the last step (or continue with the queued segment)
+  if (to_target && getRemaining() < (1 << step_shift)) {
+    if (!segment_queued) {
+      halt();
+      return;
+    }
+    startSegment();
+  }
+
+  // acceleration ramp
+  if ((ramp != RAMP_NONE || (to_target && unit_acceleration > 0)) && !updateRamp()) return;
+
+  // phase accumulator: whole us of the interval plus the carry from the accumulated fractions
+  uint64_t phase = (uint64_t) fraction + (uint32_t) interval;
+  fraction = (uint32_t) phase;
+  last_step_interval = (uint32_t) (interval >> 32) + (uint32_t) (phase >> 32);
+  next_step += last_step_interval;
+  schedule();
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include "application.h"
+
+// append-only journal of persistent fields in the (emulated) EEPROM
+// - changes only mark their field dirty, dirty fields are appended once no further changes came in for JOURNAL_QUIET_MS
+//   (coalesces scripted changes and keeps EEPROM writes off the command path)
+// - entries are appended one after the other through the active bank so every byte is written once per pass (wear leveling),
+//   when the bank is full the current values of all fields are written to the other bank (compaction) which becomes active
+// - restore replays the entries of the newest bank, entries are checksummed so that an interrupted write is ignored
+//   (entries of fields that are no longer registered or changed size are skipped)
+#define JOURNAL_ADDRESS     0 // EEPROM storage location
+#define JOURNAL_BANK_SIZE   1000 // [bytes] per bank (2 banks)
+#define JOURNAL_MAGIC       0x4a // marks a bank header
+#define JOURNAL_GENERATIONS 0x80 // bank generations count modulo this (never 0xff = erased)
+#define JOURNAL_FIELDS_MAX  9
+#define JOURNAL_QUIET_MS    1000 // commit dirty fields once unchanged for this long [ms]
+
+struct JournalBankHeader {
+  uint8_t magic; // JOURNAL_MAGIC
+  uint8_t generation; // incremented with every compaction (the newer bank is active)
+};
+
+struct JournalEntryHeader {
+  uint8_t generation; // generation of the bank (stale entries from a previous pass don't match)
+  uint8_t field;
+  uint8_t size;
+  uint8_t check; // checksum of header and data
+};
+
+struct JournalField {
+  uint8_t* data;
+  uint8_t size;
+};
+
+class StepperJournal {
+
+  private:
+
+    JournalField fields[JOURNAL_FIELDS_MAX];
+    uint8_t fields_n = 0;
+    uint16_t dirty = 0; // bit per field
+    unsigned long last_change = 0;
+
+    // active bank
+    uint8_t bank = 0;
+    uint8_t generation = 0;
+    int offset = sizeof(JournalBankHeader); // next entry [bytes from the bank start]
+
+    int getBankAddress(uint8_t bank) { return(JOURNAL_ADDRESS + bank * JOURNAL_BANK_SIZE); };
+    uint8_t getChecksum(JournalEntryHeader* header, int data_address);
+    bool append(uint8_t field); // false if the bank is full
+    void compact(); // write all fields to the other bank and activate it
+
+  public:
+
+    // register a field (before restore), returns the field id
+    uint8_t addField(void* data, uint8_t size);
+    template<typename T> uint8_t addField(T* data) { return(addField((void*) data, sizeof(T))); };
+
+    bool restore(); // replay the newest bank into the fields (fields without entries keep their values), false if there is no journal
+    void change(uint8_t field) { dirty |= 1 << field; last_change = millis(); }; // mark a field for the next commit
+    void progress(uint8_t field) { dirty |= 1 << field; }; // same without restarting the quiet period (periodic saves are not held back by each other)
+    void update(); // commit once quiet (call from loop)
+    void commit(); // append all dirty fields now
+    bool isDirty() { return(dirty != 0); };
+
+};
+
+/**** FIELDS ****/
+
+uint8_t StepperJournal::addField(void* data, uint8_t size) {
+  fields[fields_n].data = (uint8_t*) data;
+  fields[fields_n].size = size;
+  return(fields_n++);
+}
+
+/**** WRITING ****/
+
+uint8_t StepperJournal::getChecksum(JournalEntryHeader* header, int data_address) {
+  // rotate and add (catches reordered and single bit errors), never matches an erased (0xff) entry
+  uint8_t check = header->generation ^ 0x5a;
+  check = ((check << 1) | (check >> 7)) + header->field;
+  check = ((check << 1) | (check >> 7)) + header->size;
+  for (int i = 0; i < header->size; i++) {
+    check = ((check << 1) | (check >> 7)) + EEPROM.read(data_address + i);
+  }
+  return(check == 0xff ? 0 : check);
+}
+
+bool StepperJournal::append(uint8_t field) {
+  int size = sizeof(JournalEntryHeader) + fields[field].size;
+  if (offset + size > JOURNAL_BANK_SIZE) return(false);
+  int address = getBankAddress(bank) + offset;
+  // data and end marker first (entries from older passes can be left behind), the header (with the checksum) completes the entry
+  for (int i = 0; i < fields[field].size; i++) {
+    EEPROM.write(address + sizeof(JournalEntryHeader) + i, fields[field].data[i]);
+  }
+  if (offset + size < JOURNAL_BANK_SIZE) EEPROM.write(address + size, 0xff);
+  JournalEntryHeader header = {generation, field, fields[field].size, 0};
+  header.check = getChecksum(&header, address + sizeof(JournalEntryHeader));
+  EEPROM.put(address, header);
+  offset += size;
+  return(true);
+}
+
+void StepperJournal::compact() {
+  // fill the other bank first, its header is written last so an interrupted compaction leaves the active bank intact
+  bank = 1 - bank;
+  generation = (generation + 1) % JOURNAL_GENERATIONS;
+  offset = sizeof(JournalBankHeader);
+  for (uint8_t i = 0; i < fields_n; i++) append(i);
+  JournalBankHeader header = {JOURNAL_MAGIC, generation};
+  EEPROM.put(getBankAddress(bank), header);
+  #ifdef STATE_DEBUG_ON
+    Serial.printf("INFO: state journal compacted into bank %d (generation %d)\n", bank, generation);
+  #endif
+}
+
+void StepperJournal::commit() {
+  for (uint8_t i = 0; i < fields_n; i++) {
+    if (dirty & (1 << i) && !append(i)) {
+      // bank full: compaction writes the current values of all fields
+      compact();
+      break;
+    }
+  }
+  dirty = 0;
+}
+
+void StepperJournal::update() {
+  if (dirty != 0 && millis() - last_change >= JOURNAL_QUIET_MS) commit();
+}
+
+/**** RESTORING ****/
+
+bool StepperJournal::restore() {
+  // newest bank with a valid header
+  JournalBankHeader headers[2];
+  EEPROM.get(getBankAddress(0), headers[0]);
+  EEPROM.get(getBankAddress(1), headers[1]);
+  bool valid[2] = {headers[0].magic == JOURNAL_MAGIC, headers[1].magic == JOURNAL_MAGIC};
+  if (!valid[0] && !valid[1]) {
+    // no journal yet: start in bank 0 with a complete set of fields at the next commit
+    bank = 1;
+    generation = JOURNAL_GENERATIONS - 1;
+    offset = JOURNAL_BANK_SIZE;
+    return(false);
+  }
+  // the banks alternate, the active one is the successor of the other
+  bank = (!valid[0] || (valid[1] && headers[1].generation == (headers[0].generation + 1) % JOURNAL_GENERATIONS)) ? 1 : 0;
+  generation = headers[bank].generation;
+
+  // replay entries until the first one that is not part of this pass (or incomplete)
+  offset = sizeof(JournalBankHeader);
+  int entries = 0;
+  while (offset + (int) sizeof(JournalEntryHeader) <= JOURNAL_BANK_SIZE) {
+    int address = getBankAddress(bank) + offset;
+    JournalEntryHeader header;
+    EEPROM.get(address, header);
+    if (header.generation != generation || offset + (int) sizeof(JournalEntryHeader) + header.size > JOURNAL_BANK_SIZE ||
+        header.check != getChecksum(&header, address + sizeof(JournalEntryHeader))) break;
+    if (header.field < fields_n && header.size == fields[header.field].size) {
+      for (int i = 0; i < header.size; i++) {
+        fields[header.field].data[i] = EEPROM.read(address + sizeof(JournalEntryHeader) + i);
+      }
+      entries++;
+    }
+    offset += sizeof(JournalEntryHeader) + header.size;
+  }
+  #ifdef STATE_DEBUG_ON
+    Serial.printf("INFO: state journal restored %d entries from bank %d (generation %d, %d bytes used)\n", entries, bank, generation, offset);
+  #endif
+  return(true);
+}
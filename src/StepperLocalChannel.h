@@ -0,0 +1,72 @@
+#pragma once
+#include "application.h"
+
+// local control channel: commands over USB serial or a TCP connection (no cloud round trip, works offline)
+// - requests are single lines:       #<seq> <command>            e.g. #12 speed 10 rpm
+// - responses echo the sequence nr:  #<seq> <return value> <data> e.g. #12 0 speed: 10 rpm
+// - requests can be pipelined (sent without waiting for the response), they are executed in order and each
+//   response carries the request's sequence nr, lines without the # prefix (e.g. serial debug output) are not part of the protocol
+#define LOCAL_CONTROL_PORT        4100 // TCP port
+#define LOCAL_REQUEST_MAX         63 // [chars] same limit as the cloud function argument
+#define LOCAL_REQUESTS_PER_UPDATE 4 // requests executed per update() and channel (the rest wait for the next loop)
+#define LOCAL_PREFIX              '#'
+
+// request errors
+#define LOCAL_RET_ERR_REQUEST   -20
+#define LOCAL_ERROR_REQUEST     "malformed or too long request"
+
+class StepperLocalChannel {
+
+  private:
+
+    Stream* stream;
+    char line[LOCAL_REQUEST_MAX + 1];
+    int length = 0;
+    bool overflow = false; // line longer than LOCAL_REQUEST_MAX
+
+  public:
+
+    StepperLocalChannel(Stream* stream) : stream(stream) {};
+
+    bool receive(); // read available bytes, true once a complete request line is buffered (other lines are skipped)
+    int parseRequest(unsigned long* seq, char** command); // split the buffered line, returns 0 or LOCAL_RET_ERR_REQUEST
+    void respond(unsigned long seq, int ret_val, const char* data);
+
+};
+
+bool StepperLocalChannel::receive() {
+  while (stream->available() > 0) {
+    int c = stream->read();
+    if (c < 0) break;
+    if (c == '\r') continue;
+    if (c == '\n') {
+      line[length] = 0;
+      bool complete = length > 0 && line[0] == LOCAL_PREFIX;
+      length = 0;
+      if (complete) return(true);
+      overflow = false;
+    } else if (length < LOCAL_REQUEST_MAX) {
+      line[length++] = c;
+    } else {
+      overflow = true;
+    }
+  }
+  return(false);
+}
+
+int StepperLocalChannel::parseRequest(unsigned long* seq, char** command) {
+  bool too_long = overflow;
+  overflow = false;
+  *seq = 0;
+  *command = nullptr;
+  char* end;
+  *seq = strtoul(line + 1, &end, 10);
+  if (end == line + 1 || *end != ' ' || too_long) return(LOCAL_RET_ERR_REQUEST);
+  while (*end == ' ') end++;
+  *command = end;
+  return(0);
+}
+
+void StepperLocalChannel::respond(unsigned long seq, int ret_val, const char* data) {
+  stream->printf("%c%lu %d %s\r\n", LOCAL_PREFIX, seq, ret_val, data);
+}
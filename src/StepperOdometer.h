@@ -0,0 +1,26 @@
+#pragma once
+#include "application.h"
+
+// persistent odometer: total distance the motor turned (in either direction)
+// counted in step engine position units (steps in the finest microstepping mode) so microstepping changes don't affect it,
+// 64 bit so it does not overflow (or lose precision) over the lifetime of a pump
+// saved in the state journal as a separate field so state version changes keep it
+#define ODOMETER_VERSION              1
+#define ODOMETER_SAVE_PERIOD          600000 // save at most this often while running [ms] (and whenever the motor stops)
+#define ODOMETER_ROTATE_SAVE_PERIOD   60000 // save at least this often during 'rotate', 'run' and 'dispense' [ms]
+#define ODOMETER_ROTATE_SAVE_FRACTION 0.01 // and whenever this fraction of the rotation was turned (resuming after a power loss overshoots by at most the unsaved travel)
+#define ODOMETER_ROTATE_SAVE_MIN      0.1 // but not more often than every this many rotations (journal wear on short rotations)
+
+struct StepperOdometer {
+  uint8_t version;
+  float units_per_rotation; // units the total was counted in (rescaled if the motor or driver configuration changes)
+  uint64_t units; // total position units turned
+
+  StepperOdometer() : version(0), units_per_rotation(0), units(0) {};
+  StepperOdometer(float units_per_rotation) : version(ODOMETER_VERSION), units_per_rotation(units_per_rotation), units(0) {};
+
+  double getRotations() {
+    return((double) units / units_per_rotation);
+  }
+
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+// loop latency profiler (compiles out completely unless STEPPER_PROFILE_ON is defined)
+// times the phases of StepperController::update() and the expensive calls on the command path in us
+#ifdef STEPPER_PROFILE_ON
+
+#include "application.h"
+#define PROFILE_SAMPLES 128 // ring buffer size per phase (p99 is taken over the most recent samples)
+
+// profiled phases
+enum ProfilePhase {
+  PROFILE_STEPPER, // stepper checks at the start of update()
+  PROFILE_STARTUP, // startup rpm logging in update()
+  PROFILE_DEVICE, // DeviceController::update() (cloud, LCD, data logging, commands)
+  PROFILE_STATE_INFO, // updateStateInformation()
+  PROFILE_LOG_RPM, // logRpm()
+  PROFILE_SAVE_DS, // state journal commits (saveDS() only queues the state)
+  PROFILE_LOCAL, // local control requests (LOCAL_CONTROL_ON)
+  PROFILE_LCD, // LCD lines pushed from the display buffer
+  PROFILE_TELEMETRY, // telemetry sampling and batches
+  PROFILE_PHASES_N
+};
+
+const char* const PROFILE_PHASE_NAMES[PROFILE_PHASES_N] = {"stepper", "startup", "device", "state info", "log rpm", "save ds", "local", "lcd", "telemetry"};
+
+struct ProfilePhaseStats {
+  unsigned long samples[PROFILE_SAMPLES]; // ring buffer of the most recent durations [us]
+  unsigned long count; // number of samples since reset
+  unsigned long min;
+  unsigned long max;
+  unsigned long long sum;
+};
+
+class StepperProfiler {
+
+  private:
+
+    ProfilePhaseStats phases[PROFILE_PHASES_N];
+
+  public:
+
+    StepperProfiler() { reset(); };
+
+    void reset() {
+      for (int i = 0; i < PROFILE_PHASES_N; i++) {
+        phases[i].count = 0;
+        phases[i].min = 0;
+        phases[i].max = 0;
+        phases[i].sum = 0;
+      }
+    }
+
+    inline void record(ProfilePhase phase, unsigned long us) {
+      ProfilePhaseStats* p = &phases[phase];
+      p->samples[p->count % PROFILE_SAMPLES] = us;
+      if (p->count == 0 || us < p->min) p->min = us;
+      if (us > p->max) p->max = us;
+      p->sum += us;
+      p->count++;
+    }
+
+    // 99th percentile of the samples in the ring buffer
+    unsigned long getP99(ProfilePhase phase) {
+      ProfilePhaseStats* p = &phases[phase];
+      int n = (p->count < PROFILE_SAMPLES) ? p->count : PROFILE_SAMPLES;
+      if (n == 0) return(0);
+      unsigned long sorted[PROFILE_SAMPLES];
+      // insertion sort (only runs when the profile is dumped)
+      for (int i = 0; i < n; i++) {
+        unsigned long value = p->samples[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > value; j--) sorted[j] = sorted[j - 1];
+        sorted[j] = value;
+      }
+      return(sorted[(n * 99) / 100]);
+    }
+
+    // print min/mean/p99/max of all phases, returns the phase with the highest maximum
+    ProfilePhase dump() {
+      ProfilePhase worst = PROFILE_STEPPER;
+      Serial.println("INFO: loop profile [us] (phase: n, min, mean, p99, max)");
+      for (int i = 0; i < PROFILE_PHASES_N; i++) {
+        ProfilePhaseStats* p = &phases[i];
+        if (p->max > phases[worst].max) worst = (ProfilePhase) i;
+        Serial.printf("   %s: %lu, %lu, %lu, %lu, %lu\n", PROFILE_PHASE_NAMES[i], p->count, p->min,
+          p->count > 0 ? (unsigned long) (p->sum / p->count) : 0, getP99((ProfilePhase) i), p->max);
+      }
+      return(worst);
+    }
+
+    unsigned long getMax(ProfilePhase phase) { return(phases[phase].max); };
+
+};
+
+#define PROFILE_BEGIN(phase)  unsigned long profile_start_##phase = micros()
+#define PROFILE_END(phase)    profiler.record(phase, micros() - profile_start_##phase)
+
+#else
+
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+
+#endif
@@ -0,0 +1,153 @@
+#pragma once
+#include "application.h"
+#include "StepperScheduler.h"
+#include "StepperEngine.h"
+
+// self-calibration of the step rate the board sustains under its actual load (cloud, LCD, local control)
+// - a probe task on the step scheduler (no pins, the same busy wait as a step pulse) runs at a test rate for a window
+//   while loop() carries on as usual, the window passes if at most STEPPER_RATE_LATE_MAX of its deadlines were missed
+//   by more than STEPPER_RATE_JITTER of the interval (at least STEP_TIMING_LATE_US)
+// - binary search from STEPPER_ENGINE_MAX_SPEED down to STEPPER_RATE_MIN, the sustainable rate is the fastest passing
+//   window (STEPPER_RATE_MIN if none passes), the controller limits the step engines to STEPPER_RATE_MARGIN of it
+// - only while no step engine is scheduled (never adds load next to a running motor): a step engine that starts
+//   during a window takes the probe out of the scheduler right away and the calibration starts over later
+// - first STEPPER_RATE_DELAY_MS after boot (cloud connected, LCD up), then every STEPPER_RATE_PERIOD_MS
+#define STEPPER_RATE_MIN          250 // [steps/s] slowest test rate
+#define STEPPER_RATE_WINDOW_MS    250 // duration of each test window
+#define STEPPER_RATE_SEARCH       6 // binary search windows after the first one (resolution (max - min) / 64)
+#define STEPPER_RATE_JITTER       0.25 // lateness relative to the interval that counts as a missed deadline
+#define STEPPER_RATE_LATE_MAX     0.01 // fraction of missed deadlines a sustainable rate may have
+#define STEPPER_RATE_MARGIN       0.8 // step engines are limited to this fraction of the sustainable rate
+#define STEPPER_RATE_DELAY_MS     5000 // [ms] after boot
+#define STEPPER_RATE_PERIOD_MS    600000 // [ms] between calibrations
+#define STEPPER_RATE_RETRY_MS     10000 // [ms] after an aborted calibration
+
+class StepperRateCalibration : public StepperSchedulerTask {
+
+  private:
+
+    // test window (modified by the interrupt)
+    volatile uint32_t interval = 0; // [us] between deadlines
+    volatile uint32_t late_limit = 0; // [us] lateness that counts as a missed deadline
+    volatile unsigned long steps = 0;
+    volatile unsigned long late = 0;
+    volatile bool aborted = false; // a step engine started
+    bool testing = false;
+    float test_rate = 0; // [steps/s]
+    unsigned long window_start = 0; // millis()
+
+    // search
+    float low = 0; // fastest passing rate [steps/s]
+    float high = 0; // slowest failing rate [steps/s]
+    uint8_t search = 0; // windows since the first one
+    unsigned long next_calibration = STEPPER_RATE_DELAY_MS; // millis()
+
+    // result
+    float rate = 0; // sustainable rate [steps/s] (0 = not calibrated yet)
+    unsigned long calibrations = 0;
+
+    void startWindow(float rate);
+    bool stopWindow(); // whether the window passed
+    void step() override; // interrupt service routine (called by the step scheduler)
+
+  public:
+
+    bool update(bool allowed); // from loop() (allowed: the pump is off or holding), true once a calibration completed
+    void abort(); // before a step engine starts (from the thread)
+    bool isTesting() { return(testing); };
+    bool isCalibrated() { return(rate > 0); };
+    float getRate() { return(rate); }; // [steps/s]
+    float getMaxSpeed() { return(rate * STEPPER_RATE_MARGIN); }; // [steps/s]
+    unsigned long getCalibrations() { return(calibrations); };
+
+};
+
+/**** SEARCH ****/
+
+bool StepperRateCalibration::update(bool allowed) {
+  if (testing) {
+    if (aborted || !allowed) {
+      abort();
+      return(false);
+    }
+    if (millis() - window_start < STEPPER_RATE_WINDOW_MS) return(false);
+    if (stopWindow()) low = test_rate;
+    else high = test_rate;
+    if (low >= STEPPER_ENGINE_MAX_SPEED || search >= STEPPER_RATE_SEARCH) {
+      rate = low;
+      calibrations++;
+      next_calibration = millis() + STEPPER_RATE_PERIOD_MS;
+      return(true);
+    }
+    search++;
+    startWindow((low + high) / 2);
+    return(false);
+  }
+
+  // nothing else on the step scheduler
+  if (!allowed || stepper_scheduler.getTasks() > 0 || (long) (millis() - next_calibration) < 0) return(false);
+  low = STEPPER_RATE_MIN;
+  high = STEPPER_ENGINE_MAX_SPEED;
+  search = 0;
+  startWindow(high);
+  return(false);
+}
+
+void StepperRateCalibration::abort() {
+  if (!testing) return;
+  noInterrupts();
+  stepper_scheduler.remove(this);
+  interrupts();
+  testing = false;
+  next_calibration = millis() + STEPPER_RATE_RETRY_MS;
+  #ifdef STEPPER_DEBUG_ON
+    Serial.println("INFO: step rate calibration aborted (step engine started)");
+  #endif
+}
+
+/**** TEST WINDOW ****/
+
+void StepperRateCalibration::startWindow(float rate) {
+  test_rate = rate;
+  uint32_t us = lround(1.0e6 / rate);
+  uint32_t limit = lround(STEPPER_RATE_JITTER * us);
+  noInterrupts();
+  interval = us;
+  late_limit = (limit > STEP_TIMING_LATE_US) ? limit : STEP_TIMING_LATE_US;
+  steps = 0;
+  late = 0;
+  aborted = false;
+  next_step = micros() + us;
+  stepper_scheduler.add(this);
+  interrupts();
+  testing = true;
+  window_start = millis();
+}
+
+bool StepperRateCalibration::stopWindow() {
+  noInterrupts();
+  stepper_scheduler.remove(this);
+  interrupts();
+  testing = false;
+  bool passed = steps > 0 && late <= STEPPER_RATE_LATE_MAX * steps;
+  #ifdef STEPPER_DEBUG_ON
+    Serial.printf("INFO: step rate calibration at %.0f steps/s: %lu/%lu missed deadlines (%s)\n", test_rate, late, steps, passed ? "pass" : "fail");
+  #endif
+  return(passed);
+}
+
+/**** INTERRUPT ****/
+
+void StepperRateCalibration::step() {
+  // a step engine started: out of its way right away
+  if (stepper_scheduler.getTasks() > 1) {
+    stepper_scheduler.remove(this);
+    aborted = true;
+    return;
+  }
+  if (micros() - next_step > late_limit) late++;
+  steps++;
+  delayMicroseconds(STEPPER_ENGINE_PULSE_WIDTH);
+  next_step += interval;
+  stepper_scheduler.update(this);
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include "application.h"
+#include "SparkIntervalTimer.h"
+
+// step scheduler: one timer interrupt serves the step engines of all motor channels
+// - scheduled tasks (step engines) are kept in a min-heap by the deadline of their next step and the timer is programmed
+//   for the earliest one, adding, removing and rescheduling a task is O(log n)
+// - each interrupt runs the due tasks earliest deadline first, at most as many as there are tasks (bounded cost per
+//   interrupt no matter how late it is, a task that is still due after that runs after the minimum period)
+// - deadlines are micros() values compared modulo 2^32 (all within ~35 minutes of each other)
+#define STEPPER_SCHEDULER_TASKS_MAX   4
+#define STEPPER_SCHEDULER_MAX_PERIOD  50000 // longest single timer period in us (timer periods are 16 bit), longer waits take multiple periods
+#define STEPPER_SCHEDULER_MIN_PERIOD  10 // shortest timer period in us (when catching up after a late step)
+
+// task served by the scheduler (the step engine)
+class StepperSchedulerTask {
+
+  friend class StepperScheduler;
+
+  protected:
+
+    volatile uint32_t next_step = 0; // micros() when the next step is due
+    volatile int8_t heap_index = -1; // position in the scheduler's heap (-1 = not scheduled)
+    virtual void step() = 0; // called from the interrupt once due, reschedules or removes the task
+
+};
+
+class StepperScheduler {
+
+  private:
+
+    // interrupt
+    IntervalTimer timer;
+    static StepperScheduler* instance; // scheduler served by the timer interrupt
+    static void timerISR() { instance->run(); };
+    volatile bool timer_running = false;
+    volatile bool in_run = false; // timer is reprogrammed once all due tasks ran
+
+    // min-heap of the scheduled tasks by next step deadline
+    StepperSchedulerTask* heap[STEPPER_SCHEDULER_TASKS_MAX];
+    volatile uint8_t heap_n = 0;
+
+    static bool isBefore(StepperSchedulerTask* a, StepperSchedulerTask* b) { return((int32_t) (a->next_step - b->next_step) < 0); };
+    void place(uint8_t i, StepperSchedulerTask* task);
+    void siftUp(uint8_t i);
+    void siftDown(uint8_t i);
+    void program(); // program the timer for the earliest deadline (stop it if there is none)
+    void run(); // interrupt service routine
+
+  public:
+
+    // to be called with interrupts disabled (or from the interrupt)
+    bool add(StepperSchedulerTask* task); // schedule at task->next_step (reschedule if already scheduled), false if all slots are taken
+    void remove(StepperSchedulerTask* task);
+    void update(StepperSchedulerTask* task); // after the task's next_step changed
+    uint8_t getTasks() { return(heap_n); };
+
+};
+
+StepperScheduler* StepperScheduler::instance = nullptr;
+
+// shared by all step engines
+StepperScheduler stepper_scheduler;
+
+/**** HEAP ****/
+
+void StepperScheduler::place(uint8_t i, StepperSchedulerTask* task) {
+  heap[i] = task;
+  task->heap_index = i;
+}
+
+void StepperScheduler::siftUp(uint8_t i) {
+  StepperSchedulerTask* task = heap[i];
+  while (i > 0 && isBefore(task, heap[(i - 1) / 2])) {
+    place(i, heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  place(i, task);
+}
+
+void StepperScheduler::siftDown(uint8_t i) {
+  StepperSchedulerTask* task = heap[i];
+  while (2 * i + 1 < heap_n) {
+    uint8_t child = 2 * i + 1;
+    if (child + 1 < heap_n && isBefore(heap[child + 1], heap[child])) child++;
+    if (!isBefore(heap[child], task)) break;
+    place(i, heap[child]);
+    i = child;
+  }
+  place(i, task);
+}
+
+bool StepperScheduler::add(StepperSchedulerTask* task) {
+  if (task->heap_index >= 0) {
+    update(task);
+    return(true);
+  }
+  if (heap_n >= STEPPER_SCHEDULER_TASKS_MAX) return(false);
+  place(heap_n, task);
+  heap_n++;
+  siftUp(heap_n - 1);
+  program();
+  return(true);
+}
+
+void StepperScheduler::remove(StepperSchedulerTask* task) {
+  if (task->heap_index < 0) return;
+  uint8_t i = task->heap_index;
+  task->heap_index = -1;
+  heap_n--;
+  if (i < heap_n) {
+    // last task fills the gap
+    StepperSchedulerTask* last = heap[heap_n];
+    place(i, last);
+    siftUp(i);
+    siftDown(last->heap_index);
+  }
+  program();
+}
+
+void StepperScheduler::update(StepperSchedulerTask* task) {
+  if (task->heap_index < 0) return;
+  siftUp(task->heap_index);
+  siftDown(task->heap_index);
+  program();
+}
+
+/**** INTERRUPT ****/
+
+// in chunks of at most STEPPER_SCHEDULER_MAX_PERIOD
+void StepperScheduler::program() {
+  if (in_run) return;
+  if (heap_n == 0) {
+    if (timer_running) {
+      timer.end();
+      timer_running = false;
+    }
+    return;
+  }
+  int32_t remaining = heap[0]->next_step - micros();
+  uint32_t period = (remaining > STEPPER_SCHEDULER_MIN_PERIOD) ? remaining : STEPPER_SCHEDULER_MIN_PERIOD;
+  if (period > STEPPER_SCHEDULER_MAX_PERIOD) period = STEPPER_SCHEDULER_MAX_PERIOD;
+  if (timer_running) {
+    timer.resetPeriod_SIT(period, uSec);
+  } else {
+    instance = this;
+    timer_running = true;
+    timer.begin(timerISR, period, uSec);
+  }
+}
+
+void StepperScheduler::run() {
+  in_run = true;
+  for (uint8_t budget = heap_n; budget > 0 && heap_n > 0; budget--) {
+    StepperSchedulerTask* task = heap[0];
+    if ((int32_t) (task->next_step - micros()) > 0) break;
+    task->step();
+  }
+  in_run = false;
+  program();
+}
@@ -9,9 +9,92 @@
 #define STATUS_HOLD      3
 #define STATUS_MANUAL    4
 #define STATUS_ROTATE    5
-#define STATUS_TRIGGER   6 // TODO: implement signal triggering mode
-#define STEP_FLOW_UNDEF -1
-#define STATE_ADDRESS    0 // EEPROM storage location
+#define STATUS_TRIGGER   6 // started / stopped by the external trigger input (see StepperTrigger)
+#define STATUS_RUN       7 // running for a set time (executed like 'rotate', see StepperRotation)
+#define STATUS_PROGRAM   8 // executing the speed program (see StepperProgram)
+#define STEP_FLOW_UNDEF  0 // no step-flow calibration
+#define STEP_FLOW_SCALE  1e12 // step-flow is stored as an integer in 1e-12 volume units per position unit
+#define STATE_ADDRESS    0 // EEPROM storage location of the state before the state journal (read once when upgrading)
+
+// step-flow calibration (persisted as a separate state journal field so state version changes keep it)
+// integer volume per position unit (step in the finest microstepping mode) so volumes convert to exact step counts
+struct StepperCalibration {
+  uint64_t unit_flow; // volume per position unit [1 / STEP_FLOW_SCALE volume units] (STEP_FLOW_UNDEF = not calibrated)
+  char units[8]; // volume units (e.g. "mL")
+
+  StepperCalibration() : unit_flow(STEP_FLOW_UNDEF) { units[0] = 0; };
+
+  bool isCalibrated() { return(unit_flow != STEP_FLOW_UNDEF); };
+
+  // set from a volume per number of position units (false if the result is not a valid calibration)
+  bool setFlow(double volume, double per_units, const char* volume_units) {
+    double unit_flow = volume * STEP_FLOW_SCALE / per_units;
+    if (!(unit_flow >= 1.0 && unit_flow < 1.8e19) || volume_units[0] == 0) return(false);
+    this->unit_flow = (uint64_t) (unit_flow + 0.5);
+    strncpy(units, volume_units, sizeof(units) - 1);
+    units[sizeof(units) - 1] = 0;
+    return(true);
+  }
+
+  // position units for a volume (rounded to the nearest unit)
+  uint64_t getUnits(double volume) {
+    uint64_t scaled = (uint64_t) (volume * STEP_FLOW_SCALE + 0.5);
+    return((scaled + unit_flow / 2) / unit_flow);
+  }
+
+  double getVolume(uint64_t units) {
+    return((double) units * unit_flow / STEP_FLOW_SCALE);
+  }
+
+};
+
+// active 'rotate', 'dispense' or 'run' (persisted as a separate state journal field to resume it after a power loss)
+// a 'run' is the duration at the current speed as a number of position units (rescaled when the speed changes)
+struct StepperRotation {
+  uint64_t end; // odometer units at which it completes
+  uint64_t units; // position units in total
+  float rpm_after; // speed to return to once complete ('dispense' runs at the maximum speed), < 0 to keep the speed
+  bool dispense; // whether to report the dispensed volume once complete
+  float minutes; // duration of a 'run' (0 for 'rotate' and 'dispense')
+  bool reverse; // against the direction setting (negative 'rotate')
+
+  StepperRotation() : end(0), units(0), rpm_after(-1), dispense(false), minutes(0), reverse(false) {};
+};
+
+// external trigger ('auto', persisted as a separate state journal field)
+#define TRIGGER_GATE     1 // run while the trigger input is high
+#define TRIGGER_DOSE     2 // rotate by a fixed dose on every rising edge (edges during a dose extend it)
+
+struct StepperTrigger {
+  uint8_t mode; // TRIGGER_GATE or TRIGGER_DOSE
+  float rotations; // dose per rising edge
+
+  StepperTrigger() : mode(TRIGGER_GATE), rotations(0) {};
+
+  bool isValid() { return(mode == TRIGGER_GATE || (mode == TRIGGER_DOSE && rotations > 0)); };
+};
+
+// speed program ('program', persisted as a separate state journal field so it can be started again without loading it)
+// segments run one after the other: speed (sign relative to the direction setting, 0 holds position) for a number of
+// minutes or rotations, reached at the motor's acceleration limit or in a linear ramp over the whole segment
+#define PROGRAM_SEGMENTS_MAX  8
+#define PROGRAM_ROTATIONS     1 // length in rotations (minutes otherwise)
+#define PROGRAM_RAMP          2 // linear ramp from the previous segment's speed over the segment
+
+struct StepperProgramSegment {
+  float rpm; // < 0: against the direction setting, 0: hold
+  float length; // minutes or rotations
+  uint8_t flags; // PROGRAM_ROTATIONS, PROGRAM_RAMP
+};
+
+struct StepperProgram {
+  uint8_t n; // number of segments
+  StepperProgramSegment segments[PROGRAM_SEGMENTS_MAX];
+
+  StepperProgram() : n(0) {};
+
+  bool isValid() { return(n <= PROGRAM_SEGMENTS_MAX); };
+};
 
 /**** textual translations of state values ****/
 
@@ -45,7 +128,9 @@ const StepperStateInfo STATUS_INFO[] = {
    {STATUS_HOLD, "hold", "holding position"},
    {STATUS_MANUAL, "man", "manual mode"},
    {STATUS_ROTATE, "rot", "executing number of rotations"},
-   {STATUS_TRIGGER, "trig", "triggered by external signal"}
+   {STATUS_TRIGGER, "trig", "triggered by external signal"},
+   {STATUS_RUN, "run", "running for a set time"},
+   {STATUS_PROGRAM, "prog", "executing speed program"}
 };
 
 const StepperStateInfo DIR_INFO[] = {
@@ -105,3 +190,111 @@ static void getStepperStateMSInfo(bool ms_auto, int ms_mode, char* target, int s
   if (value_only) getStepperStateMSInfo(ms_auto, ms_mode, target, size, PATTERN_V_SIMPLE, false);
   else getStepperStateMSInfo(ms_auto, ms_mode, target, size, PATTERN_KV_JSON_QUOTED, true);
 }
+
+// odometer (total rotations)
+static void getStepperStateOdometerInfo(double rotations, char* target, int size, char* pattern, bool include_key = true) {
+  getStateDoubleText("odo", rotations, "rot", target, size, pattern, 1, include_key);
+}
+
+static void getStepperStateOdometerInfo(double rotations, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateOdometerInfo(rotations, target, size, PATTERN_VU_SIMPLE, false);
+  else getStepperStateOdometerInfo(rotations, target, size, PATTERN_KVU_JSON_QUOTED, true);
+}
+
+// step timing (missed deadlines / measured steps and worst lateness)
+static void getStepperStateTimingInfo(unsigned long late, unsigned long steps, unsigned long max_late, char* target, int size, char* pattern, bool include_key = true) {
+  char timing_text[30];
+  snprintf(timing_text, sizeof(timing_text), "%lu/%lu<%luus", late, steps, max_late);
+  getStateStringText("late", timing_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateTimingInfo(unsigned long late, unsigned long steps, unsigned long max_late, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateTimingInfo(late, steps, max_late, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateTimingInfo(late, steps, max_late, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// timed run (elapsed and remaining minutes)
+static void getStepperStateRunInfo(double elapsed, double remaining, char* target, int size, char* pattern, bool include_key = true) {
+  char run_text[30];
+  snprintf(run_text, sizeof(run_text), "%.2fmin, %.2fmin left", elapsed, remaining);
+  getStateStringText("run", run_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateRunInfo(double elapsed, double remaining, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateRunInfo(elapsed, remaining, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateRunInfo(elapsed, remaining, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// speed program (active segment / segments and its progress)
+static void getStepperStateProgramInfo(int segment, int segments, double progress, char* target, int size, char* pattern, bool include_key = true) {
+  char program_text[30];
+  snprintf(program_text, sizeof(program_text), "%d/%d, %.0f%%", segment, segments, 100 * progress);
+  getStateStringText("prog", program_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateProgramInfo(int segment, int segments, double progress, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateProgramInfo(segment, segments, progress, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateProgramInfo(segment, segments, progress, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// external trigger (mode, dose and worst trigger to first step latency)
+static void getStepperStateTriggerInfo(uint8_t mode, float rotations, unsigned long max_latency, char* target, int size, char* pattern, bool include_key = true) {
+  char trigger_text[30];
+  if (mode == TRIGGER_DOSE) snprintf(trigger_text, sizeof(trigger_text), "dose %.3grot <%luus", rotations, max_latency);
+  else snprintf(trigger_text, sizeof(trigger_text), "gate <%luus", max_latency);
+  getStateStringText("trig", trigger_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateTriggerInfo(uint8_t mode, float rotations, unsigned long max_latency, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateTriggerInfo(mode, rotations, max_latency, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateTriggerInfo(mode, rotations, max_latency, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// closed loop encoder (stall reaction, worst following error / tolerance and detected stalls)
+static void getStepperStateEncoderInfo(char* mode, long max_error, int tolerance, unsigned long stalls, char* target, int size, char* pattern, bool include_key = true) {
+  char encoder_text[30];
+  snprintf(encoder_text, sizeof(encoder_text), "%s %ld/%dcnt, %lu stalls", mode, max_error, tolerance, stalls);
+  getStateStringText("enc", encoder_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateEncoderInfo(char* mode, long max_error, int tolerance, unsigned long stalls, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateEncoderInfo(mode, max_error, tolerance, stalls, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateEncoderInfo(mode, max_error, tolerance, stalls, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// step rate limit / sustainable rate measured by the self-calibration (0: not calibrated yet) and full step rpm limit
+static void getStepperStateLimitInfo(float max_speed, float rate, float rpm_limit, char* target, int size, char* pattern, bool include_key = true) {
+  char limit_text[30];
+  if (rate > 0) snprintf(limit_text, sizeof(limit_text), "%.0f/%.0fsps, %.1frpm", max_speed, rate, rpm_limit);
+  else snprintf(limit_text, sizeof(limit_text), "%.0fsps board, %.1frpm", max_speed, rpm_limit);
+  getStateStringText("limit", limit_text, target, size, pattern, include_key);
+}
+
+static void getStepperStateLimitInfo(float max_speed, float rate, float rpm_limit, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateLimitInfo(max_speed, rate, rpm_limit, target, size, PATTERN_V_SIMPLE, false);
+  else getStepperStateLimitInfo(max_speed, rate, rpm_limit, target, size, PATTERN_KV_JSON_QUOTED, true);
+}
+
+// step-flow calibration (volume per rotation)
+static void getStepperStateCalibrationInfo(double rotation_flow, char* units, char* target, int size, char* pattern, bool include_key = true) {
+  char flow_units[20];
+  snprintf(flow_units, sizeof(flow_units), "%s/rot", units);
+  int decimals = find_signif_decimals(rotation_flow, 4, true, 6); // 4 significant digits by default, max 6 after decimals
+  getStateDoubleText("calib", rotation_flow, flow_units, target, size, pattern, decimals, include_key);
+}
+
+static void getStepperStateCalibrationInfo(double rotation_flow, char* units, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateCalibrationInfo(rotation_flow, units, target, size, PATTERN_VU_SIMPLE, false);
+  else getStepperStateCalibrationInfo(rotation_flow, units, target, size, PATTERN_KVU_JSON_QUOTED, true);
+}
+
+// volume (total pumped or last dispensed)
+static void getStepperStateVolumeInfo(char* key, double volume, char* units, char* target, int size, char* pattern, bool include_key = true) {
+  int decimals = find_signif_decimals(volume, 4, true, 3); // 4 significant digits by default, max 3 after decimals
+  getStateDoubleText(key, volume, units, target, size, pattern, decimals, include_key);
+}
+
+static void getStepperStateVolumeInfo(char* key, double volume, char* units, char* target, int size, bool value_only = false) {
+  if (value_only) getStepperStateVolumeInfo(key, volume, units, target, size, PATTERN_VU_SIMPLE, false);
+  else getStepperStateVolumeInfo(key, volume, units, target, size, PATTERN_KVU_JSON_QUOTED, true);
+}
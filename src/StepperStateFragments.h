@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+// cached serialized state fragments: json key-value pair (state information) and value text (LCD) per state field
+// - fragments are only reformatted after they were invalidated (state changes), unchanged fields are spliced in as is
+// - empty json fragments (e.g. no calibration) are left out of the state information
+#define STATE_FRAGMENT_JSON_SIZE  60
+#define STATE_FRAGMENT_TEXT_SIZE  21 // LCD line
+
+enum StateFragment {
+  FRAGMENT_STATUS,
+  FRAGMENT_DIR,
+  FRAGMENT_SPEED,
+  FRAGMENT_MS,
+  FRAGMENT_ODO,
+  FRAGMENT_CALIB,
+  FRAGMENT_VOL,
+  FRAGMENT_DISP,
+  FRAGMENT_LATE,
+  FRAGMENT_TRIG,
+  FRAGMENT_RUN,
+  FRAGMENT_ENC,
+  FRAGMENT_LIMIT,
+  FRAGMENT_PROG,
+  FRAGMENTS_N
+};
+
+#define FRAGMENT_BIT(fragment) ((uint16_t) 1 << (fragment))
+#define FRAGMENTS_STATE (FRAGMENT_BIT(FRAGMENT_STATUS) | FRAGMENT_BIT(FRAGMENT_DIR) | FRAGMENT_BIT(FRAGMENT_SPEED) | FRAGMENT_BIT(FRAGMENT_MS) | FRAGMENT_BIT(FRAGMENT_TRIG) | FRAGMENT_BIT(FRAGMENT_RUN) | FRAGMENT_BIT(FRAGMENT_PROG)) // persisted state (saveDS(), trigger, run and program are only listed in their modes)
+#define FRAGMENTS_CALIB (FRAGMENT_BIT(FRAGMENT_CALIB) | FRAGMENT_BIT(FRAGMENT_VOL) | FRAGMENT_BIT(FRAGMENT_DISP)) // depend on the calibration
+#define FRAGMENTS_ALL   (FRAGMENT_BIT(FRAGMENTS_N) - 1)
+
+class StepperStateFragments {
+
+  private:
+
+    uint16_t dirty = FRAGMENTS_ALL; // bit per fragment
+    char json[FRAGMENTS_N][STATE_FRAGMENT_JSON_SIZE];
+    char text[FRAGMENTS_N][STATE_FRAGMENT_TEXT_SIZE];
+
+  public:
+
+    void invalidate(uint16_t fragments) { dirty |= fragments; };
+    // whether the fragment needs to be reformatted (counts as up to date afterwards)
+    bool refresh(StateFragment fragment) {
+      if (!(dirty & FRAGMENT_BIT(fragment))) return(false);
+      dirty &= ~FRAGMENT_BIT(fragment);
+      json[fragment][0] = 0;
+      text[fragment][0] = 0;
+      return(true);
+    };
+    char* getJson(StateFragment fragment) { return(json[fragment]); };
+    char* getText(StateFragment fragment) { return(text[fragment]); };
+
+};
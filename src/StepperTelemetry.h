@@ -0,0 +1,122 @@
+#pragma once
+#include "application.h"
+
+// telemetry: the actual motion sampled at a fixed period into a RAM ring buffer and flushed in delta/varint encoded batches
+// - sample: time [us], position [units], missed step deadlines (count) and the longest gap between loop() calls since the previous sample [us]
+//   (the actual step rate is the position change over the time between two samples)
+// - batch (bytes, sent as base64 text): varint format, varint sequence nr of the first sample (gaps = dropped samples), varint period [us],
+//   the first sample as varint time, zigzag varint position, varint late, varint lag,
+//   then each further sample as zigzag varint (time delta - period), zigzag varint (position delta - previous position delta),
+//   varint late delta and varint lag (constant speed at the nominal period encodes in ~5 bytes per sample)
+// - the oldest samples are overwritten if the batches are not flushed in time (counted as dropped)
+#define TELEMETRY_FORMAT          1
+#define TELEMETRY_SAMPLES         128 // ring buffer size
+#define TELEMETRY_PERIOD_MS       100 // default sampling period
+#define TELEMETRY_PERIOD_MIN_MS   10
+#define TELEMETRY_BATCH_SAMPLES   32 // flush once this many samples are buffered
+#define TELEMETRY_BATCH_MAX       450 // [bytes] per batch (base64 of it fits into one Particle event)
+#define TELEMETRY_SAMPLE_MAX      20 // [bytes] encoded sample (4 varints)
+
+struct TelemetrySample {
+  uint32_t time; // micros()
+  int32_t position; // [units]
+  uint32_t late; // missed step deadlines since boot
+  uint32_t lag; // longest loop() gap [us]
+};
+
+class StepperTelemetry {
+
+  private:
+
+    TelemetrySample samples[TELEMETRY_SAMPLES];
+    uint16_t first = 0; // oldest buffered sample
+    uint16_t count = 0;
+    uint32_t seq = 0; // sequence nr of the oldest buffered sample
+    unsigned long dropped = 0;
+
+    static int putVarint(uint8_t* target, uint32_t value);
+    static uint32_t zigzag(int32_t value) { return(((uint32_t) value << 1) ^ (uint32_t) (value >> 31)); };
+
+  public:
+
+    void clear() { seq += count; count = 0; };
+    void add(uint32_t time, int32_t position, uint32_t late, uint32_t lag);
+    int getCount() { return(count); };
+    unsigned long getDropped() { return(dropped); };
+
+    // encode (and remove) the oldest samples into a batch of at most size bytes, returns the batch size
+    int encode(uint8_t* target, int size, uint32_t period_us);
+    static int toBase64(const uint8_t* data, int n, char* target, int size); // returns the text length (0 if it does not fit)
+
+};
+
+void StepperTelemetry::add(uint32_t time, int32_t position, uint32_t late, uint32_t lag) {
+  if (count == TELEMETRY_SAMPLES) {
+    // full: overwrite the oldest
+    first = (first + 1) % TELEMETRY_SAMPLES;
+    count--;
+    seq++;
+    dropped++;
+  }
+  TelemetrySample* sample = &samples[(first + count) % TELEMETRY_SAMPLES];
+  sample->time = time;
+  sample->position = position;
+  sample->late = late;
+  sample->lag = lag;
+  count++;
+}
+
+int StepperTelemetry::putVarint(uint8_t* target, uint32_t value) {
+  int n = 0;
+  while (value >= 0x80) {
+    target[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  target[n++] = value;
+  return(n);
+}
+
+int StepperTelemetry::encode(uint8_t* target, int size, uint32_t period_us) {
+  if (count == 0 || size < 3 * 5 + TELEMETRY_SAMPLE_MAX) return(0);
+  int n = putVarint(target, TELEMETRY_FORMAT);
+  n += putVarint(target + n, seq);
+  n += putVarint(target + n, period_us);
+  TelemetrySample* previous = &samples[first];
+  n += putVarint(target + n, previous->time);
+  n += putVarint(target + n, zigzag(previous->position));
+  n += putVarint(target + n, previous->late);
+  n += putVarint(target + n, previous->lag);
+  int encoded = 1;
+  int32_t previous_delta = 0;
+  while (encoded < count && n + TELEMETRY_SAMPLE_MAX <= size) {
+    TelemetrySample* sample = &samples[(first + encoded) % TELEMETRY_SAMPLES];
+    int32_t delta = (uint32_t) sample->position - (uint32_t) previous->position;
+    n += putVarint(target + n, zigzag((int32_t) (sample->time - previous->time - period_us)));
+    n += putVarint(target + n, zigzag((int32_t) ((uint32_t) delta - (uint32_t) previous_delta)));
+    n += putVarint(target + n, sample->late - previous->late);
+    n += putVarint(target + n, sample->lag);
+    previous_delta = delta;
+    previous = sample;
+    encoded++;
+  }
+  first = (first + encoded) % TELEMETRY_SAMPLES;
+  count -= encoded;
+  seq += encoded;
+  return(n);
+}
+
+int StepperTelemetry::toBase64(const uint8_t* data, int n, char* target, int size) {
+  static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int length = (n + 2) / 3 * 4;
+  if (length + 1 > size) return(0);
+  char* c = target;
+  for (int i = 0; i < n; i += 3) {
+    uint32_t bits = (uint32_t) data[i] << 16 | (i + 1 < n ? (uint32_t) data[i + 1] << 8 : 0) | (i + 2 < n ? data[i + 2] : 0);
+    *c++ = digits[(bits >> 18) & 0x3f];
+    *c++ = digits[(bits >> 12) & 0x3f];
+    *c++ = (i + 1 < n) ? digits[(bits >> 6) & 0x3f] : '=';
+    *c++ = (i + 2 < n) ? digits[bits & 0x3f] : '=';
+  }
+  *c = 0;
+  return(length);
+}
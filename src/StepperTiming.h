@@ -0,0 +1,48 @@
+#pragma once
+#include "application.h"
+
+// step timing statistics: deviation of each step interval from the ideal interval
+// recorded from the step interrupt, so recording has to stay at a handful of instructions
+#define STEP_TIMING_BUCKETS   16 // log2 buckets: 0us, 1us, 2-3us, 4-7us, ... >= 16.4ms
+#define STEP_TIMING_LATE_US   20 // steps later than this count as missed deadlines
+
+struct StepTimingStats {
+  volatile unsigned long steps; // number of measured step intervals
+  volatile unsigned long late; // number of steps that missed their deadline by more than STEP_TIMING_LATE_US
+  volatile unsigned long max_late; // worst lateness [us]
+  volatile unsigned long max_early; // worst earliness [us]
+  volatile unsigned long histogram[STEP_TIMING_BUCKETS]; // counts of |deviation| in log2 buckets
+
+  StepTimingStats() { reset(); };
+
+  void reset() {
+    steps = 0;
+    late = 0;
+    max_late = 0;
+    max_early = 0;
+    for (int i = 0; i < STEP_TIMING_BUCKETS; i++) histogram[i] = 0;
+  }
+
+  // record a step interval against the ideal interval
+  inline void record(unsigned long interval, unsigned long ideal) {
+    unsigned long deviation;
+    if (interval >= ideal) {
+      deviation = interval - ideal;
+      if (deviation > max_late) max_late = deviation;
+      if (deviation > STEP_TIMING_LATE_US) late++;
+    } else {
+      deviation = ideal - interval;
+      if (deviation > max_early) max_early = deviation;
+    }
+    int bucket = (deviation == 0) ? 0 : 32 - __builtin_clz(deviation);
+    if (bucket >= STEP_TIMING_BUCKETS) bucket = STEP_TIMING_BUCKETS - 1;
+    histogram[bucket]++;
+    steps++;
+  }
+
+  // lower bound of a histogram bucket [us]
+  static unsigned long getBucketStart(int bucket) {
+    return(bucket == 0 ? 0 : 1UL << (bucket - 1));
+  }
+
+};
@@ -9,10 +9,14 @@
 //#define SERIAL_DEBUG_ON
 //#define LCD_DEBUG_ON
 #define STEPPER_DEBUG_ON
+//#define STEPPER_PROFILE_ON // loop latency profiler ('profile' command)
+#define LOCAL_CONTROL_ON // local control over USB serial and TCP (see StepperLocalChannel.h)
+//#define SECOND_PUMP_HEAD // second pump head as motor channel 2 ('ch 2 ...' commands, see StepperChannel.h)
+//#define ENCODER_FEEDBACK // closed loop encoder on the pump head's motor ('encoder' command, see StepperEncoder.h), uses the second pump head's pins
 
 // keep track of installed version
 #define STATE_VERSION    4 // change whenver StepperState structure changes
-#define DEVICE_VERSION  "pump 0.4.4" // update with every code update
+#define DEVICE_VERSION  "pump 0.5.0" // update with every code update
 
 // M800 controller
 #include "StepperController.h"
@@ -21,13 +25,13 @@
 DeviceDisplay* lcd = &LCD_20x4;
 
 // board
-StepperBoard* board = &PHOTON_STEPPER_BOARD;
+const StepperBoard* board = &PHOTON_STEPPER_BOARD;
 
 // driver
-StepperDriver* driver = &DRV8825;
+const StepperDriver* driver = &DRV8825;
 
 // motor
-StepperMotor* motor = &WM114ST;
+const StepperMotor* motor = &WM114ST;
 
 // initial state
 StepperState* state = new StepperState(
@@ -52,6 +56,24 @@ StepperController* pump = new StepperController(
   /* pointer to state */  state
 );
 
+// second pump head (own board pins, driver, motor and state)
+#ifdef SECOND_PUMP_HEAD
+StepperChannel* head2 = new StepperChannel(
+  /* pointer to board */  &PHOTON_STEPPER_BOARD_2,
+  /* pointer to driver */ &DRV8825,
+  /* pointer to motor */  &WM114ST,
+  /* pointer to state */  new StepperState(false, true, false, 3600, LOG_BY_TIME, DIR_CW, STATUS_OFF, 1)
+);
+#endif
+
+// closed loop feedback (stalls and slip back off the speed)
+#if defined(ENCODER_FEEDBACK) && defined(SECOND_PUMP_HEAD)
+#error "the encoder and the second pump head share pins A0 and A1"
+#endif
+#ifdef ENCODER_FEEDBACK
+StepperEncoder* encoder = new StepperEncoder(&PHOTON_ENCODER_400);
+#endif
+
 // using system threading to improve timely stepper stepping
 SYSTEM_THREAD(ENABLED);
 SYSTEM_MODE(SEMI_AUTOMATIC);
@@ -65,6 +87,12 @@ void setup() {
   lcd->setTempTextShowTime(3); // how many seconds temp time
 
   // controller
+  #ifdef SECOND_PUMP_HEAD
+    pump->addChannel(head2);
+  #endif
+  #ifdef ENCODER_FEEDBACK
+    pump->addEncoder(encoder, ENCODER_BACKOFF);
+  #endif
   pump->init();
 
   // connect device to cloud
@@ -76,17 +104,3 @@ void setup() {
 void loop() {
   pump->update();
 }
-
-
-/*
-// maybe test this more
-// might need a system where every line of LCD screen gets stored in a String
-// and then only updated in the separate threat whenever necessary
-led1Thread = new Thread("sample", test_lcd);
-Thread* led1Thread;
-
-os_thread_return_t test_lcd(){
-    for(;;) {
-        lcd.update();
-    }
-}*/